@@ -117,6 +117,35 @@ pixel2lat(  float zoom,
     return lat;
 }
 
+void
+latlon2world(float lat,
+             float lon,
+             double *world_x,
+             double *world_y)
+{
+    /* lon2pixel and lat2pixel at zoom 0, divided by TILESIZE */
+    *world_x = lon / (2*M_PI) + 0.5;
+    *world_y = 0.5 - atanh(sin(lat)) / (2*M_PI);
+}
+
+void
+world2pixel(int zoom,
+            const double *world,
+            unsigned int n,
+            double offset_x,
+            double offset_y,
+            double *pixel)
+{
+    const double scale = (double)TILESIZE * (1 << zoom);
+    unsigned int i;
+
+    /* kept trivial, so that the compiler can vectorize it */
+    for (i = 0; i < n; i++) {
+        pixel[2*i] = world[2*i] * scale - offset_x;
+        pixel[2*i+1] = world[2*i+1] * scale - offset_y;
+    }
+}
+
 int
 latlon2zoom(int pix_height,
 	    int pix_width,
@@ -43,6 +43,24 @@ float
 pixel2lat(  float zoom,
             int pixel_y);
 
+/* Mercator position, 0 to 1 across the whole map at any zoom, so that a
+ * pixel position is just a scale and an offset away */
+void
+latlon2world(float lat,
+             float lon,
+             double *world_x,
+             double *world_y);
+
+/* n world positions, x and y interleaved, to pixels at zoom less
+ * offset_x,y. world and pixel may be the same array */
+void
+world2pixel(int zoom,
+            const double *world,
+            unsigned int n,
+            double offset_x,
+            double offset_y,
+            double *pixel);
+
 int
 latlon2zoom(int pix_height,
             int pix_width,
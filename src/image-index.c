@@ -0,0 +1,380 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <glib.h>
+
+#include "private.h"
+#include "image-index.h"
+#include "tile-index.h"
+
+/*
+ * The map is split into a grid of CELLS x CELLS, in latlon2world()
+ * coordinates, and each image is put in the cell its point is in. That
+ * is a few hundred pixels across at the highest zooms. Only cells holding
+ * images are stored, so when zoomed out and more cells are visible than
+ * hold images, those holding images are walked instead.
+ */
+#define CELL_BITS   16
+#define CELLS       (1 << CELL_BITS)
+
+typedef struct {
+    OsmGpsMapImage *image;
+    double world[2];
+    /* how far from its point the image may reach, rotated, in pixels */
+    int pad;
+    int zorder;
+    /* when added, to keep images of the same z-order in that order */
+    guint64 seq;
+    guint cell;
+} OsmImageIndexEntry;
+
+/* The images in one OSM_IMAGE_CLUSTER_SIZE square at one zoom */
+typedef struct {
+    guint count;
+    double world_sum[2];
+    /* all the entries in the square xor'ed together, so that when only
+     * one is left it is this */
+    guintptr entries_xor;
+} OsmImageIndexCluster;
+
+struct _OsmImageIndex
+{
+    /* image to OsmImageIndexEntry */
+    GHashTable *entries;
+    /* cell to GPtrArray of OsmImageIndexEntry */
+    GHashTable *cells;
+    guint64 next_seq;
+    /* the largest pad of any image added since the index was empty */
+    int max_pad;
+    /* when clustering, OSM_TILE_KEY(0, zoom, x, y) of every square
+     * holding images to its OsmImageIndexCluster */
+    OsmTileIndex *clusters;
+};
+
+static guint64
+image_index_cluster_key(int zoom, const double *world)
+{
+    double cells = (double)TILESIZE * (1 << zoom) / OSM_IMAGE_CLUSTER_SIZE;
+
+    return OSM_TILE_KEY(0, zoom,
+                        (int)CLAMP(world[0] * cells, 0.0, cells - 1.0),
+                        (int)CLAMP(world[1] * cells, 0.0, cells - 1.0));
+}
+
+/* adds (sign 1) or takes away (sign -1) the entry from its square at
+ * every zoom */
+static void
+image_index_cluster(OsmImageIndex *index, OsmImageIndexEntry *e, int sign)
+{
+    int zoom;
+
+    for (zoom = 0; zoom <= MAX_ZOOM; zoom++) {
+        guint64 key = image_index_cluster_key(zoom, e->world);
+        OsmImageIndexCluster *c = osm_tile_index_lookup(index->clusters, key);
+
+        if (!c) {
+            if (sign < 0)
+                continue;
+            c = g_new0(OsmImageIndexCluster, 1);
+            osm_tile_index_insert(index->clusters, key, c);
+        }
+
+        c->count += sign;
+        c->world_sum[0] += sign * e->world[0];
+        c->world_sum[1] += sign * e->world[1];
+        c->entries_xor ^= (guintptr)e;
+        if (c->count == 0)
+            osm_tile_index_remove(index->clusters, key);
+    }
+}
+
+static guint
+image_index_cell_coord(double world)
+{
+    return (guint)CLAMP(world * CELLS, 0.0, CELLS - 1.0);
+}
+
+static guint
+image_index_cell(const double *world)
+{
+    return (image_index_cell_coord(world[0]) << CELL_BITS) |
+            image_index_cell_coord(world[1]);
+}
+
+static void
+image_index_unlink(OsmImageIndex *index, OsmImageIndexEntry *e)
+{
+    GPtrArray *cell = g_hash_table_lookup(index->cells, GUINT_TO_POINTER(e->cell));
+
+    if (cell) {
+        g_ptr_array_remove_fast(cell, e);
+        if (cell->len == 0)
+            g_hash_table_remove(index->cells, GUINT_TO_POINTER(e->cell));
+    }
+    if (index->clusters)
+        image_index_cluster(index, e, -1);
+}
+
+/* (re)reads where the image is, and files it in the right cell */
+static void
+image_index_link(OsmImageIndex *index, OsmImageIndexEntry *e)
+{
+    GPtrArray *cell;
+    int w, h;
+
+    osm_gps_map_image_get_world(e->image, e->world);
+    osm_gps_map_image_get_size(e->image, &w, &h);
+    /* a corner of the image is at most w + h away, whatever the alignment
+     * and rotation */
+    e->pad = w + h;
+    e->zorder = osm_gps_map_image_get_zorder(e->image);
+    e->cell = image_index_cell(e->world);
+    index->max_pad = MAX(index->max_pad, e->pad);
+
+    cell = g_hash_table_lookup(index->cells, GUINT_TO_POINTER(e->cell));
+    if (!cell) {
+        cell = g_ptr_array_new();
+        g_hash_table_insert(index->cells, GUINT_TO_POINTER(e->cell), cell);
+    }
+    g_ptr_array_add(cell, e);
+    if (index->clusters)
+        image_index_cluster(index, e, 1);
+}
+
+OsmImageIndex *
+osm_image_index_new(void)
+{
+    OsmImageIndex *index = g_new0(OsmImageIndex, 1);
+
+    index->entries = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    index->cells = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                         (GDestroyNotify)g_ptr_array_unref);
+    return index;
+}
+
+void
+osm_image_index_free(OsmImageIndex *index)
+{
+    if (index) {
+        osm_tile_index_free(index->clusters);
+        g_hash_table_destroy(index->cells);
+        g_hash_table_destroy(index->entries);
+        g_free(index);
+    }
+}
+
+void
+osm_image_index_add(OsmImageIndex *index, OsmGpsMapImage *image)
+{
+    OsmImageIndexEntry *e;
+
+    if (g_hash_table_contains(index->entries, image))
+        return;
+
+    e = g_new0(OsmImageIndexEntry, 1);
+    e->image = image;
+    e->seq = index->next_seq++;
+    g_hash_table_insert(index->entries, image, e);
+    image_index_link(index, e);
+}
+
+gboolean
+osm_image_index_remove(OsmImageIndex *index, OsmGpsMapImage *image)
+{
+    OsmImageIndexEntry *e = g_hash_table_lookup(index->entries, image);
+
+    if (!e)
+        return FALSE;
+
+    image_index_unlink(index, e);
+    g_hash_table_remove(index->entries, image);
+    if (g_hash_table_size(index->entries) == 0)
+        index->max_pad = 0;
+    return TRUE;
+}
+
+void
+osm_image_index_remove_all(OsmImageIndex *index)
+{
+    g_hash_table_remove_all(index->cells);
+    g_hash_table_remove_all(index->entries);
+    if (index->clusters)
+        osm_tile_index_remove_all(index->clusters);
+    index->max_pad = 0;
+}
+
+void
+osm_image_index_update(OsmImageIndex *index, OsmGpsMapImage *image)
+{
+    OsmImageIndexEntry *e = g_hash_table_lookup(index->entries, image);
+
+    if (e) {
+        image_index_unlink(index, e);
+        image_index_link(index, e);
+    }
+}
+
+static void
+image_index_query_cell(GPtrArray *cell, GPtrArray *found, double scale,
+                       double x0, double y0, double x1, double y1)
+{
+    guint i;
+
+    for (i = 0; i < cell->len; i++) {
+        OsmImageIndexEntry *e = g_ptr_array_index(cell, i);
+        double x = e->world[0] * scale;
+        double y = e->world[1] * scale;
+
+        if (x + e->pad >= x0 && x - e->pad <= x1 &&
+            y + e->pad >= y0 && y - e->pad <= y1)
+            g_ptr_array_add(found, e);
+    }
+}
+
+static gint
+image_index_compare(gconstpointer a, gconstpointer b)
+{
+    const OsmImageIndexEntry *ea = *(OsmImageIndexEntry **)a;
+    const OsmImageIndexEntry *eb = *(OsmImageIndexEntry **)b;
+
+    if (ea->zorder != eb->zorder)
+        return ea->zorder < eb->zorder ? -1 : 1;
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+GPtrArray *
+osm_image_index_query(OsmImageIndex *index, int zoom, double x0, double y0, double x1, double y1)
+{
+    GPtrArray *found = g_ptr_array_new();
+    double scale = (double)TILESIZE * (1 << zoom);
+    double pad = index->max_pad;
+    guint cx0, cy0, cx1, cy1, i;
+
+    if (g_hash_table_size(index->entries) == 0)
+        return found;
+
+    /* an image in a cell outside the area may still reach into it */
+    cx0 = image_index_cell_coord((x0 - pad) / scale);
+    cy0 = image_index_cell_coord((y0 - pad) / scale);
+    cx1 = image_index_cell_coord((x1 + pad) / scale);
+    cy1 = image_index_cell_coord((y1 + pad) / scale);
+
+    if ((guint64)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) <= g_hash_table_size(index->cells)) {
+        guint cx, cy;
+
+        for (cx = cx0; cx <= cx1; cx++) {
+            for (cy = cy0; cy <= cy1; cy++) {
+                GPtrArray *cell = g_hash_table_lookup(index->cells,
+                                                      GUINT_TO_POINTER((cx << CELL_BITS) | cy));
+                if (cell)
+                    image_index_query_cell(cell, found, scale, x0, y0, x1, y1);
+            }
+        }
+    } else {
+        GHashTableIter iter;
+        gpointer key, cell;
+
+        g_hash_table_iter_init(&iter, index->cells);
+        while (g_hash_table_iter_next(&iter, &key, &cell)) {
+            guint cx = GPOINTER_TO_UINT(key) >> CELL_BITS;
+            guint cy = GPOINTER_TO_UINT(key) & (CELLS - 1);
+
+            if (cx >= cx0 && cx <= cx1 && cy >= cy0 && cy <= cy1)
+                image_index_query_cell(cell, found, scale, x0, y0, x1, y1);
+        }
+    }
+
+    g_ptr_array_sort(found, image_index_compare);
+    for (i = 0; i < found->len; i++)
+        found->pdata[i] = ((OsmImageIndexEntry *)found->pdata[i])->image;
+
+    return found;
+}
+
+void
+osm_image_index_set_clustering(OsmImageIndex *index, gboolean clustering)
+{
+    GHashTableIter iter;
+    gpointer e;
+
+    if (clustering == (index->clusters != NULL))
+        return;
+
+    if (!clustering) {
+        osm_tile_index_free(index->clusters);
+        index->clusters = NULL;
+        return;
+    }
+
+    index->clusters = osm_tile_index_new(g_free);
+    g_hash_table_iter_init(&iter, index->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &e))
+        image_index_cluster(index, e, 1);
+}
+
+GPtrArray *
+osm_image_index_query_clusters(OsmImageIndex *index, int zoom, double x0, double y0, double x1, double y1, GArray *clusters)
+{
+    GPtrArray *found = g_ptr_array_new();
+    double scale = (double)TILESIZE * (1 << zoom);
+    int max_cell = (1 << zoom) * (TILESIZE / OSM_IMAGE_CLUSTER_SIZE) - 1;
+    int cx0, cy0, cx1, cy1, cx, cy;
+    guint i;
+
+    g_return_val_if_fail(index->clusters, found);
+
+    /* an image, or the glyph of a cluster, in a square outside the area
+     * may still reach into it */
+    x0 -= MAX(index->max_pad, OSM_IMAGE_CLUSTER_SIZE);
+    y0 -= MAX(index->max_pad, OSM_IMAGE_CLUSTER_SIZE);
+    x1 += MAX(index->max_pad, OSM_IMAGE_CLUSTER_SIZE);
+    y1 += MAX(index->max_pad, OSM_IMAGE_CLUSTER_SIZE);
+    cx0 = CLAMP(floor(x0 / OSM_IMAGE_CLUSTER_SIZE), 0, max_cell);
+    cy0 = CLAMP(floor(y0 / OSM_IMAGE_CLUSTER_SIZE), 0, max_cell);
+    cx1 = CLAMP(floor(x1 / OSM_IMAGE_CLUSTER_SIZE), 0, max_cell);
+    cy1 = CLAMP(floor(y1 / OSM_IMAGE_CLUSTER_SIZE), 0, max_cell);
+
+    for (cx = cx0; cx <= cx1; cx++) {
+        for (cy = cy0; cy <= cy1; cy++) {
+            OsmImageIndexCluster *c = osm_tile_index_lookup(index->clusters,
+                                                            OSM_TILE_KEY(0, zoom, cx, cy));
+            if (!c)
+                continue;
+
+            if (c->count == 1) {
+                g_ptr_array_add(found, (OsmImageIndexEntry *)c->entries_xor);
+            } else {
+                OsmImageCluster cluster;
+                cluster.x = c->world_sum[0] / c->count * scale;
+                cluster.y = c->world_sum[1] / c->count * scale;
+                cluster.count = c->count;
+                g_array_append_val(clusters, cluster);
+            }
+        }
+    }
+
+    g_ptr_array_sort(found, image_index_compare);
+    for (i = 0; i < found->len; i++)
+        found->pdata[i] = ((OsmImageIndexEntry *)found->pdata[i])->image;
+
+    return found;
+}
@@ -0,0 +1,66 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IMAGE_INDEX_H__
+#define __IMAGE_INDEX_H__
+
+#include <glib.h>
+
+#include "osm-gps-map-image.h"
+
+/* The images on the map, bucketed by where they are, so that drawing only
+ * looks at those near the part of the map being drawn. Holds no
+ * references */
+typedef struct _OsmImageIndex OsmImageIndex;
+
+OsmImageIndex *osm_image_index_new(void);
+void osm_image_index_free(OsmImageIndex *index);
+
+void osm_image_index_add(OsmImageIndex *index, OsmGpsMapImage *image);
+gboolean osm_image_index_remove(OsmImageIndex *index, OsmGpsMapImage *image);
+void osm_image_index_remove_all(OsmImageIndex *index);
+/* after the point or pixbuf of an image changed. Images not in the index
+ * are ignored */
+void osm_image_index_update(OsmImageIndex *index, OsmGpsMapImage *image);
+
+/* The images which may cover any of the pixels x0,y0 - x1,y1 at zoom, by
+ * z-order, and in the order they were added within a z-order. Free with
+ * g_ptr_array_unref() */
+GPtrArray *osm_image_index_query(OsmImageIndex *index, int zoom, double x0, double y0, double x1, double y1);
+
+/* Images closer than this, in pixels, are clustered together */
+#define OSM_IMAGE_CLUSTER_SIZE  64
+
+typedef struct {
+    /* pixels at the zoom queried, the average of the images */
+    double x;
+    double y;
+    guint count;
+} OsmImageCluster;
+
+/* Start or stop counting, for every zoom, the images in each
+ * OSM_IMAGE_CLUSTER_SIZE square of pixels */
+void osm_image_index_set_clustering(OsmImageIndex *index, gboolean clustering);
+/* Like osm_image_index_query(), except that images sharing a square are
+ * not returned, but added to clusters as one OsmImageCluster. Needs
+ * clustering, and costs the number of squares in the area, not the number
+ * of images */
+GPtrArray *osm_image_index_query_clusters(OsmImageIndex *index, int zoom, double x0, double y0, double x1, double y1, GArray *clusters);
+
+#endif /* __IMAGE_INDEX_H__ */
@@ -0,0 +1,1052 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:osm-gps-map-download-job
+ * @short_description: Downloads all tiles of a region
+ * @stability: Unstable
+ * @include: osm-gps-map.h
+ *
+ * #OsmGpsMapDownloadJob downloads every tile of a rectangular region over a
+ * range of zoom levels into the tile cache of a #OsmGpsMap, for use while
+ * offline (see osm_gps_map_download_job_add()).
+ *
+ * Tiles which are already cached are skipped, the check is done in a
+ * background thread. At most #OsmGpsMapDownloadJob:max-downloads tiles are
+ * downloaded at once, and no more than #OsmGpsMapDownloadJob:max-rate are
+ * started per second. Downloads for the map on the screen always go first.
+ *
+ * A job can be paused, and its progress saved to a checkpoint file, so that
+ * an interrupted job can be continued later with
+ * osm_gps_map_download_job_new_from_checkpoint().
+ **/
+
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "converter.h"
+#include "private.h"
+#include "osm-gps-map-download-job.h"
+
+/* number of tiles checked against the tile cache at once */
+#define JOB_CHECK_BATCH         512
+/* seconds between saving the checkpoint, if there is a checkpoint file */
+#define JOB_CHECKPOINT_INTERVAL 10
+#define JOB_CHECKPOINT_GROUP    "download-job"
+
+enum
+{
+    PROP_0,
+    PROP_MAX_DOWNLOADS,
+    PROP_MAX_RATE,
+    PROP_CHECKPOINT_FILE,
+    PROP_PAUSED,
+    PROP_ZOOM_START,
+    PROP_ZOOM_END,
+    PROP_TILES_TOTAL,
+    PROP_TILES_DONE,
+    PROP_TILES_SKIPPED,
+    PROP_TILES_FAILED,
+    PROP_BYTES
+};
+
+enum
+{
+    PROGRESS,
+    FINISHED,
+    LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = {0,};
+
+typedef struct {
+    /* position in the job, see job_tile_at */
+    guint64 index;
+    int zoom;
+    int x;
+    int y;
+    gboolean stored;
+} OsmJobTile;
+
+typedef enum {
+    JOB_TILE_DONE,
+    JOB_TILE_SKIPPED,
+    JOB_TILE_FAILED
+} OsmJobOutcome;
+
+/* a tile finished at or after the resume index */
+typedef struct {
+    guint64 index;
+    OsmJobOutcome outcome;
+    gsize bytes;
+} OsmJobResult;
+
+struct _OsmGpsMapDownloadJobPrivate
+{
+    /* the region, north west and south east corners */
+    OsmGpsMapPoint pt1;
+    OsmGpsMapPoint pt2;
+    int zoom_start;
+    int zoom_end;
+
+    guint64 tiles_total;
+    /* index of the next tile to check against the tile cache */
+    guint64 next;
+    guint64 tiles_done;
+    guint64 tiles_skipped;
+    guint64 tiles_failed;
+    guint64 bytes;
+
+    guint max_downloads;
+    gdouble max_rate;
+    gchar *checkpoint_file;
+    gboolean paused;
+    gboolean finished;
+
+    /* set while the job runs */
+    OsmGpsMap *map;
+    /* OsmJobTile which are not cached, in order */
+    GQueue pending;
+    /* OsmJobTile being downloaded */
+    GQueue active;
+    /* the first tile of the batch being checked, if checking */
+    gboolean checking;
+    guint64 checking_from;
+    GCancellable *cancellable;
+
+    /* earliest time the next download may start, for max-rate */
+    gint64 next_start;
+    guint rate_timeout;
+    gint64 last_checkpoint;
+    /* OsmJobResult of the tiles finished at or after the resume index,
+     * which a checkpoint must not count as they are fetched again */
+    GArray *results;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE(OsmGpsMapDownloadJob, osm_gps_map_download_job, G_TYPE_OBJECT)
+
+static void job_pump (OsmGpsMapDownloadJob *job);
+
+static void
+job_tile_free (OsmJobTile *tile)
+{
+    g_slice_free (OsmJobTile, tile);
+}
+
+/* the tiles of the region at zoom */
+static void
+job_tile_range (OsmGpsMapDownloadJobPrivate *priv, int zoom,
+                int *x1, int *y1, int *x2, int *y2)
+{
+    int max = (1 << zoom) - 1;
+    int xa = lon2pixel(zoom, priv->pt1.rlon) / TILESIZE;
+    int ya = lat2pixel(zoom, priv->pt1.rlat) / TILESIZE;
+    int xb = lon2pixel(zoom, priv->pt2.rlon) / TILESIZE;
+    int yb = lat2pixel(zoom, priv->pt2.rlat) / TILESIZE;
+
+    *x1 = CLAMP(MIN(xa, xb), 0, max);
+    *y1 = CLAMP(MIN(ya, yb), 0, max);
+    *x2 = CLAMP(MAX(xa, xb), 0, max);
+    *y2 = CLAMP(MAX(ya, yb), 0, max);
+}
+
+static void
+job_count_tiles (OsmGpsMapDownloadJobPrivate *priv)
+{
+    int zoom, x1, y1, x2, y2;
+
+    priv->tiles_total = 0;
+    for (zoom = priv->zoom_start; zoom <= priv->zoom_end; zoom++) {
+        job_tile_range (priv, zoom, &x1, &y1, &x2, &y2);
+        priv->tiles_total += (guint64)(x2 - x1 + 1) * (y2 - y1 + 1);
+    }
+}
+
+/* Tiles are numbered by zoom, then x, then y, so that a job can be
+ * continued from a single number */
+static gboolean
+job_tile_at (OsmGpsMapDownloadJobPrivate *priv, guint64 index, OsmJobTile *tile)
+{
+    int zoom, x1, y1, x2, y2;
+
+    tile->index = index;
+    for (zoom = priv->zoom_start; zoom <= priv->zoom_end; zoom++) {
+        guint64 ny, n;
+
+        job_tile_range (priv, zoom, &x1, &y1, &x2, &y2);
+        ny = y2 - y1 + 1;
+        n = (guint64)(x2 - x1 + 1) * ny;
+        if (index < n) {
+            tile->zoom = zoom;
+            tile->x = x1 + index / ny;
+            tile->y = y1 + index % ny;
+            return TRUE;
+        }
+        index -= n;
+    }
+    return FALSE;
+}
+
+/* the first tile which is not known to be done */
+static guint64
+job_resume_index (OsmGpsMapDownloadJobPrivate *priv)
+{
+    guint64 index = priv->next;
+    GList *l;
+
+    if (priv->checking)
+        index = MIN(index, priv->checking_from);
+    if (priv->pending.head)
+        index = MIN(index, ((OsmJobTile *)priv->pending.head->data)->index);
+    for (l = priv->active.head; l != NULL; l = l->next)
+        index = MIN(index, ((OsmJobTile *)l->data)->index);
+
+    return index;
+}
+
+/* forget the results before the resume index, which only moves forward */
+static void
+job_prune_results (OsmGpsMapDownloadJobPrivate *priv)
+{
+    guint64 resume = job_resume_index (priv);
+    guint i, n = 0;
+
+    for (i = 0; i < priv->results->len; i++) {
+        OsmJobResult *result = &g_array_index (priv->results, OsmJobResult, i);
+        if (result->index >= resume)
+            g_array_index (priv->results, OsmJobResult, n++) = *result;
+    }
+    g_array_set_size (priv->results, n);
+}
+
+/* count a finished tile */
+static void
+job_tile_finished (OsmGpsMapDownloadJobPrivate *priv, guint64 index,
+                   OsmJobOutcome outcome, gsize bytes)
+{
+    OsmJobResult result = { index, outcome, bytes };
+
+    switch (outcome) {
+        case JOB_TILE_SKIPPED:
+            priv->tiles_skipped++;
+            /* fall through */
+        case JOB_TILE_DONE:
+            priv->tiles_done++;
+            priv->bytes += bytes;
+            break;
+        case JOB_TILE_FAILED:
+            priv->tiles_failed++;
+            break;
+    }
+    g_array_append_val (priv->results, result);
+}
+
+static void
+job_emit_progress (OsmGpsMapDownloadJob *job)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+
+    g_signal_emit (job, signals[PROGRESS], 0,
+                   priv->tiles_done, priv->tiles_total, priv->bytes);
+}
+
+static void
+job_save_checkpoint (OsmGpsMapDownloadJob *job)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+    GError *error = NULL;
+
+    if (!priv->checkpoint_file)
+        return;
+
+    priv->last_checkpoint = g_get_monotonic_time ();
+    if (!osm_gps_map_download_job_save_checkpoint (job, priv->checkpoint_file, &error)) {
+        g_warning ("Error saving download checkpoint: %s", error->message);
+        g_error_free (error);
+    }
+}
+
+static void
+job_finish (OsmGpsMapDownloadJob *job, gboolean complete)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+    OsmGpsMap *map = priv->map;
+
+    if (priv->finished)
+        return;
+
+    /* the checkpoint needs to know what was still to do */
+    if (priv->checkpoint_file) {
+        if (complete)
+            g_unlink (priv->checkpoint_file);
+        else
+            job_save_checkpoint (job);
+    }
+
+    priv->finished = TRUE;
+    priv->map = NULL;
+
+    if (priv->rate_timeout) {
+        g_source_remove (priv->rate_timeout);
+        priv->rate_timeout = 0;
+    }
+    g_cancellable_cancel (priv->cancellable);
+    g_queue_clear_full (&priv->pending, (GDestroyNotify)job_tile_free);
+    g_queue_clear_full (&priv->active, (GDestroyNotify)job_tile_free);
+
+    g_object_ref (job);
+    if (map) {
+        osm_gps_map_cancel_job_tiles (map, job);
+        osm_gps_map_remove_job (map, job);
+    }
+    g_signal_emit (job, signals[FINISHED], 0,
+                   priv->tiles_done, priv->tiles_failed, priv->bytes);
+    g_object_unref (job);
+}
+
+static void
+job_check_thread (GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+    GArray *tiles = task_data;
+    OsmTileStore *store = g_object_get_data (G_OBJECT (task), "tile-store");
+    guint i;
+
+    for (i = 0; i < tiles->len && !g_cancellable_is_cancelled (cancellable); i++) {
+        OsmJobTile *tile = &g_array_index (tiles, OsmJobTile, i);
+        tile->stored = osm_tile_store_contains (store, tile->zoom, tile->x, tile->y);
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+/* queue the tiles which are not stored for download */
+static void
+job_check_complete (OsmGpsMapDownloadJob *job, GArray *tiles)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+    guint i, n_stored = 0;
+
+    for (i = 0; i < tiles->len; i++) {
+        OsmJobTile *tile = &g_array_index (tiles, OsmJobTile, i);
+
+        if (tile->stored) {
+            job_tile_finished (priv, tile->index, JOB_TILE_SKIPPED, 0);
+            n_stored++;
+        } else {
+            g_queue_push_tail (&priv->pending, g_slice_dup (OsmJobTile, tile));
+        }
+    }
+
+    if (n_stored) {
+        job_prune_results (priv);
+        job_emit_progress (job);
+    }
+}
+
+static void
+job_check_ready (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    OsmGpsMapDownloadJob *job = OSM_GPS_MAP_DOWNLOAD_JOB (source_object);
+    GTask *task = G_TASK (result);
+
+    /* fails if the job was cancelled meanwhile */
+    if (g_task_propagate_boolean (task, NULL)) {
+        job->priv->checking = FALSE;
+        job_check_complete (job, g_task_get_task_data (task));
+        job_pump (job);
+    }
+}
+
+/* check the next batch of tiles against the tile cache */
+static void
+job_check_next (OsmGpsMapDownloadJob *job)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+    OsmTileStore *store = osm_gps_map_get_tile_store (priv->map);
+    GArray *tiles = g_array_sized_new (FALSE, FALSE, sizeof (OsmJobTile), JOB_CHECK_BATCH);
+    OsmJobTile tile = {0,};
+    GTask *task;
+
+    priv->checking_from = priv->next;
+    while (tiles->len < JOB_CHECK_BATCH && job_tile_at (priv, priv->next, &tile)) {
+        g_array_append_val (tiles, tile);
+        priv->next++;
+    }
+
+    if (!store) {
+        /* nothing is cached */
+        job_check_complete (job, tiles);
+        g_array_unref (tiles);
+        return;
+    }
+
+    priv->checking = TRUE;
+    task = g_task_new (job, priv->cancellable, job_check_ready, NULL);
+    /* the map may change its store while the thread runs */
+    g_object_set_data_full (G_OBJECT (task), "tile-store",
+                            osm_tile_store_ref (store), (GDestroyNotify)osm_tile_store_unref);
+    g_task_set_task_data (task, tiles, (GDestroyNotify)g_array_unref);
+    g_task_run_in_thread (task, job_check_thread);
+    g_object_unref (task);
+}
+
+static gboolean
+job_rate_timeout (OsmGpsMapDownloadJob *job)
+{
+    job->priv->rate_timeout = 0;
+    job_pump (job);
+    return FALSE;
+}
+
+/* start as many downloads as allowed, and keep the pending queue filled */
+static void
+job_pump (OsmGpsMapDownloadJob *job)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+
+    if (priv->finished || priv->paused || !priv->map)
+        return;
+
+    while (priv->active.length < priv->max_downloads && priv->pending.length > 0) {
+        OsmJobTile *tile;
+        gboolean missing;
+
+        if (priv->max_rate > 0) {
+            gint64 now = g_get_monotonic_time ();
+
+            if (now < priv->next_start) {
+                if (!priv->rate_timeout)
+                    priv->rate_timeout = g_timeout_add (MAX((priv->next_start - now) / 1000, 1),
+                                                        (GSourceFunc)job_rate_timeout, job);
+                break;
+            }
+            priv->next_start = MAX(priv->next_start, now) + G_USEC_PER_SEC / priv->max_rate;
+        }
+
+        tile = g_queue_pop_head (&priv->pending);
+        if (osm_gps_map_queue_job_tile (priv->map, job, tile->zoom, tile->x, tile->y, &missing)) {
+            g_queue_push_tail (&priv->active, tile);
+        } else {
+            /* known to be missing on the server, or not downloadable */
+            job_tile_finished (priv, tile->index,
+                               missing ? JOB_TILE_FAILED : JOB_TILE_DONE, 0);
+            job_tile_free (tile);
+            job_prune_results (priv);
+            job_emit_progress (job);
+        }
+    }
+
+    if (!priv->checking && priv->next < priv->tiles_total &&
+        priv->pending.length < JOB_CHECK_BATCH / 2)
+        job_check_next (job);
+
+    if (!priv->checking && priv->next >= priv->tiles_total &&
+        priv->pending.length == 0 && priv->active.length == 0)
+        job_finish (job, TRUE);
+}
+
+static void
+osm_gps_map_download_job_get_property (GObject    *object,
+                                       guint       property_id,
+                                       GValue     *value,
+                                       GParamSpec *pspec)
+{
+    OsmGpsMapDownloadJobPrivate *priv = OSM_GPS_MAP_DOWNLOAD_JOB(object)->priv;
+
+    switch (property_id)
+    {
+        case PROP_MAX_DOWNLOADS:
+            g_value_set_uint(value, priv->max_downloads);
+            break;
+        case PROP_MAX_RATE:
+            g_value_set_double(value, priv->max_rate);
+            break;
+        case PROP_CHECKPOINT_FILE:
+            g_value_set_string(value, priv->checkpoint_file);
+            break;
+        case PROP_PAUSED:
+            g_value_set_boolean(value, priv->paused);
+            break;
+        case PROP_ZOOM_START:
+            g_value_set_int(value, priv->zoom_start);
+            break;
+        case PROP_ZOOM_END:
+            g_value_set_int(value, priv->zoom_end);
+            break;
+        case PROP_TILES_TOTAL:
+            g_value_set_uint64(value, priv->tiles_total);
+            break;
+        case PROP_TILES_DONE:
+            g_value_set_uint64(value, priv->tiles_done);
+            break;
+        case PROP_TILES_SKIPPED:
+            g_value_set_uint64(value, priv->tiles_skipped);
+            break;
+        case PROP_TILES_FAILED:
+            g_value_set_uint64(value, priv->tiles_failed);
+            break;
+        case PROP_BYTES:
+            g_value_set_uint64(value, priv->bytes);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+osm_gps_map_download_job_set_property (GObject      *object,
+                                       guint         property_id,
+                                       const GValue *value,
+                                       GParamSpec   *pspec)
+{
+    OsmGpsMapDownloadJob *job = OSM_GPS_MAP_DOWNLOAD_JOB(object);
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+
+    switch (property_id)
+    {
+        case PROP_MAX_DOWNLOADS:
+            priv->max_downloads = g_value_get_uint(value);
+            job_pump(job);
+            break;
+        case PROP_MAX_RATE:
+            priv->max_rate = g_value_get_double(value);
+            break;
+        case PROP_CHECKPOINT_FILE:
+            g_free(priv->checkpoint_file);
+            priv->checkpoint_file = g_value_dup_string(value);
+            break;
+        case PROP_PAUSED:
+            if (g_value_get_boolean(value))
+                osm_gps_map_download_job_pause(job);
+            else
+                osm_gps_map_download_job_resume(job);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+osm_gps_map_download_job_dispose (GObject *object)
+{
+    OsmGpsMapDownloadJobPrivate *priv = OSM_GPS_MAP_DOWNLOAD_JOB(object)->priv;
+
+    /* a running job is kept alive by its map */
+    g_clear_object (&priv->cancellable);
+
+    G_OBJECT_CLASS (osm_gps_map_download_job_parent_class)->dispose (object);
+}
+
+static void
+osm_gps_map_download_job_finalize (GObject *object)
+{
+    OsmGpsMapDownloadJobPrivate *priv = OSM_GPS_MAP_DOWNLOAD_JOB(object)->priv;
+
+    g_queue_clear_full (&priv->pending, (GDestroyNotify)job_tile_free);
+    g_queue_clear_full (&priv->active, (GDestroyNotify)job_tile_free);
+    g_array_unref (priv->results);
+    g_free (priv->checkpoint_file);
+
+    G_OBJECT_CLASS (osm_gps_map_download_job_parent_class)->finalize (object);
+}
+
+static void
+osm_gps_map_download_job_class_init (OsmGpsMapDownloadJobClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->get_property = osm_gps_map_download_job_get_property;
+    object_class->set_property = osm_gps_map_download_job_set_property;
+    object_class->dispose = osm_gps_map_download_job_dispose;
+    object_class->finalize = osm_gps_map_download_job_finalize;
+
+    /**
+     * OsmGpsMapDownloadJob:max-downloads:
+     *
+     * The most tiles of this job downloaded at the same time
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_MAX_DOWNLOADS,
+                                     g_param_spec_uint ("max-downloads",
+                                                        "max downloads",
+                                                        "maximum number of simultaneous downloads",
+                                                        1,          /* minimum property value */
+                                                        64,         /* maximum property value */
+                                                        4,
+                                                        G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
+    /**
+     * OsmGpsMapDownloadJob:max-rate:
+     *
+     * The most downloads started per second, 0 for no limit
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_MAX_RATE,
+                                     g_param_spec_double ("max-rate",
+                                                          "max rate",
+                                                          "maximum number of downloads started per second",
+                                                          0.0,          /* minimum property value */
+                                                          G_MAXDOUBLE,  /* maximum property value */
+                                                          0.0,
+                                                          G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
+    /**
+     * OsmGpsMapDownloadJob:checkpoint-file:
+     *
+     * If set, the progress of the job is saved to this file regularly,
+     * and when the job is paused or stopped before it is complete. The file
+     * is removed once the job is complete.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_CHECKPOINT_FILE,
+                                     g_param_spec_string ("checkpoint-file",
+                                                          "checkpoint file",
+                                                          "file to save the progress of the job to",
+                                                          NULL,
+                                                          G_PARAM_READABLE | G_PARAM_WRITABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_PAUSED,
+                                     g_param_spec_boolean ("paused",
+                                                           "paused",
+                                                           "whether the job is paused",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_ZOOM_START,
+                                     g_param_spec_int ("zoom-start",
+                                                       "zoom start",
+                                                       "lowest zoom level downloaded",
+                                                       MIN_ZOOM, MAX_ZOOM, MIN_ZOOM,
+                                                       G_PARAM_READABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_ZOOM_END,
+                                     g_param_spec_int ("zoom-end",
+                                                       "zoom end",
+                                                       "highest zoom level downloaded",
+                                                       MIN_ZOOM, MAX_ZOOM, MIN_ZOOM,
+                                                       G_PARAM_READABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_TILES_TOTAL,
+                                     g_param_spec_uint64 ("tiles-total",
+                                                          "tiles total",
+                                                          "number of tiles in the region",
+                                                          0, G_MAXUINT64, 0,
+                                                          G_PARAM_READABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_TILES_DONE,
+                                     g_param_spec_uint64 ("tiles-done",
+                                                          "tiles done",
+                                                          "number of tiles downloaded or already cached",
+                                                          0, G_MAXUINT64, 0,
+                                                          G_PARAM_READABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_TILES_SKIPPED,
+                                     g_param_spec_uint64 ("tiles-skipped",
+                                                          "tiles skipped",
+                                                          "number of tiles which were already cached",
+                                                          0, G_MAXUINT64, 0,
+                                                          G_PARAM_READABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_TILES_FAILED,
+                                     g_param_spec_uint64 ("tiles-failed",
+                                                          "tiles failed",
+                                                          "number of tiles which could not be downloaded",
+                                                          0, G_MAXUINT64, 0,
+                                                          G_PARAM_READABLE));
+
+    g_object_class_install_property (object_class,
+                                     PROP_BYTES,
+                                     g_param_spec_uint64 ("bytes",
+                                                          "bytes",
+                                                          "number of bytes downloaded",
+                                                          0, G_MAXUINT64, 0,
+                                                          G_PARAM_READABLE));
+
+    /**
+     * OsmGpsMapDownloadJob::progress:
+     * @self: A #OsmGpsMapDownloadJob
+     * @tiles_done: tiles downloaded or already cached so far
+     * @tiles_total: tiles in the region
+     * @bytes: bytes downloaded so far
+     *
+     * Emitted whenever a tile is done
+     *
+     * Since: 1.3.0
+     **/
+    signals [PROGRESS] = g_signal_new ("progress",
+                                OSM_TYPE_GPS_MAP_DOWNLOAD_JOB,
+                                G_SIGNAL_RUN_FIRST,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL,
+                                G_TYPE_NONE,
+                                3,
+                                G_TYPE_UINT64,
+                                G_TYPE_UINT64,
+                                G_TYPE_UINT64);
+
+    /**
+     * OsmGpsMapDownloadJob::finished:
+     * @self: A #OsmGpsMapDownloadJob
+     * @tiles_done: tiles downloaded or already cached
+     * @tiles_failed: tiles which could not be downloaded
+     * @bytes: bytes downloaded
+     *
+     * Emitted when the job is complete, or was cancelled. The job was
+     * complete if @tiles_done and @tiles_failed add up to
+     * #OsmGpsMapDownloadJob:tiles-total
+     *
+     * Since: 1.3.0
+     **/
+    signals [FINISHED] = g_signal_new ("finished",
+                                OSM_TYPE_GPS_MAP_DOWNLOAD_JOB,
+                                G_SIGNAL_RUN_FIRST,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL,
+                                G_TYPE_NONE,
+                                3,
+                                G_TYPE_UINT64,
+                                G_TYPE_UINT64,
+                                G_TYPE_UINT64);
+}
+
+static void
+osm_gps_map_download_job_init (OsmGpsMapDownloadJob *self)
+{
+    self->priv = osm_gps_map_download_job_get_instance_private (self);
+    self->priv->cancellable = g_cancellable_new ();
+    g_queue_init (&self->priv->pending);
+    g_queue_init (&self->priv->active);
+    self->priv->results = g_array_new (FALSE, FALSE, sizeof (OsmJobResult));
+}
+
+/**
+ * osm_gps_map_download_job_new:
+ * @pt1: (in): north west corner
+ * @pt2: (in): south east corner
+ * @zoom_start: (in): start of zoom range
+ * @zoom_end: (in): end of zoom range
+ *
+ * Create a job downloading all tiles over the supplied zoom range in the
+ * rectangular region specified by pt1 (north west corner) to pt2 (south
+ * east corner). It is started by osm_gps_map_download_job_add()
+ *
+ * Returns: (transfer full): a new #OsmGpsMapDownloadJob
+ * Since: 1.3.0
+ **/
+OsmGpsMapDownloadJob *
+osm_gps_map_download_job_new (OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end)
+{
+    OsmGpsMapDownloadJob *job;
+    OsmGpsMapDownloadJobPrivate *priv;
+
+    g_return_val_if_fail (pt1 != NULL && pt2 != NULL, NULL);
+
+    job = g_object_new (OSM_TYPE_GPS_MAP_DOWNLOAD_JOB, NULL);
+    priv = job->priv;
+    priv->pt1.rlat = pt1->rlat;
+    priv->pt1.rlon = pt1->rlon;
+    priv->pt2.rlat = pt2->rlat;
+    priv->pt2.rlon = pt2->rlon;
+    priv->zoom_start = CLAMP(zoom_start, MIN_ZOOM, MAX_ZOOM);
+    priv->zoom_end = CLAMP(zoom_end, priv->zoom_start, MAX_ZOOM);
+    job_count_tiles (priv);
+
+    return job;
+}
+
+/**
+ * osm_gps_map_download_job_new_from_checkpoint:
+ * @filename: (in): a checkpoint file
+ * @error: return location for a #GError, or %NULL
+ *
+ * Create a job continuing the one which saved @filename. The new job
+ * keeps saving its progress to @filename.
+ *
+ * Returns: (transfer full): a new #OsmGpsMapDownloadJob, or %NULL on error
+ * Since: 1.3.0
+ **/
+OsmGpsMapDownloadJob *
+osm_gps_map_download_job_new_from_checkpoint (const gchar *filename, GError **error)
+{
+    OsmGpsMapDownloadJob *job = NULL;
+    OsmGpsMapDownloadJobPrivate *priv;
+    GKeyFile *keyfile = g_key_file_new ();
+    GError *err = NULL;
+    OsmGpsMapPoint pt1 = {0,}, pt2 = {0,};
+    int zoom_start = 0, zoom_end = 0;
+    guint64 next = 0, done = 0, skipped = 0, failed = 0, bytes = 0;
+
+    if (!g_key_file_load_from_file (keyfile, filename, G_KEY_FILE_NONE, error))
+        goto out;
+
+    pt1.rlat = g_key_file_get_double (keyfile, JOB_CHECKPOINT_GROUP, "lat1", &err);
+    if (!err) pt1.rlon = g_key_file_get_double (keyfile, JOB_CHECKPOINT_GROUP, "lon1", &err);
+    if (!err) pt2.rlat = g_key_file_get_double (keyfile, JOB_CHECKPOINT_GROUP, "lat2", &err);
+    if (!err) pt2.rlon = g_key_file_get_double (keyfile, JOB_CHECKPOINT_GROUP, "lon2", &err);
+    if (!err) zoom_start = g_key_file_get_integer (keyfile, JOB_CHECKPOINT_GROUP, "zoom-start", &err);
+    if (!err) zoom_end = g_key_file_get_integer (keyfile, JOB_CHECKPOINT_GROUP, "zoom-end", &err);
+    if (!err) next = g_key_file_get_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "next", &err);
+    if (!err) done = g_key_file_get_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "tiles-done", &err);
+    if (!err) skipped = g_key_file_get_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "tiles-skipped", &err);
+    if (!err) failed = g_key_file_get_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "tiles-failed", &err);
+    if (!err) bytes = g_key_file_get_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "bytes", &err);
+    if (err) {
+        g_propagate_prefixed_error (error, err, "Invalid download checkpoint %s: ", filename);
+        goto out;
+    }
+
+    job = osm_gps_map_download_job_new (&pt1, &pt2, zoom_start, zoom_end);
+    priv = job->priv;
+    priv->next = MIN(next, priv->tiles_total);
+    priv->tiles_done = done;
+    priv->tiles_skipped = skipped;
+    priv->tiles_failed = failed;
+    priv->bytes = bytes;
+    priv->checkpoint_file = g_strdup (filename);
+
+out:
+    g_key_file_free (keyfile);
+    return job;
+}
+
+/**
+ * osm_gps_map_download_job_save_checkpoint:
+ * @job: (in): a #OsmGpsMapDownloadJob
+ * @filename: (in): the file to write
+ * @error: return location for a #GError, or %NULL
+ *
+ * Save the region and progress of @job, to continue it with
+ * osm_gps_map_download_job_new_from_checkpoint(). This is done
+ * automatically if #OsmGpsMapDownloadJob:checkpoint-file is set.
+ *
+ * Returns: %TRUE on success
+ * Since: 1.3.0
+ **/
+gboolean
+osm_gps_map_download_job_save_checkpoint (OsmGpsMapDownloadJob *job, const gchar *filename, GError **error)
+{
+    OsmGpsMapDownloadJobPrivate *priv;
+    GKeyFile *keyfile;
+    gboolean saved;
+    guint64 done, skipped, failed, bytes;
+    guint i;
+
+    g_return_val_if_fail (OSM_GPS_MAP_IS_DOWNLOAD_JOB (job), FALSE);
+    priv = job->priv;
+
+    /* the tiles from next on are fetched again when continued, so are
+     * not counted yet */
+    job_prune_results (priv);
+    done = priv->tiles_done;
+    skipped = priv->tiles_skipped;
+    failed = priv->tiles_failed;
+    bytes = priv->bytes;
+    for (i = 0; i < priv->results->len; i++) {
+        OsmJobResult *result = &g_array_index (priv->results, OsmJobResult, i);
+
+        switch (result->outcome) {
+            case JOB_TILE_SKIPPED:
+                skipped--;
+                /* fall through */
+            case JOB_TILE_DONE:
+                done--;
+                bytes -= result->bytes;
+                break;
+            case JOB_TILE_FAILED:
+                failed--;
+                break;
+        }
+    }
+
+    keyfile = g_key_file_new ();
+    g_key_file_set_double (keyfile, JOB_CHECKPOINT_GROUP, "lat1", priv->pt1.rlat);
+    g_key_file_set_double (keyfile, JOB_CHECKPOINT_GROUP, "lon1", priv->pt1.rlon);
+    g_key_file_set_double (keyfile, JOB_CHECKPOINT_GROUP, "lat2", priv->pt2.rlat);
+    g_key_file_set_double (keyfile, JOB_CHECKPOINT_GROUP, "lon2", priv->pt2.rlon);
+    g_key_file_set_integer (keyfile, JOB_CHECKPOINT_GROUP, "zoom-start", priv->zoom_start);
+    g_key_file_set_integer (keyfile, JOB_CHECKPOINT_GROUP, "zoom-end", priv->zoom_end);
+    g_key_file_set_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "next", job_resume_index (priv));
+    g_key_file_set_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "tiles-done", done);
+    g_key_file_set_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "tiles-skipped", skipped);
+    g_key_file_set_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "tiles-failed", failed);
+    g_key_file_set_uint64 (keyfile, JOB_CHECKPOINT_GROUP, "bytes", bytes);
+
+    /* written to a temporary file first, so a crash leaves the old one */
+    saved = g_key_file_save_to_file (keyfile, filename, error);
+    g_key_file_free (keyfile);
+
+    return saved;
+}
+
+/**
+ * osm_gps_map_download_job_pause:
+ * @job: (in): a #OsmGpsMapDownloadJob
+ *
+ * Stop starting downloads, the ones already started are finished
+ *
+ * Since: 1.3.0
+ **/
+void
+osm_gps_map_download_job_pause (OsmGpsMapDownloadJob *job)
+{
+    g_return_if_fail (OSM_GPS_MAP_IS_DOWNLOAD_JOB (job));
+
+    if (job->priv->paused)
+        return;
+
+    job->priv->paused = TRUE;
+    if (!job->priv->finished)
+        job_save_checkpoint (job);
+    g_object_notify (G_OBJECT (job), "paused");
+}
+
+/**
+ * osm_gps_map_download_job_resume:
+ * @job: (in): a #OsmGpsMapDownloadJob
+ *
+ * Continue a job paused by osm_gps_map_download_job_pause()
+ *
+ * Since: 1.3.0
+ **/
+void
+osm_gps_map_download_job_resume (OsmGpsMapDownloadJob *job)
+{
+    g_return_if_fail (OSM_GPS_MAP_IS_DOWNLOAD_JOB (job));
+
+    if (!job->priv->paused)
+        return;
+
+    job->priv->paused = FALSE;
+    g_object_notify (G_OBJECT (job), "paused");
+    if (job->priv->map)
+        job_pump (job);
+}
+
+/**
+ * osm_gps_map_download_job_cancel:
+ * @job: (in): a #OsmGpsMapDownloadJob
+ *
+ * Stop the job for good, aborting the downloads in progress. If
+ * #OsmGpsMapDownloadJob:checkpoint-file is set it can be continued later
+ * from there.
+ *
+ * Since: 1.3.0
+ **/
+void
+osm_gps_map_download_job_cancel (OsmGpsMapDownloadJob *job)
+{
+    g_return_if_fail (OSM_GPS_MAP_IS_DOWNLOAD_JOB (job));
+
+    job_finish (job, FALSE);
+}
+
+/**
+ * osm_gps_map_download_job_is_finished:
+ * @job: (in): a #OsmGpsMapDownloadJob
+ *
+ * Returns: %TRUE if the job is complete or was cancelled
+ * Since: 1.3.0
+ **/
+gboolean
+osm_gps_map_download_job_is_finished (OsmGpsMapDownloadJob *job)
+{
+    g_return_val_if_fail (OSM_GPS_MAP_IS_DOWNLOAD_JOB (job), FALSE);
+
+    return job->priv->finished;
+}
+
+/* Called by the map, in osm_gps_map_download_job_add() */
+gboolean
+osm_gps_map_download_job_start (OsmGpsMapDownloadJob *job, OsmGpsMap *map,
+                                int min_zoom, int max_zoom)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+
+    if (priv->map) {
+        g_warning ("Download job is already running");
+        return FALSE;
+    }
+
+    /* a job continued from a checkpoint keeps its numbering of tiles */
+    if (priv->next == 0) {
+        priv->zoom_start = CLAMP(priv->zoom_start, min_zoom, max_zoom);
+        priv->zoom_end = CLAMP(priv->zoom_end, min_zoom, max_zoom);
+        job_count_tiles (priv);
+    }
+
+    priv->map = map;
+    priv->last_checkpoint = g_get_monotonic_time ();
+    g_debug ("Download job of %"G_GUINT64_FORMAT" tiles, from %"G_GUINT64_FORMAT,
+             priv->tiles_total, priv->next);
+
+    job_pump (job);
+    return TRUE;
+}
+
+/* Called by the map when a tile of the job was downloaded, ok is FALSE if
+ * the download or storing the tile failed */
+void
+osm_gps_map_download_job_tile_done (OsmGpsMapDownloadJob *job, int zoom, int x, int y,
+                                    gboolean ok, gsize bytes)
+{
+    OsmGpsMapDownloadJobPrivate *priv = job->priv;
+    GList *l;
+
+    if (priv->finished)
+        return;
+
+    for (l = priv->active.head; l != NULL; l = l->next) {
+        OsmJobTile *tile = l->data;
+        if (tile->zoom == zoom && tile->x == x && tile->y == y) {
+            job_tile_finished (priv, tile->index,
+                               ok ? JOB_TILE_DONE : JOB_TILE_FAILED, ok ? bytes : 0);
+            job_tile_free (tile);
+            g_queue_delete_link (&priv->active, l);
+            break;
+        }
+    }
+    if (l == NULL)
+        return;
+
+    job_prune_results (priv);
+    job_emit_progress (job);
+
+    if (priv->checkpoint_file &&
+        g_get_monotonic_time () - priv->last_checkpoint > JOB_CHECKPOINT_INTERVAL * G_USEC_PER_SEC)
+        job_save_checkpoint (job);
+
+    job_pump (job);
+}
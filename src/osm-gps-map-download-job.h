@@ -0,0 +1,65 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OSM_GPS_MAP_DOWNLOAD_JOB_H
+#define _OSM_GPS_MAP_DOWNLOAD_JOB_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "osm-gps-map-point.h"
+
+G_BEGIN_DECLS
+
+#define OSM_TYPE_GPS_MAP_DOWNLOAD_JOB              osm_gps_map_download_job_get_type()
+#define OSM_GPS_MAP_DOWNLOAD_JOB(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), OSM_TYPE_GPS_MAP_DOWNLOAD_JOB, OsmGpsMapDownloadJob))
+#define OSM_GPS_MAP_DOWNLOAD_JOB_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST ((klass), OSM_TYPE_GPS_MAP_DOWNLOAD_JOB, OsmGpsMapDownloadJobClass))
+#define OSM_GPS_MAP_IS_DOWNLOAD_JOB(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), OSM_TYPE_GPS_MAP_DOWNLOAD_JOB))
+#define OSM_GPS_MAP_IS_DOWNLOAD_JOB_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE ((klass), OSM_TYPE_GPS_MAP_DOWNLOAD_JOB))
+#define OSM_GPS_MAP_DOWNLOAD_JOB_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS ((obj), OSM_TYPE_GPS_MAP_DOWNLOAD_JOB, OsmGpsMapDownloadJobClass))
+
+typedef struct _OsmGpsMapDownloadJob OsmGpsMapDownloadJob;
+typedef struct _OsmGpsMapDownloadJobClass OsmGpsMapDownloadJobClass;
+typedef struct _OsmGpsMapDownloadJobPrivate OsmGpsMapDownloadJobPrivate;
+
+struct _OsmGpsMapDownloadJob
+{
+    GObject parent;
+
+    OsmGpsMapDownloadJobPrivate *priv;
+};
+
+struct _OsmGpsMapDownloadJobClass
+{
+    GObjectClass parent_class;
+};
+
+GType                   osm_gps_map_download_job_get_type (void) G_GNUC_CONST;
+
+OsmGpsMapDownloadJob *  osm_gps_map_download_job_new                    (OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end);
+OsmGpsMapDownloadJob *  osm_gps_map_download_job_new_from_checkpoint    (const gchar *filename, GError **error);
+gboolean                osm_gps_map_download_job_save_checkpoint        (OsmGpsMapDownloadJob *job, const gchar *filename, GError **error);
+void                    osm_gps_map_download_job_pause                  (OsmGpsMapDownloadJob *job);
+void                    osm_gps_map_download_job_resume                 (OsmGpsMapDownloadJob *job);
+void                    osm_gps_map_download_job_cancel                 (OsmGpsMapDownloadJob *job);
+gboolean                osm_gps_map_download_job_is_finished            (OsmGpsMapDownloadJob *job);
+
+G_END_DECLS
+
+#endif /* _OSM_GPS_MAP_DOWNLOAD_JOB_H */
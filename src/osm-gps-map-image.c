@@ -27,10 +27,12 @@
  * (osm_gps_map_image_add()) at a specific location (a #OsmGpsMapPoint).
  **/
 
+#include <math.h>
 #include <gdk/gdk.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 #include "converter.h"
+#include "private.h"
 #include "osm-gps-map-track.h"
 #include "osm-gps-map-image.h"
 
@@ -45,10 +47,32 @@ enum
     PROP_ROTATION
 };
 
+/* rotated images are drawn from copies turned by a multiple of this many
+ * degrees */
+#define SPRITE_ANGLE_STEP   (2)
+#define SPRITE_ANGLES       (360 / SPRITE_ANGLE_STEP)
+
+/* A pixbuf ready for cairo, made once for all the images showing it, and
+ * the turned copies of it drawn so far */
+typedef struct {
+    /* the key, the images showing it hold the references */
+    GdkPixbuf *pixbuf;
+    guint ref_count;
+    cairo_surface_t *surface;
+    /* SPRITE_ANGLES of them, each made when first needed */
+    cairo_surface_t **rotated;
+} OsmImageSprite;
+
+/* GdkPixbuf to its OsmImageSprite */
+static GHashTable *sprites = NULL;
+
 struct _OsmGpsMapImagePrivate
 {
     OsmGpsMapPoint  *pt;
+    /* latlon2world() of pt */
+    double          world[2];
     GdkPixbuf       *pixbuf;
+    OsmImageSprite  *sprite;
     int             w;
     int             h;
     gfloat          xalign;
@@ -59,6 +83,89 @@ struct _OsmGpsMapImagePrivate
 
 G_DEFINE_TYPE_WITH_PRIVATE (OsmGpsMapImage, osm_gps_map_image, G_TYPE_OBJECT)
 
+static OsmImageSprite *
+osm_image_sprite_get (GdkPixbuf *pixbuf)
+{
+    OsmImageSprite *sprite;
+    cairo_t *cr;
+
+    if (!sprites)
+        sprites = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    sprite = g_hash_table_lookup (sprites, pixbuf);
+    if (sprite) {
+        sprite->ref_count++;
+        return sprite;
+    }
+
+    sprite = g_new0 (OsmImageSprite, 1);
+    sprite->pixbuf = pixbuf;
+    sprite->ref_count = 1;
+    sprite->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                  gdk_pixbuf_get_width (pixbuf),
+                                                  gdk_pixbuf_get_height (pixbuf));
+    cr = cairo_create (sprite->surface);
+    gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
+    cairo_paint (cr);
+    cairo_destroy (cr);
+
+    g_hash_table_insert (sprites, pixbuf, sprite);
+    return sprite;
+}
+
+static void
+osm_image_sprite_unref (OsmImageSprite *sprite)
+{
+    int i;
+
+    if (--sprite->ref_count > 0)
+        return;
+
+    g_hash_table_remove (sprites, sprite->pixbuf);
+    cairo_surface_destroy (sprite->surface);
+    if (sprite->rotated) {
+        for (i = 0; i < SPRITE_ANGLES; i++) {
+            if (sprite->rotated[i])
+                cairo_surface_destroy (sprite->rotated[i]);
+        }
+        g_free (sprite->rotated);
+    }
+    g_free (sprite);
+}
+
+/* The sprite turned by angle * SPRITE_ANGLE_STEP degrees about its
+ * centre, which stays at the centre */
+static cairo_surface_t *
+osm_image_sprite_get_rotated (OsmImageSprite *sprite, int angle)
+{
+    int w = cairo_image_surface_get_width (sprite->surface);
+    int h = cairo_image_surface_get_height (sprite->surface);
+    int side = ceil (sqrt (w * w + h * h));
+    int rw, rh;
+    cairo_t *cr;
+
+    if (!sprite->rotated)
+        sprite->rotated = g_new0 (cairo_surface_t *, SPRITE_ANGLES);
+    if (sprite->rotated[angle])
+        return sprite->rotated[angle];
+
+    /* big enough for any angle, and centred on whole pixels like the
+     * sprite, so that drawing it does not resample it again */
+    rw = side + (side - w) % 2;
+    rh = side + (side - h) % 2;
+    sprite->rotated[angle] = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, rw, rh);
+
+    cr = cairo_create (sprite->rotated[angle]);
+    cairo_translate (cr, rw / 2.0, rh / 2.0);
+    cairo_rotate (cr, deg2rad (angle * SPRITE_ANGLE_STEP));
+    cairo_translate (cr, -w / 2.0, -h / 2.0);
+    cairo_set_source_surface (cr, sprite->surface, 0, 0);
+    cairo_paint (cr);
+    cairo_destroy (cr);
+
+    return sprite->rotated[angle];
+}
+
 static void
 osm_gps_map_image_get_property (GObject    *object,
                                 guint       property_id,
@@ -101,11 +208,14 @@ osm_gps_map_image_set_property (GObject      *object,
     switch (property_id)
     {
         case PROP_PIXBUF:
+            if (priv->sprite)
+                osm_image_sprite_unref (priv->sprite);
             if (priv->pixbuf)
                 g_object_unref (priv->pixbuf);
             priv->pixbuf = g_value_dup_object (value);
             priv->w = gdk_pixbuf_get_width(priv->pixbuf);
             priv->h = gdk_pixbuf_get_height(priv->pixbuf);
+            priv->sprite = osm_image_sprite_get (priv->pixbuf);
             break;
         case PROP_X_ALIGN:
             priv->xalign = g_value_get_float (value);
@@ -114,7 +224,11 @@ osm_gps_map_image_set_property (GObject      *object,
             priv->yalign = g_value_get_float (value);
             break;
         case PROP_POINT:
+            if (priv->pt)
+                g_boxed_free (OSM_TYPE_GPS_MAP_POINT, priv->pt);
             priv->pt = g_value_dup_boxed (value);
+            if (priv->pt)
+                latlon2world (priv->pt->rlat, priv->pt->rlon, &priv->world[0], &priv->world[1]);
             break;
         case PROP_Z_ORDER:
             priv->zorder = g_value_get_int (value);
@@ -132,8 +246,11 @@ osm_gps_map_image_dispose (GObject *object)
 {
     OsmGpsMapImagePrivate *priv = OSM_GPS_MAP_IMAGE(object)->priv;
 
-    if (priv->pixbuf)
-        g_object_unref (priv->pixbuf);
+    if (priv->sprite) {
+        osm_image_sprite_unref (priv->sprite);
+        priv->sprite = NULL;
+    }
+    g_clear_object (&priv->pixbuf);
 
     G_OBJECT_CLASS (osm_gps_map_image_parent_class)->dispose (object);
 }
@@ -229,6 +346,7 @@ osm_gps_map_image_draw (OsmGpsMapImage *object, cairo_t *cr, GdkRectangle *rect)
     OsmGpsMapImagePrivate *priv;
     int xoffset, yoffset;
     gdouble x,y;
+    int angle;
 
     g_return_if_fail (OSM_GPS_MAP_IS_IMAGE (object));
     priv = OSM_GPS_MAP_IMAGE(object)->priv;
@@ -238,16 +356,26 @@ osm_gps_map_image_draw (OsmGpsMapImage *object, cairo_t *cr, GdkRectangle *rect)
     x = rect->x - xoffset;
     y = rect->y - yoffset;
 
-    cairo_translate(cr, x+(priv->w/2), y+(priv->h/2));
-    cairo_rotate(cr, deg2rad(priv->rotation));
-    cairo_translate(cr,  -(x+(priv->w/2)), -(y+(priv->h/2)));
-
-    gdk_cairo_set_source_pixbuf (cr, priv->pixbuf, x, y);
-    cairo_paint (cr);
-
-    cairo_translate(cr, x+(priv->w/2), y+(priv->h/2));
-    cairo_rotate(cr, -deg2rad(priv->rotation));
-    cairo_translate(cr,  -(x+(priv->w/2)), -(y+(priv->h/2)));
+    /* one paint of a surface made earlier, of just the image */
+    angle = (int)floor (priv->rotation / SPRITE_ANGLE_STEP + 0.5) % SPRITE_ANGLES;
+    if (angle < 0)
+        angle += SPRITE_ANGLES;
+
+    if (priv->sprite && angle == 0) {
+        cairo_set_source_surface (cr, priv->sprite->surface, x, y);
+        cairo_rectangle (cr, x, y, priv->w, priv->h);
+        cairo_fill (cr);
+    } else if (priv->sprite) {
+        cairo_surface_t *rotated = osm_image_sprite_get_rotated (priv->sprite, angle);
+        int rw = cairo_image_surface_get_width (rotated);
+        int rh = cairo_image_surface_get_height (rotated);
+        double rx = x + (priv->w - rw) / 2;
+        double ry = y + (priv->h - rh) / 2;
+
+        cairo_set_source_surface (cr, rotated, rx, ry);
+        cairo_rectangle (cr, rx, ry, rw, rh);
+        cairo_fill (cr);
+    }
 
     rect->width = priv->w;
     rect->height = priv->h;
@@ -260,6 +388,20 @@ osm_gps_map_image_get_point(OsmGpsMapImage *object)
     return object->priv->pt;
 }
 
+void
+osm_gps_map_image_get_world (OsmGpsMapImage *object, double *world)
+{
+    world[0] = object->priv->world[0];
+    world[1] = object->priv->world[1];
+}
+
+void
+osm_gps_map_image_get_size (OsmGpsMapImage *object, int *w, int *h)
+{
+    *w = object->priv->w;
+    *h = object->priv->h;
+}
+
 gint
 osm_gps_map_image_get_zorder(OsmGpsMapImage *object)
 {
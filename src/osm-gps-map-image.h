@@ -85,7 +85,8 @@ void            osm_gps_map_image_draw (OsmGpsMapImage *object, cairo_t *cr, Gdk
  * osm_gps_map_image_get_point:
  * @object: a #OsmGpsMapImage
  *
- * Get image location point
+ * Get image location point. To move the image, set #OsmGpsMapImage:point
+ * rather than changing the point returned.
  *
  * Returns: (transfer none): location point
  * Since: 0.7.0
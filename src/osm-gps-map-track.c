@@ -32,8 +32,16 @@
 #include <math.h>
 
 #include "converter.h"
+#include "private.h"
+#include "tile-index.h"
 #include "osm-gps-map-track.h"
 
+/* how far, in pixels, a simplified track may be from the real one */
+#define LOD_TOLERANCE   (0.5)
+
+/* size, in pixels, of the cells of the hit test grid */
+#define HIT_CELL        (32)
+
 enum
 {
     PROP_0,
@@ -58,7 +66,27 @@ static guint signals[LAST_SIGNAL] = {0,};
 
 struct _OsmGpsMapTrackPrivate
 {
+    /* OsmGpsMapPoint, in one block so that appending, indexing and
+     * walking the track are cheap */
+    GArray *points;
+    /* for each point, its x and y from latlon2world(), which only need
+     * scaling and offsetting to be drawn */
+    GArray *world;
+    /* the "track" property and osm_gps_map_track_get_points(), pointing
+     * into points. Built when asked for, freed when points moves */
     GSList *track;
+    /* for each zoom level, the positions of the points left after
+     * simplifying the track for drawing at that zoom. Built on first use,
+     * and brought up to date with the points added since when next used */
+    GArray *lod[MAX_ZOOM + 1];
+    /* the points, and the breakers between them, by which HIT_CELL square
+     * they are in at hit_zoom. Built when hit testing, dropped when the
+     * points change */
+    OsmTileIndex *hit;
+    int hit_zoom;
+    gboolean hit_closed;
+    /* counts changes to the points, see osm_gps_map_track_get_stamp() */
+    guint stamp;
     gboolean visible;
     gfloat linewidth;
     gfloat alpha;
@@ -73,6 +101,335 @@ G_DEFINE_TYPE_WITH_PRIVATE(OsmGpsMapTrack, osm_gps_map_track, G_TYPE_OBJECT)
 #define DEFAULT_B   (0)
 #define DEFAULT_A   (0.6)
 
+/* Forgets the simplified points from pos onwards, after the points there
+ * changed. The last one left is where simplifying starts again */
+static void
+osm_gps_map_track_lod_truncate (OsmGpsMapTrack *track, int pos)
+{
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    int zoom;
+
+    for (zoom = 0; zoom <= MAX_ZOOM; zoom++) {
+        GArray *lod = priv->lod[zoom];
+        guint len;
+
+        if (!lod)
+            continue;
+
+        len = lod->len;
+        while (len > 0 && g_array_index (lod, guint, len - 1) >= (guint)pos)
+            len--;
+        g_array_set_size (lod, len);
+    }
+}
+
+/* After any point was added, removed or moved */
+static void
+osm_gps_map_track_points_changed (OsmGpsMapTrack *track)
+{
+    osm_tile_index_free (track->priv->hit);
+    track->priv->hit = NULL;
+    track->priv->stamp++;
+}
+
+/* After points was reallocated or changed */
+static void
+osm_gps_map_track_drop_list (OsmGpsMapTrack *track)
+{
+    g_slist_free (track->priv->track);
+    track->priv->track = NULL;
+    osm_gps_map_track_points_changed (track);
+}
+
+/* Works out the world positions of n points from pos, which world must
+ * already have room for */
+static void
+osm_gps_map_track_project (OsmGpsMapTrack *track, guint pos, guint n)
+{
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    double *world = (double *)priv->world->data;
+    guint i;
+
+    for (i = pos; i < pos + n; i++) {
+        const OsmGpsMapPoint *p = &g_array_index (priv->points, OsmGpsMapPoint, i);
+        latlon2world (p->rlat, p->rlon, &world[2*i], &world[2*i+1]);
+    }
+}
+
+/* After points were added to the end */
+static void
+osm_gps_map_track_project_appended (OsmGpsMapTrack *track)
+{
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    guint pos = priv->world->len / 2;
+
+    g_array_set_size (priv->world, 2 * priv->points->len);
+    osm_gps_map_track_project (track, pos, priv->points->len - pos);
+}
+
+void
+osm_gps_map_track_point_moved (OsmGpsMapTrack *track, int pos)
+{
+    if (pos < 0 || (guint)pos >= track->priv->points->len)
+        return;
+    osm_gps_map_track_project (track, pos, 1);
+    osm_gps_map_track_lod_truncate (track, pos);
+    osm_gps_map_track_points_changed (track);
+}
+
+static void
+on_point_changed (OsmGpsMapTrack *track, int pos, gpointer user_data)
+{
+    if (pos >= 0 && (guint)pos < track->priv->points->len) {
+        osm_gps_map_track_point_moved (track, pos);
+        return;
+    }
+
+    /* we don't know which */
+    osm_gps_map_track_project (track, 0, track->priv->points->len);
+    osm_gps_map_track_lod_truncate (track, 0);
+    osm_gps_map_track_points_changed (track);
+}
+
+static double
+osm_track_lod_distance (const double *a, const double *b, const double *p)
+{
+    double dx = b[0] - a[0];
+    double dy = b[1] - a[1];
+    double len2 = dx * dx + dy * dy;
+    double t = 0.0;
+
+    /* to the segment, not the line, as tracks turn back on themselves */
+    if (len2 > 0.0)
+        t = CLAMP (((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / len2, 0.0, 1.0);
+
+    dx = a[0] + t * dx - p[0];
+    dy = a[1] + t * dy - p[1];
+    return sqrt (dx * dx + dy * dy);
+}
+
+/* Douglas-Peucker, marks the points between first and last to keep */
+static void
+osm_track_lod_simplify (const double *xy, gboolean *keep, int first, int last)
+{
+    GArray *stack = g_array_new (FALSE, FALSE, sizeof (int));
+
+    keep[first] = keep[last] = TRUE;
+    g_array_append_val (stack, first);
+    g_array_append_val (stack, last);
+
+    while (stack->len) {
+        int a = g_array_index (stack, int, stack->len - 2);
+        int b = g_array_index (stack, int, stack->len - 1);
+        int i, furthest = -1;
+        double max = LOD_TOLERANCE;
+
+        g_array_set_size (stack, stack->len - 2);
+
+        for (i = a + 1; i < b; i++) {
+            double d = osm_track_lod_distance (&xy[2*a], &xy[2*b], &xy[2*i]);
+            if (d > max) {
+                max = d;
+                furthest = i;
+            }
+        }
+
+        if (furthest >= 0) {
+            keep[furthest] = TRUE;
+            g_array_append_val (stack, a);
+            g_array_append_val (stack, furthest);
+            g_array_append_val (stack, furthest);
+            g_array_append_val (stack, b);
+        }
+    }
+
+    g_array_free (stack, TRUE);
+}
+
+/* Simplifies the points after the last one already simplified */
+static void
+osm_gps_map_track_lod_update (OsmGpsMapTrack *track, GArray *lod, int zoom)
+{
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    const OsmGpsMapPoint *points;
+    const double *world;
+    gboolean *keep;
+    double *xy;
+    guint start = 0;
+    int i, n, first;
+
+    if (lod->len) {
+        if (g_array_index (lod, guint, lod->len - 1) + 1 >= priv->points->len)
+            return;
+        /* the last point kept was only kept for being the end, so it is
+         * simplified again with the rest, from the one kept before it */
+        if (lod->len >= 2) {
+            start = g_array_index (lod, guint, lod->len - 2);
+            g_array_set_size (lod, lod->len - 2);
+        } else {
+            start = g_array_index (lod, guint, 0);
+            g_array_set_size (lod, 0);
+        }
+    }
+
+    points = &g_array_index (priv->points, OsmGpsMapPoint, start);
+    world = &g_array_index (priv->world, double, 2 * start);
+    n = priv->points->len - start;
+    xy = g_new (double, 2 * n);
+    keep = g_new0 (gboolean, n);
+
+    world2pixel (zoom, world, n, 0.0, 0.0, xy);
+
+    /* both ends of a segment crossing the date line are kept, so that it
+     * is still drawn split in two */
+    for (i = 1, first = 0; i < n; i++) {
+        if (fabs (points[i].rlon - points[i-1].rlon) > M_PI) {
+            osm_track_lod_simplify (xy, keep, first, i - 1);
+            first = i;
+        }
+    }
+    osm_track_lod_simplify (xy, keep, first, n - 1);
+
+    for (i = 0; i < n; i++) {
+        if (keep[i]) {
+            guint index = start + i;
+            g_array_append_val (lod, index);
+        }
+    }
+
+    g_free (xy);
+    g_free (keep);
+}
+
+/* Returns the positions of the points to draw at zoom, leaving out those
+ * which would not move the line by more than half a pixel */
+GArray *
+osm_gps_map_track_get_lod (OsmGpsMapTrack *track, int zoom)
+{
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    GArray *lod;
+
+    zoom = CLAMP (zoom, 0, MAX_ZOOM);
+    lod = priv->lod[zoom];
+    if (!lod) {
+        lod = g_array_new (FALSE, FALSE, sizeof (guint));
+        priv->lod[zoom] = lod;
+    }
+
+    if (priv->points->len)
+        osm_gps_map_track_lod_update (track, lod, zoom);
+
+    return lod;
+}
+
+static void
+osm_gps_map_track_hit_add (OsmTileIndex *hit, int zoom, double x, double y, guint entry)
+{
+    guint64 key = OSM_TILE_KEY (0, zoom, (int)floor (x / HIT_CELL), (int)floor (y / HIT_CELL));
+    GArray *cell = osm_tile_index_lookup (hit, key);
+
+    if (!cell) {
+        cell = g_array_new (FALSE, FALSE, sizeof (guint));
+        osm_tile_index_insert (hit, key, cell);
+    }
+    g_array_append_val (cell, entry);
+}
+
+/* Cells hold the position of a point shifted left by one, with the low
+ * bit set for the breaker before it */
+static void
+osm_gps_map_track_hit_build (OsmGpsMapTrack *track, int zoom, gboolean closed)
+{
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    guint i, n = priv->points->len;
+    double *xy = g_new (double, 2 * n);
+
+    priv->hit = osm_tile_index_new ((GDestroyNotify)g_array_unref);
+    priv->hit_zoom = zoom;
+    priv->hit_closed = closed;
+
+    world2pixel (zoom, (const double *)priv->world->data, n, 0.0, 0.0, xy);
+    for (i = 0; i < n; i++) {
+        osm_gps_map_track_hit_add (priv->hit, zoom, xy[2*i], xy[2*i+1], i << 1);
+        if (i > 0)
+            osm_gps_map_track_hit_add (priv->hit, zoom,
+                                       (xy[2*i-2] + xy[2*i]) / 2, (xy[2*i-1] + xy[2*i+1]) / 2,
+                                       (i << 1) | 1);
+    }
+    if (closed && n > 1)
+        osm_gps_map_track_hit_add (priv->hit, zoom,
+                                   (xy[2*n-2] + xy[0]) / 2, (xy[2*n-1] + xy[1]) / 2,
+                                   (n << 1) | 1);
+    g_free (xy);
+}
+
+OsmGpsMapHit_t
+osm_gps_map_track_hit_test (OsmGpsMapTrack *track, int zoom, double x, double y,
+                            double radius, gboolean breakers, gboolean closed, int *index)
+{
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    const double *world = (const double *)priv->world->data;
+    const double scale = (double)TILESIZE * (1 << zoom);
+    OsmGpsMapHit_t best = OSM_GPS_MAP_HIT_NONE;
+    double best_d2 = radius * radius;
+    guint n = priv->points->len;
+    int cx, cy;
+
+    if (n == 0)
+        return OSM_GPS_MAP_HIT_NONE;
+
+    if (!priv->hit || priv->hit_zoom != zoom || priv->hit_closed != closed) {
+        osm_tile_index_free (priv->hit);
+        osm_gps_map_track_hit_build (track, zoom, closed);
+    }
+
+    for (cx = floor ((x - radius) / HIT_CELL); cx <= floor ((x + radius) / HIT_CELL); cx++) {
+        for (cy = floor ((y - radius) / HIT_CELL); cy <= floor ((y + radius) / HIT_CELL); cy++) {
+            GArray *cell = osm_tile_index_lookup (priv->hit, OSM_TILE_KEY (0, zoom, cx, cy));
+            guint j;
+
+            if (!cell)
+                continue;
+
+            for (j = 0; j < cell->len; j++) {
+                guint entry = g_array_index (cell, guint, j);
+                guint i = entry >> 1;
+                OsmGpsMapHit_t kind;
+                double px, py, d2;
+
+                if (entry & 1) {
+                    /* between i - 1 and i, or the last and first */
+                    guint a = (i == n) ? n - 1 : i - 1;
+                    guint b = (i == n) ? 0 : i;
+                    if (!breakers)
+                        continue;
+                    kind = OSM_GPS_MAP_HIT_BREAKER;
+                    px = (world[2*a] + world[2*b]) / 2 * scale;
+                    py = (world[2*a+1] + world[2*b+1]) / 2 * scale;
+                } else {
+                    kind = OSM_GPS_MAP_HIT_POINT;
+                    px = world[2*i] * scale;
+                    py = world[2*i+1] * scale;
+                }
+
+                d2 = (px - x) * (px - x) + (py - y) * (py - y);
+                if (d2 > radius * radius)
+                    continue;
+                if (best == OSM_GPS_MAP_HIT_NONE ||
+                    (kind == OSM_GPS_MAP_HIT_POINT && best == OSM_GPS_MAP_HIT_BREAKER) ||
+                    (kind == best && d2 < best_d2)) {
+                    best = kind;
+                    best_d2 = d2;
+                    if (index)
+                        *index = i;
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
 static void
 osm_gps_map_track_get_property (GObject    *object,
                                 guint       property_id,
@@ -87,7 +444,7 @@ osm_gps_map_track_get_property (GObject    *object,
             g_value_set_boolean(value, priv->visible);
             break;
         case PROP_TRACK:
-            g_value_set_pointer(value, priv->track);
+            g_value_set_pointer(value, osm_gps_map_track_get_points(OSM_GPS_MAP_TRACK(object)));
             break;
         case PROP_LINE_WIDTH:
             g_value_set_float(value, priv->linewidth);
@@ -119,9 +476,19 @@ osm_gps_map_track_set_property (GObject      *object,
         case PROP_VISIBLE:
             priv->visible = g_value_get_boolean (value);
             break;
-        case PROP_TRACK:
-            priv->track = g_value_get_pointer (value);
-            break;
+        case PROP_TRACK: {
+            /* the track takes the points, and keeps copies */
+            GSList *list = g_value_get_pointer (value);
+            osm_gps_map_track_drop_list (OSM_GPS_MAP_TRACK(object));
+            g_array_set_size (priv->points, 0);
+            g_array_set_size (priv->world, 0);
+            for (; list; list = g_slist_delete_link (list, list)) {
+                g_array_append_vals (priv->points, list->data, 1);
+                g_free (list->data);
+            }
+            osm_gps_map_track_project_appended (OSM_GPS_MAP_TRACK(object));
+            osm_gps_map_track_lod_truncate (OSM_GPS_MAP_TRACK(object), 0);
+            } break;
         case PROP_LINE_WIDTH:
             priv->linewidth = g_value_get_float (value);
             break;
@@ -148,11 +515,10 @@ osm_gps_map_track_dispose (GObject *object)
     g_return_if_fail (OSM_GPS_MAP_IS_TRACK (object));
     OsmGpsMapTrackPrivate *priv = OSM_GPS_MAP_TRACK(object)->priv;
 
-    if (priv->track) {
-        g_slist_foreach(priv->track, (GFunc) g_free, NULL);
-        g_slist_free(priv->track);
-        priv->track = NULL;
-    }
+    osm_gps_map_track_drop_list (OSM_GPS_MAP_TRACK(object));
+    g_array_set_size (priv->points, 0);
+    g_array_set_size (priv->world, 0);
+    osm_gps_map_track_lod_truncate (OSM_GPS_MAP_TRACK(object), 0);
 
     G_OBJECT_CLASS (osm_gps_map_track_parent_class)->dispose (object);
 }
@@ -160,6 +526,17 @@ osm_gps_map_track_dispose (GObject *object)
 static void
 osm_gps_map_track_finalize (GObject *object)
 {
+    OsmGpsMapTrackPrivate *priv = OSM_GPS_MAP_TRACK(object)->priv;
+    int zoom;
+
+    g_array_free (priv->points, TRUE);
+    g_array_free (priv->world, TRUE);
+    osm_tile_index_free (priv->hit);
+    for (zoom = 0; zoom <= MAX_ZOOM; zoom++) {
+        if (priv->lod[zoom])
+            g_array_free (priv->lod[zoom], TRUE);
+    }
+
     G_OBJECT_CLASS (osm_gps_map_track_parent_class)->finalize (object);
 }
 
@@ -185,7 +562,7 @@ osm_gps_map_track_class_init (OsmGpsMapTrackClass *klass)
                                      PROP_TRACK,
                                      g_param_spec_pointer ("track",
                                                            "track",
-                                                           "list of points for the track",
+                                                           "list of points for the track, only valid until it is next changed",
                                                            G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 
     g_object_class_install_property (object_class,
@@ -249,7 +626,7 @@ osm_gps_map_track_class_init (OsmGpsMapTrackClass *klass)
 	                            0,
 	                            NULL,
 	                            NULL,
-	                            g_cclosure_marshal_VOID__VOID,
+	                            g_cclosure_marshal_VOID__INT,
 	                            G_TYPE_NONE,
 	                            1,
 	                            G_TYPE_INT);
@@ -281,10 +658,15 @@ static void
 osm_gps_map_track_init (OsmGpsMapTrack *self)
 {
     self->priv = osm_gps_map_track_get_instance_private(self);
+    self->priv->points = g_array_new (FALSE, FALSE, sizeof (OsmGpsMapPoint));
+    self->priv->world = g_array_new (FALSE, FALSE, sizeof (double));
 
     self->priv->color.red = DEFAULT_R;
     self->priv->color.green = DEFAULT_G;
     self->priv->color.blue = DEFAULT_B;
+
+    /* points are changed in place, so the simplified ones are stale */
+    g_signal_connect (self, "point-changed", G_CALLBACK (on_point_changed), NULL);
 }
 
 void
@@ -293,23 +675,41 @@ osm_gps_map_track_add_point (OsmGpsMapTrack *track, const OsmGpsMapPoint *point)
     g_return_if_fail (OSM_GPS_MAP_IS_TRACK (track));
     OsmGpsMapTrackPrivate *priv = track->priv;
 
-    OsmGpsMapPoint *p = g_boxed_copy (OSM_TYPE_GPS_MAP_POINT, point);
-    priv->track = g_slist_append (priv->track, p);
-    g_signal_emit (track, signals[POINT_ADDED], 0, p);
+    osm_gps_map_track_drop_list (track);
+    g_array_append_vals (priv->points, point, 1);
+    osm_gps_map_track_project_appended (track);
+    g_signal_emit (track, signals[POINT_ADDED], 0,
+                   &g_array_index (priv->points, OsmGpsMapPoint, priv->points->len - 1));
+}
+
+void
+osm_gps_map_track_add_points (OsmGpsMapTrack *track, const OsmGpsMapPoint *points, guint n_points)
+{
+    g_return_if_fail (OSM_GPS_MAP_IS_TRACK (track));
+    g_return_if_fail (points != NULL || n_points == 0);
+
+    osm_gps_map_track_drop_list (track);
+    g_array_append_vals (track->priv->points, points, n_points);
+    osm_gps_map_track_project_appended (track);
+    g_object_notify (G_OBJECT (track), "track");
 }
 
 void
 osm_gps_map_track_remove_point(OsmGpsMapTrack* track, int pos)
 {
     OsmGpsMapTrackPrivate *priv = track->priv;
-    gpointer pgl = g_slist_nth_data(priv->track, pos);
-    priv->track = g_slist_remove(priv->track, pgl);
+    if (pos >= 0 && (guint)pos < priv->points->len) {
+        osm_gps_map_track_drop_list (track);
+        g_array_remove_index (priv->points, pos);
+        g_array_remove_range (priv->world, 2 * pos, 2);
+        osm_gps_map_track_lod_truncate (track, pos);
+    }
     g_signal_emit(track, signals[POINT_REMOVED], 0, pos);
 }
 
 int osm_gps_map_track_n_points(OsmGpsMapTrack* track)
 {
-    return g_slist_length(track->priv->track);
+    return track->priv->points->len;
 }
 
 void
@@ -318,24 +718,78 @@ osm_gps_map_track_insert_point (OsmGpsMapTrack* track, OsmGpsMapPoint* np, int p
     // TODO: const OsmGpsMapPoint * like add_point (1.3)
     g_return_if_fail (OSM_GPS_MAP_IS_TRACK (track));
     OsmGpsMapTrackPrivate *priv = track->priv;
+    double pos_world[2] = { 0.0, 0.0 };
 
-    OsmGpsMapPoint *p = g_boxed_copy (OSM_TYPE_GPS_MAP_POINT, np);
-    priv->track = g_slist_insert (priv->track, p, pos);
+    /* like g_slist_insert, out of range appends */
+    if (pos < 0 || (guint)pos > priv->points->len)
+        pos = priv->points->len;
+
+    osm_gps_map_track_drop_list (track);
+    g_array_insert_vals (priv->points, pos, np, 1);
+    g_array_insert_vals (priv->world, 2 * pos, pos_world, 2);
+    osm_gps_map_track_project (track, pos, 1);
+    osm_gps_map_track_lod_truncate (track, pos);
     g_signal_emit (track, signals[POINT_INSERTED], 0, pos);
 }
 
 OsmGpsMapPoint* osm_gps_map_track_get_point(OsmGpsMapTrack* track, int pos)
 {
     OsmGpsMapTrackPrivate* priv = track->priv;
-    return g_slist_nth_data(priv->track, pos);
+    if (pos < 0 || (guint)pos >= priv->points->len)
+        return NULL;
+    return &g_array_index(priv->points, OsmGpsMapPoint, pos);
+}
+
+void
+osm_gps_map_track_set_point (OsmGpsMapTrack *track, int pos, const OsmGpsMapPoint *point)
+{
+    g_return_if_fail (OSM_GPS_MAP_IS_TRACK (track));
+    OsmGpsMapTrackPrivate *priv = track->priv;
+    g_return_if_fail (pos >= 0 && (guint)pos < priv->points->len);
+
+    g_array_index(priv->points, OsmGpsMapPoint, pos) = *point;
+    /* even if the handler is blocked */
+    osm_gps_map_track_point_moved (track, pos);
+    g_signal_emit (track, signals[POINT_CHANGED], 0, pos);
 }
 
+guint
+osm_gps_map_track_get_stamp (OsmGpsMapTrack *track)
+{
+    return track->priv->stamp;
+}
+
+const double *
+osm_gps_map_track_get_world (OsmGpsMapTrack *track)
+{
+    return (const double *)track->priv->world->data;
+}
+
+const OsmGpsMapPoint *
+osm_gps_map_track_get_point_array (OsmGpsMapTrack *track, guint *n_points)
+{
+    g_return_val_if_fail (OSM_GPS_MAP_IS_TRACK (track), NULL);
+
+    if (n_points)
+        *n_points = track->priv->points->len;
+    return (const OsmGpsMapPoint *)track->priv->points->data;
+}
 
 GSList *
 osm_gps_map_track_get_points (OsmGpsMapTrack *track)
 {
+    OsmGpsMapTrackPrivate *priv;
+    guint i;
+
     g_return_val_if_fail (OSM_GPS_MAP_IS_TRACK (track), NULL);
-    return track->priv->track;
+    priv = track->priv;
+
+    if (!priv->track) {
+        for (i = priv->points->len; i > 0; i--)
+            priv->track = g_slist_prepend (priv->track,
+                                           &g_array_index (priv->points, OsmGpsMapPoint, i - 1));
+    }
+    return priv->track;
 }
 
 void
@@ -359,21 +813,21 @@ osm_gps_map_track_get_color (OsmGpsMapTrack *track, GdkRGBA *color)
 double
 osm_gps_map_track_get_length(OsmGpsMapTrack* track)
 {
-    GSList* points = track->priv->track;
+    GArray* points = track->priv->points;
     double ret = 0;
     OsmGpsMapPoint* point_a = NULL;
     OsmGpsMapPoint* point_b = NULL;
+    guint i;
 
-    while(points)
+    for (i = 0; i < points->len; i++)
     {
         point_a = point_b;
-        point_b = points->data;
+        point_b = &g_array_index(points, OsmGpsMapPoint, i);
         if(point_a)
         {
             ret += acos(sin(point_a->rlat)*sin(point_b->rlat)
                     + cos(point_a->rlat)*cos(point_b->rlat)*cos(point_b->rlon-point_a->rlon)) * 6371109; //the mean raduis of earth
         }
-        points = points->next;
     }
     return ret;
 }
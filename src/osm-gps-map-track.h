@@ -84,7 +84,10 @@ void                osm_gps_map_track_add_point     (OsmGpsMapTrack *track, cons
  * osm_gps_map_track_get_points:
  * @track: (in): a #OsmGpsMapTrack
  *
- * Get list of points in the track
+ * Get list of points in the track. The list and its points are only
+ * valid until the track is next changed. Like those of
+ * osm_gps_map_track_get_point(), points changed in place need
+ * #OsmGpsMapTrack::point-changed to be drawn where they now are.
  *
  * Returns: (element-type OsmGpsMapPoint) (transfer none): list of #OsmGpsMapPoint
  * Since: 0.7.0
@@ -150,7 +153,10 @@ void                osm_gps_map_track_insert_point(OsmGpsMapTrack* track, OsmGps
  * @track: a #OsmGpsMapTrack
  * @pos: Position of the point to get
  *
- * Get a #OsmGpsMapPoint point at @pos of given track
+ * Get a #OsmGpsMapPoint point at @pos of given track. The point is only
+ * valid until the track is next changed. A point changed in place is only
+ * drawn where it now is once #OsmGpsMapTrack::point-changed is emitted
+ * for it, use osm_gps_map_track_set_point() instead.
  *
  * Returns: (transfer none): a #OsmGpsMapPoint
  * Since: 1.1.0
@@ -168,6 +174,49 @@ OsmGpsMapPoint*     osm_gps_map_track_get_point(OsmGpsMapTrack* track, int pos);
  **/
 double              osm_gps_map_track_get_length(OsmGpsMapTrack* track);
 
+/**
+ * osm_gps_map_track_add_points:
+ * @track: (in): a #OsmGpsMapTrack
+ * @points: (array length=n_points): points to add
+ * @n_points: the number of points
+ *
+ * Add many points to the end of the track at once. This is much faster
+ * than calling osm_gps_map_track_add_point() for each. Instead of
+ * #OsmGpsMapTrack::point-added for each point, notify::track is emitted
+ * once.
+ *
+ * Since: 1.3.0
+ **/
+void                osm_gps_map_track_add_points(OsmGpsMapTrack *track, const OsmGpsMapPoint *points, guint n_points);
+
+/**
+ * osm_gps_map_track_set_point:
+ * @track: (in): a #OsmGpsMapTrack
+ * @pos: Position of the point to change
+ * @point: (in): the new location
+ *
+ * Move the point at @pos to @point, and emit
+ * #OsmGpsMapTrack::point-changed
+ *
+ * Since: 1.3.0
+ **/
+void                osm_gps_map_track_set_point(OsmGpsMapTrack *track, int pos, const OsmGpsMapPoint *point);
+
+/**
+ * osm_gps_map_track_get_point_array:
+ * @track: (in): a #OsmGpsMapTrack
+ * @n_points: (out) (optional): the number of points
+ *
+ * Get all the points of the track, stored one after the other. Like the
+ * points returned by osm_gps_map_track_get_point() and
+ * osm_gps_map_track_get_points(), the array is only valid until the
+ * track is next changed.
+ *
+ * Returns: (array length=n_points) (transfer none): the points
+ * Since: 1.3.0
+ **/
+const OsmGpsMapPoint *osm_gps_map_track_get_point_array(OsmGpsMapTrack *track, guint *n_points);
+
 
 G_END_DECLS
 
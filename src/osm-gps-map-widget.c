@@ -141,20 +141,59 @@
 #include "osm-gps-map-source.h"
 #include "osm-gps-map-widget.h"
 #include "osm-gps-map-compat.h"
+#include "image-index.h"
+#include "tile-index.h"
+#include "tile-store.h"
 
 #define ENABLE_DEBUG                (0)
-#define EXTRA_BORDER                (0)
+/* for messages in the per tile drawing path, which is otherwise free of
+ * allocations (g_debug formats the message even if it is not shown) */
+#if ENABLE_DEBUG
+#define tile_debug(...)             g_debug(__VA_ARGS__)
+#else
+#define tile_debug(...)             G_STMT_START { } G_STMT_END
+#endif
 #define OSM_GPS_MAP_SCROLL_STEP     (10)
 #define USER_AGENT                  "libosmgpsmap/" VERSION
 #define DOWNLOAD_RETRIES            3
-#define MAX_DOWNLOAD_TILES          10000
+#define MAX_DECODE_THREADS          4
+#define MAX_DOWNLOADS_PER_HOST      4
+/* tiles written between syncs of the tile store, if tile-cache-sync */
+#define WRITE_SYNC_BATCH            64
+#define TILE_CACHE_BYTES            (64 * 1024 * 1024)
 #define DOT_RADIUS                  4.0
+/* kinetic scrolling slows down by 1/e every KINETIC_TIME_CONSTANT seconds,
+ * and only starts if the pointer was still moving faster than
+ * KINETIC_MIN_VELOCITY pixels per second when released */
+#define KINETIC_TIME_CONSTANT       0.325
+#define KINETIC_MIN_VELOCITY        100.0
+#define KINETIC_MAX_VELOCITY        8000.0
+
+/* A write thread, and what it keeps. Left to finish on its own when the
+ * tile store is replaced, so it is held by the map and every queued
+ * OsmTileWrite */
+typedef struct {
+    gint ref_count;
+    GThreadPool *pool;
+    /* queued and not yet written, atomic */
+    gint queued;
+    /* written since the last sync, only used by the write thread */
+    guint unsynced;
+    /* tile-cache-sync, atomic */
+    gint sync;
+} OsmWriteQueue;
 
 struct _OsmGpsMapPrivate
 {
-    GHashTable *tile_queue;
-    GHashTable *missing_tiles;
-    GHashTable *tile_cache;
+    /* all these are keyed by OSM_TILE_KEY */
+    OsmTileIndex *tile_queue;
+    OsmTileIndex *missing_tiles;
+    /* OsmDownloadHost by host name, see osm_gps_map_download_pump */
+    GHashTable *download_hosts;
+    guint idle_download_pump;
+    /* running OsmGpsMapDownloadJob */
+    GSList *download_jobs;
+    OsmTileIndex *tile_cache;
 
     int map_zoom;
     int max_zoom;
@@ -172,11 +211,46 @@ struct _OsmGpsMapPrivate
     gfloat center_rlat;
     gfloat center_rlon;
 
-    guint max_tile_cache_size;
-    /* Incremented at each redraw */
-    guint redraw_cycle;
-    /* ID of the idle redraw operation */
-    guint idle_map_redraw;
+    /* OsmCachedTile in tile_cache, most recently used first */
+    GQueue tile_cache_lru;
+    guint64 tile_cache_bytes;
+    guint64 max_tile_cache_bytes;
+    /* ID of the tick callback which brings the surfaces up to date at the
+     * next frame, 0 if none is pending */
+    guint tick_map_redraw;
+
+    /* While the zoom changes, the map as it was last drawn is shown scaled
+     * from one zoom to the other, and the surfaces are only drawn again at
+     * the end. Views are the world position at the center of the widget and
+     * the pixels across the world, as in osm_gps_map_get_view() */
+    guint zoom_animation_duration;
+    guint tick_zoom_animation;
+    gint64 zoom_animation_start;
+    cairo_surface_t *zoom_snapshot;
+    /* world position of the top left of zoom_snapshot, and its scale */
+    double zoom_snapshot_view[3];
+    double zoom_from[3];
+    double zoom_to_scale;
+    /* the world position which stays in the same place on the widget */
+    double zoom_fixed[2];
+    double zoom_view[3];
+
+    /* Tiles are read from the tile store and decoded in a thread pool. The
+     * results are handed back to the main loop through decode_results, in
+     * batches, by the idle_decode_complete source */
+    GThreadPool *decode_pool;
+    /* cache keys of the tiles currently being read from the tile store */
+    OsmTileIndex *decode_queue;
+    GAsyncQueue *decode_results;
+    guint idle_decode_complete;
+    gint decode_idle_pending;
+    /* bumped when the tile source changes, stale results are discarded */
+    gint decode_generation;
+
+    /* Downloaded tiles are written to the tile store by a single thread,
+     * so that the main loop never waits for the disk */
+    OsmWriteQueue *write_queue;
+    gint tile_cache_sync;
 
     //how we download tiles
     SoupSession *soup_session;
@@ -187,6 +261,7 @@ struct _OsmGpsMapPrivate
     char *tile_dir;
     char *tile_base_dir;
     char *cache_dir;
+    OsmTileStore *tile_store;
 
     //contains flags indicating the various special characters
     //the uri string contains, that will be replaced when calculating
@@ -195,6 +270,8 @@ struct _OsmGpsMapPrivate
     char *repo_uri;
     char *image_format;
     int uri_format;
+    /* identifies repo_uri in tile keys, a new one each time it changes */
+    guint8 tile_source;
 
     //gps tracking state
     GSList *trip_history;
@@ -207,30 +284,65 @@ struct _OsmGpsMapPrivate
     //additional images or tracks added to the map
     GSList *tracks;
     GSList *images;
+    /* the same images, by where they are */
+    OsmImageIndex *image_index;
     GSList *polygons;
+    /* the outlines of the polygons, as last drawn */
+    GHashTable *polygon_cache;
 
-    //Used for storing the joined tiles
+    //Used for storing the joined tiles, with pixmap_border pixels on every
+    //side more than is visible
     cairo_surface_t *pixmap;
+    //The same size as pixmap, the map is scrolled by copying into it
+    cairo_surface_t *pixmap_spare;
+    /* GdkRectangle, in pixels from the top left of the world at map_zoom,
+     * covered by tiles which arrived since pixmap was drawn */
+    GArray *dirty_tiles;
+    //Tracks, polygons and images, drawn over pixmap. The gps point and the
+    //layers are drawn over both in osm_gps_map_draw()
+    cairo_surface_t *overlay;
+    cairo_surface_t *overlay_spare;
+    //Where pixmap and overlay were drawn, so that a pan only draws what
+    //was exposed
+    int pixmap_map_x;
+    int pixmap_map_y;
+    int pixmap_zoom;
 
     //The tile painted when one cannot be found
-    GdkPixbuf *null_tile;
+    cairo_surface_t *null_tile;
 
     //A list of OsmGpsMapLayer* layers, such as the OSD
     GSList *layers;
 
     //For tracking click and drag
     int drag_counter;
-    int drag_mouse_dx;
-    int drag_mouse_dy;
     int drag_start_mouse_x;
     int drag_start_mouse_y;
     int drag_start_map_x;
     int drag_start_map_y;
     int drag_limit;
-    guint drag_expose_source;
+    /* the last drag position, and how fast the map was moving, in pixels per
+     * second, for kinetic scrolling */
+    int drag_last_mouse_x;
+    int drag_last_mouse_y;
+    gint64 drag_last_time;
+    double drag_velocity[2];
+
+    /* Kinetic scrolling: after a drag the map keeps moving from
+     * kinetic_from, slowing down until it stops at kinetic_to. The tiles
+     * there are loaded while it moves */
+    guint tick_kinetic;
+    gint64 kinetic_start;
+    int kinetic_from[2];
+    double kinetic_velocity[2];
+    int kinetic_to[2];
+    /* tiles drawn around the visible map, so that they are ready to be
+     * dragged into view. pixmap_border is the same in pixels */
+    guint drag_margin;
+    int pixmap_border;
 
     /* Properties for dragging a point with right mouse button. */
-    OsmGpsMapPoint* drag_point;
+    int drag_point;
     OsmGpsMapTrack* drag_track;
 
     /* for customizing the redering of the gps track */
@@ -247,6 +359,9 @@ struct _OsmGpsMapPrivate
     guint trip_history_record_enabled : 1;
     guint trip_history_show_enabled : 1;
     guint gps_point_enabled : 1;
+    guint tile_cache_packed : 1;
+    guint image_clustering : 1;
+    guint kinetic_scrolling : 1;
 
     /* state flags */
     guint is_disposed : 1;
@@ -256,27 +371,96 @@ struct _OsmGpsMapPrivate
     guint is_fullscreen : 1;
     guint is_google : 1;
     guint is_dragging_point : 1;
+    /* pixmap shows the current tiles at pixmap_map_x,y, only the position
+     * changed since */
+    guint pixmap_valid : 1;
+    /* the same for overlay, and the current tracks, polygons and images */
+    guint overlay_valid : 1;
 };
 
 typedef struct
 {
-    GdkPixbuf *pixbuf;
-    /* We keep track of the number of the redraw cycle this tile was last used,
-     * so that osm_gps_map_purge_cache() can remove the older ones */
-    guint redraw_cycle;
+    /* the decoded tile, ready to paint */
+    cairo_surface_t *surface;
+    /* memory used by the surface */
+    gsize bytes;
+    /* the key in tile_cache */
+    guint64 key;
+    /* the zoom level the image data came from. For a tile rendered from
+     * another zoom level this differs from the zoom in key, and the tile
+     * is provisional: it is only shown until the real one is loaded */
+    int detail_zoom;
+    gboolean provisional;
+    /* position in priv->tile_cache_lru, so that the least recently used
+     * tile can be found, and a tile moved to the front, in constant time */
+    GList link;
+    OsmGpsMapPrivate *priv;
 } OsmCachedTile;
 
+typedef struct {
+    char *name;
+    /* OsmTileDownload waiting for a connection, most important first when
+     * sorted is set */
+    GQueue pending;
+    /* OsmTileDownload being downloaded */
+    GQueue active;
+    gboolean sorted;
+} OsmDownloadHost;
+
 typedef struct {
     /* The details of the tile to download */
     char *uri;
-    char *folder;
-    char *filename;
+    guint64 key;
+    int zoom;
+    int x;
+    int y;
     OsmGpsMap *map;
+    /* the tile source and store the tile was requested for, a tile which
+     * arrives after the source changed is dropped */
+    guint8 source;
+    OsmTileStore *store;
     /* whether to redraw the map when the tile arrives */
     gboolean redraw;
     int ttl;
+    /* the request, until it is started */
+    SoupMessage *msg;
+    OsmDownloadHost *host;
+    GCancellable *cancellable;
+    /* download order, lowest first */
+    int priority_class;
+    double priority;
+    /* the OsmGpsMapDownloadJobs waiting for the tile, if any */
+    GSList *jobs;
 } OsmTileDownload;
 
+typedef struct {
+    /* The details of the tile to decode */
+    guint64 key;
+    int zoom;
+    int x;
+    int y;
+    /* the encoded tile, if NULL it is read from the tile store */
+    GBytes *bytes;
+    /* download the tile if it is not in the tile store */
+    gboolean download;
+    OsmGpsMap *map;
+    gint generation;
+    /* the result, NULL if the tile is not stored or could not be decoded */
+    cairo_surface_t *surface;
+} OsmTileDecode;
+
+typedef struct {
+    OsmWriteQueue *queue;
+    OsmTileStore *store;
+    int zoom;
+    int x;
+    int y;
+    GBytes *bytes;
+    /* OsmGpsMapDownloadJobs told once the tile is written */
+    GSList *jobs;
+    gboolean stored;
+} OsmTileWrite;
+
 enum
 {
     PROP_0,
@@ -305,7 +489,14 @@ enum
     PROP_IMAGE_FORMAT,
     PROP_DRAG_LIMIT,
     PROP_AUTO_CENTER_THRESHOLD,
-    PROP_SHOW_GPS_POINT
+    PROP_SHOW_GPS_POINT,
+    PROP_TILE_CACHE_PACKED,
+    PROP_TILE_CACHE_BYTES,
+    PROP_TILE_CACHE_SYNC,
+    PROP_DRAG_MARGIN,
+    PROP_IMAGE_CLUSTERING,
+    PROP_ZOOM_ANIMATION_DURATION,
+    PROP_KINETIC_SCROLLING
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (OsmGpsMap, osm_gps_map, GTK_TYPE_DRAWING_AREA);
@@ -317,12 +508,21 @@ static gchar    *replace_string(const gchar *src, const gchar *from, const gchar
 static gchar    *replace_map_uri(OsmGpsMap *map, const gchar *uri, int zoom, int x, int y);
 static void     osm_gps_map_tile_download_complete (SoupSession *session, GAsyncResult *result, gpointer user_data);
 static void     osm_gps_map_download_tile (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw);
-static GdkPixbuf* osm_gps_map_render_tile_upscaled (OsmGpsMap *map, GdkPixbuf *tile, int tile_zoom, int zoom, int x, int y);
+static gboolean osm_gps_map_download_tile_full (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw, OsmGpsMapDownloadJob *job);
+static void     osm_gps_map_queue_decode (OsmGpsMap *map, int zoom, int x, int y, GBytes *bytes, gboolean download);
+static void     osm_gps_map_prefetch_tiles (OsmGpsMap *map, int map_x, int map_y);
+static cairo_surface_t* osm_gps_map_render_tile_upscaled (OsmGpsMap *map, cairo_surface_t *tile, int tile_zoom, int zoom, int x, int y);
+static void     center_coord_update(OsmGpsMap *map);
+static void     osm_gps_map_map_update_idle (OsmGpsMap *map);
 
 static void
 cached_tile_free (OsmCachedTile *tile)
 {
-    g_object_unref (tile->pixbuf);
+    OsmGpsMapPrivate *priv = tile->priv;
+
+    g_queue_unlink (&priv->tile_cache_lru, &tile->link);
+    priv->tile_cache_bytes -= tile->bytes;
+    cairo_surface_destroy (tile->surface);
     g_slice_free (OsmCachedTile, tile);
 }
 
@@ -601,42 +801,91 @@ draw_white_rectangle(cairo_t *cr, double x, double y, double width, double heigh
     cairo_restore (cr);
 }
 
+/* A circle, bigger for more images, with the number of images in it */
+static void
+osm_gps_map_print_cluster (cairo_t *cr, const OsmImageCluster *cluster, int map_x0, int map_y0)
+{
+    char count[16];
+    cairo_text_extents_t extents;
+    double x = cluster->x - map_x0;
+    double y = cluster->y - map_y0;
+    double r = MIN(12 + 3 * log10 (cluster->count), OSM_IMAGE_CLUSTER_SIZE / 2);
+
+    g_snprintf (count, sizeof (count), "%u", cluster->count);
+
+    cairo_arc (cr, x, y, r, 0, 2 * M_PI);
+    cairo_set_source_rgba (cr, 0.1, 0.4, 0.8, 0.8);
+    cairo_fill_preserve (cr);
+    cairo_set_line_width (cr, 2);
+    cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
+    cairo_stroke (cr);
+
+    cairo_select_font_face (cr, "Sans",
+                            CAIRO_FONT_SLANT_NORMAL,
+                            CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_font_size (cr, 11);
+    cairo_text_extents (cr, count, &extents);
+    cairo_move_to (cr,
+                   x - extents.width / 2 - extents.x_bearing,
+                   y - extents.height / 2 - extents.y_bearing);
+    cairo_show_text (cr, count);
+}
+
 static void
 osm_gps_map_print_images (OsmGpsMap *map, cairo_t *cr)
 {
-    GSList *list;
-    int min_x = 0,min_y = 0,max_x = 0,max_y = 0;
+    GPtrArray *images;
+    GArray *clusters = NULL;
+    double x0, y0, x1, y1;
     int map_x0, map_y0;
+    guint i;
     OsmGpsMapPrivate *priv = map->priv;
 
-    map_x0 = priv->map_x - EXTRA_BORDER;
-    map_y0 = priv->map_y - EXTRA_BORDER;
-    for(list = priv->images; list != NULL; list = list->next)
+    map_x0 = priv->map_x - priv->pixmap_border;
+    map_y0 = priv->map_y - priv->pixmap_border;
+
+    /* only the images which reach into the clip, which may be a lot
+     * smaller than the map after a pan */
+    cairo_clip_extents (cr, &x0, &y0, &x1, &y1);
+    if (priv->image_clustering) {
+        clusters = g_array_new (FALSE, FALSE, sizeof (OsmImageCluster));
+        images = osm_image_index_query_clusters (priv->image_index, priv->map_zoom,
+                                                 x0 + map_x0, y0 + map_y0,
+                                                 x1 + map_x0, y1 + map_y0,
+                                                 clusters);
+    } else {
+        images = osm_image_index_query (priv->image_index, priv->map_zoom,
+                                        x0 + map_x0, y0 + map_y0,
+                                        x1 + map_x0, y1 + map_y0);
+    }
+
+    for (i = 0; i < images->len; i++)
     {
         GdkRectangle loc;
-        OsmGpsMapImage *im = OSM_GPS_MAP_IMAGE(list->data);
-        const OsmGpsMapPoint *pt = osm_gps_map_image_get_point(im);
+        OsmGpsMapImage *im = g_ptr_array_index (images, i);
+        double world[2], xy[2];
 
         /* pixel_x,y, offsets */
-        loc.x = lon2pixel(priv->map_zoom, pt->rlon) - map_x0;
-        loc.y = lat2pixel(priv->map_zoom, pt->rlat) - map_y0;
+        osm_gps_map_image_get_world (im, world);
+        world2pixel (priv->map_zoom, world, 1, map_x0, map_y0, xy);
+        loc.x = floor (xy[0]);
+        loc.y = floor (xy[1]);
 
         osm_gps_map_image_draw (
                          im,
                          cr,
                          &loc);
-
-        max_x = MAX(loc.x + loc.width, max_x);
-        min_x = MIN(loc.x - loc.width, min_x);
-        max_y = MAX(loc.y + loc.height, max_y);
-        min_y = MIN(loc.y - loc.height, min_y);
     }
 
-    gtk_widget_queue_draw_area (
-                                GTK_WIDGET(map),
-                                min_x + EXTRA_BORDER, min_y + EXTRA_BORDER,
-                                max_x + EXTRA_BORDER, max_y + EXTRA_BORDER);
+    g_ptr_array_unref (images);
 
+    /* over the images */
+    if (clusters) {
+        for (i = 0; i < clusters->len; i++)
+            osm_gps_map_print_cluster (cr, &g_array_index (clusters, OsmImageCluster, i),
+                                       map_x0, map_y0);
+        g_array_free (clusters, TRUE);
+    }
 }
 
 static void
@@ -645,13 +894,12 @@ osm_gps_map_draw_gps_point (OsmGpsMap *map, cairo_t *cr)
     OsmGpsMapPrivate *priv = map->priv;
     int map_x0, map_y0;
     int x, y;
-    int r, r2, mr;
+    int r, r2;
 
     r = priv->ui_gps_point_inner_radius;
     r2 = priv->ui_gps_point_outer_radius;
-    mr = MAX(3*r,r2);
-    map_x0 = priv->map_x - EXTRA_BORDER;
-    map_y0 = priv->map_y - EXTRA_BORDER;
+    map_x0 = priv->map_x - priv->pixmap_border;
+    map_y0 = priv->map_y - priv->pixmap_border;
     x = lon2pixel(priv->map_zoom, priv->gps->rlon) - map_x0;
     y = lat2pixel(priv->map_zoom, priv->gps->rlat) - map_y0;
 
@@ -698,137 +946,526 @@ osm_gps_map_draw_gps_point (OsmGpsMap *map, cairo_t *cr)
         cairo_arc (cr, x, y, r, 0, 2 * M_PI);
         cairo_stroke(cr);
     }
+}
 
-    gtk_widget_queue_draw_area (GTK_WIDGET(map),
-                                x-mr,
-                                y-mr,
-                                mr*2,
-                                mr*2);
+/* Asks for the area under the gps point to be drawn again, before and
+ * after it moves */
+static void
+osm_gps_map_queue_gps_point (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    int x, y, mr;
+
+    if (!priv->gps_track_used || !priv->gps_point_enabled)
+        return;
+
+    /* the arrow is 3r long, plus the line widths */
+    mr = MAX(3*priv->ui_gps_point_inner_radius, priv->ui_gps_point_outer_radius) + 2;
+    x = lon2pixel(priv->map_zoom, priv->gps->rlon) - priv->map_x;
+    y = lat2pixel(priv->map_zoom, priv->gps->rlat) - priv->map_y;
+
+    gtk_widget_queue_draw_area (GTK_WIDGET(map), x-mr, y-mr, mr*2, mr*2);
+}
+
+/* paint the part of tile, which is zoom_diff levels above the target tile
+ * x,y, magnified to cover the target */
+static void
+osm_gps_map_paint_tile_upscaled(cairo_t *cr, cairo_surface_t *tile, int zoom_diff,
+                                int x, int y, int offset_x, int offset_y)
+{
+    int area_size, area_x, area_y;
+    int modulo;
+
+    area_size = TILESIZE >> zoom_diff;
+    modulo = 1 << zoom_diff;
+    area_x = (x % modulo) * area_size;
+    area_y = (y % modulo) * area_size;
+
+    cairo_save (cr);
+    cairo_rectangle (cr, offset_x, offset_y, TILESIZE, TILESIZE);
+    cairo_clip (cr);
+    cairo_translate (cr, offset_x, offset_y);
+    cairo_scale (cr, modulo, modulo);
+    cairo_set_source_surface (cr, tile, -area_x, -area_y);
+    cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_NEAREST);
+    cairo_paint (cr);
+    cairo_restore (cr);
 }
 
 static void
-osm_gps_map_blit_tile(OsmGpsMap *map, GdkPixbuf *pixbuf, cairo_t *cr, int offset_x, int offset_y,
+osm_gps_map_blit_tile(OsmGpsMap *map, cairo_surface_t *tile, cairo_t *cr, int offset_x, int offset_y,
                       int tile_zoom, int target_x, int target_y)
 {
     OsmGpsMapPrivate *priv = map->priv;
     int target_zoom = priv->map_zoom;
 
     if (tile_zoom == target_zoom) {
-        g_debug("Blit @ %d,%d", offset_x,offset_y);
-        /* draw pixbuf */
-        gdk_cairo_set_source_pixbuf (cr, pixbuf, offset_x, offset_y);
+        tile_debug("Blit @ %d,%d", offset_x,offset_y);
+        /* draw surface */
+        cairo_set_source_surface (cr, tile, offset_x, offset_y);
         cairo_paint (cr);
     } else {
-        /* get an upscaled version of the pixbuf */
-        GdkPixbuf *pixmap_scaled = osm_gps_map_render_tile_upscaled (
-                                            map, pixbuf, tile_zoom,
-                                            target_zoom, target_x, target_y);
+        /* magnify the matching part of the tile */
+        osm_gps_map_paint_tile_upscaled (cr, tile, target_zoom - tile_zoom,
+                                         target_x, target_y, offset_x, offset_y);
+    }
+}
 
-        osm_gps_map_blit_tile (map, pixmap_scaled, cr, offset_x, offset_y,
-                               target_zoom, target_x, target_y);
+#define MSG_RESPONSE_LEN_FORMAT "%"G_GOFFSET_FORMAT
+
+static GdkPixbuf *
+osm_gps_map_decode_tile (GBytes *bytes)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf = NULL;
 
-        g_object_unref (pixmap_scaled);
+    /* let gdk-pixbuf sniff the format, tiles in the cache may not match
+     * the image-format of the current source */
+    loader = gdk_pixbuf_loader_new ();
+    if (gdk_pixbuf_loader_write_bytes (loader, bytes, NULL) &&
+        gdk_pixbuf_loader_close (loader, NULL)) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+        if (pixbuf)
+            g_object_ref (pixbuf);
+    } else {
+        gdk_pixbuf_loader_close (loader, NULL);
+        g_warning("Error: Decoding of image failed");
     }
+    g_object_unref (loader);
+
+    return pixbuf;
 }
 
-#define MSG_RESPONSE_LEN_FORMAT "%"G_GOFFSET_FORMAT
+/* c * a / 255, rounded, without a division */
+static inline guint
+premultiply (guint c, guint a)
+{
+    guint t = c * a + 0x80;
+    return ((t >> 8) + t) >> 8;
+}
+
+/* Convert a decoded tile into a cairo image surface, premultiplying the
+ * alpha if there is any, so that it can be painted as is. Unlike
+ * gdk_cairo_set_source_pixbuf this is safe to call from any thread */
+static cairo_surface_t *
+osm_gps_map_tile_surface_new (GdkPixbuf *pixbuf)
+{
+    int width = gdk_pixbuf_get_width (pixbuf);
+    int height = gdk_pixbuf_get_height (pixbuf);
+    int n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+    int src_stride = gdk_pixbuf_get_rowstride (pixbuf);
+    const guchar *src = gdk_pixbuf_read_pixels (pixbuf);
+    cairo_surface_t *surface;
+    guchar *dst;
+    int dst_stride;
+    int i, j;
+
+    surface = cairo_image_surface_create (n_channels == 4 ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+                                          width, height);
+    if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy (surface);
+        return NULL;
+    }
+
+    cairo_surface_flush (surface);
+    dst = cairo_image_surface_get_data (surface);
+    dst_stride = cairo_image_surface_get_stride (surface);
+
+    for (j = 0; j < height; j++) {
+        const guchar *p = src + j * src_stride;
+        guint32 *q = (guint32 *)(dst + j * dst_stride);
+
+        if (n_channels == 3) {
+            for (i = 0; i < width; i++, p += 3)
+                q[i] = 0xff000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+        } else {
+            for (i = 0; i < width; i++, p += 4) {
+                guint a = p[3];
+                if (a == 0xff) {
+                    q[i] = 0xff000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+                } else if (a == 0) {
+                    q[i] = 0;
+                } else {
+                    q[i] = (a << 24) | (premultiply (p[0], a) << 16) |
+                           (premultiply (p[1], a) << 8) | premultiply (p[2], a);
+                }
+            }
+        }
+    }
+
+    cairo_surface_mark_dirty (surface);
+    return surface;
+}
 
 static void
-osm_gps_map_tile_download_complete (SoupSession *session, GAsyncResult *result, gpointer user_data)
+osm_tile_download_free (OsmTileDownload *dl)
+{
+    if (dl->msg)
+        g_object_unref (dl->msg);
+    g_slist_free_full (dl->jobs, g_object_unref);
+    osm_tile_store_unref (dl->store);
+    g_free (dl->uri);
+    g_free (dl);
+}
+
+static void
+osm_download_host_free (OsmDownloadHost *host)
+{
+    /* only the pending downloads belong to the host, the active ones are
+     * freed by their completion callback */
+    g_queue_foreach (&host->pending, (GFunc)osm_tile_download_free, NULL);
+    g_queue_clear (&host->pending);
+    g_queue_clear (&host->active);
+    g_free (host->name);
+    g_free (host);
+}
+
+/* is the tile (at the zoom level tiles are fetched for the current map zoom)
+ * on screen, or within one tile of it */
+static gboolean
+osm_gps_map_tile_in_view (OsmGpsMap *map, int zoom, int x, int y)
 {
-    FILE *file;
-    OsmTileDownload *dl = (OsmTileDownload *)user_data;
-    OsmGpsMap *map = OSM_GPS_MAP(dl->map);
     OsmGpsMapPrivate *priv = map->priv;
-    gboolean file_saved = FALSE;
+    GtkAllocation allocation;
+    int tile_zoom = priv->map_zoom;
+    int size, x0, y0, x1, y1;
 
-    GError *error = NULL;
-    SoupMessage *msg = soup_session_get_async_result_message(session, result);
-    SoupStatus soup_status = soup_message_get_status(msg);
-    GBytes *body = soup_session_send_and_read_finish (session, result, &error);
+    if (tile_zoom > MIN_ZOOM)
+        tile_zoom -= priv->tile_zoom_offset;
+    if (zoom != tile_zoom)
+        return FALSE;
+
+    gtk_widget_get_allocation(GTK_WIDGET(map), &allocation);
+    size = TILESIZE << (priv->map_zoom - tile_zoom);
+    x0 = x1 = priv->map_x;
+    y0 = y1 = priv->map_y;
+
+    /* or on the way to where kinetic scrolling stops */
+    if (priv->tick_kinetic != 0) {
+        x0 = MIN (x0, priv->kinetic_to[0]);
+        x1 = MAX (x1, priv->kinetic_to[0]);
+        y0 = MIN (y0, priv->kinetic_to[1]);
+        y1 = MAX (y1, priv->kinetic_to[1]);
+    }
 
-    GCancellable *cancellable = (GCancellable *)g_hash_table_lookup(priv->tile_queue, dl->uri);
-    g_object_unref (cancellable);
+    return ((x + 2) * size > x0 - priv->pixmap_border) &&
+           ((x - 1) * size < x1 + allocation.width + priv->pixmap_border) &&
+           ((y + 2) * size > y0 - priv->pixmap_border) &&
+           ((y - 1) * size < y1 + allocation.height + priv->pixmap_border);
+}
 
-    if (SOUP_STATUS_IS_SUCCESSFUL (soup_status)) {
-        /* save tile into cachedir if one has been specified */
-        if (priv->cache_dir) {
-            if (g_mkdir_with_parents(dl->folder,0700) == 0) {
-                file = g_fopen(dl->filename, "wb");
-                if (file != NULL) {
-                    fwrite (g_bytes_get_data(body, NULL), 1, g_bytes_get_size(body), file);
-                    file_saved = TRUE;
-                    g_debug("Wrote "MSG_RESPONSE_LEN_FORMAT" bytes to %s", g_bytes_get_size(body), dl->filename);
-                    fclose (file);
+static void
+osm_gps_map_download_update_priority (OsmTileDownload *dl, OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GtkAllocation allocation;
+    int tile_zoom = priv->map_zoom;
+    double size, dx, dy;
 
-                }
-            } else {
-                g_warning("Error creating tile download directory: %s", dl->folder);
-            }
+    if (tile_zoom > MIN_ZOOM)
+        tile_zoom -= priv->tile_zoom_offset;
+
+    /* bulk downloads (osm_gps_map_download_maps) go after everything needed
+     * for the screen, in the order they were requested */
+    if (!dl->redraw) {
+        dl->priority_class = 2;
+        dl->priority = 0;
+        return;
+    }
+
+    /* then tiles for the current zoom, closest to the center first */
+    gtk_widget_get_allocation(GTK_WIDGET(map), &allocation);
+    size = ldexp(TILESIZE, priv->map_zoom - dl->zoom);
+    dx = (dl->x + 0.5) * size - (priv->map_x + allocation.width / 2);
+    dy = (dl->y + 0.5) * size - (priv->map_y + allocation.height / 2);
+
+    dl->priority_class = (dl->zoom == tile_zoom) ? 0 : 1;
+    dl->priority = dx * dx + dy * dy;
+}
+
+static gint
+osm_gps_map_download_compare (const OsmTileDownload *a, const OsmTileDownload *b, gpointer user_data)
+{
+    if (a->priority_class != b->priority_class)
+        return a->priority_class - b->priority_class;
+    if (a->priority != b->priority)
+        return a->priority < b->priority ? -1 : 1;
+    return 0;
+}
+
+static void
+osm_gps_map_download_start (OsmGpsMap *map, OsmTileDownload *dl)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    SoupMessage *msg = dl->msg;
+
+    dl->msg = NULL;
+    g_queue_push_tail (&dl->host->active, dl);
+
+    g_debug("Download tile: %d,%d z:%d\n\t%s", dl->x, dl->y, dl->zoom, dl->uri);
+
+    /* keep the map around until the callback has run, even if the
+     * download is aborted by osm_gps_map_dispose */
+    g_object_ref (map);
+    soup_session_send_and_read_async(priv->soup_session, msg,
+                            G_PRIORITY_DEFAULT,
+                            dl->cancellable,
+                            (GAsyncReadyCallback)osm_gps_map_tile_download_complete,
+                            dl);
+    /* the soup session holds a reference while sending */
+    g_object_unref (msg);
+}
+
+/* start as many of the queued downloads as the per host limit allows, the
+ * most important ones first */
+static gboolean
+osm_gps_map_download_pump (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GHashTableIter iter;
+    OsmDownloadHost *host;
+
+    priv->idle_download_pump = 0;
+
+    g_hash_table_iter_init (&iter, priv->download_hosts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&host)) {
+        if (host->active.length >= MAX_DOWNLOADS_PER_HOST || host->pending.length == 0)
+            continue;
+
+        if (!host->sorted) {
+            g_queue_foreach (&host->pending, (GFunc)osm_gps_map_download_update_priority, map);
+            g_queue_sort (&host->pending, (GCompareDataFunc)osm_gps_map_download_compare, NULL);
+            host->sorted = TRUE;
         }
 
-        if (dl->redraw) {
-            GdkPixbuf *pixbuf = NULL;
+        while (host->active.length < MAX_DOWNLOADS_PER_HOST && host->pending.length > 0)
+            osm_gps_map_download_start (map, g_queue_pop_head (&host->pending));
+    }
 
-            /* if the file was actually stored on disk, we can simply */
-            /* load and decode it from that file */
-            if (priv->cache_dir) {
-                if (file_saved) {
-                    pixbuf = gdk_pixbuf_new_from_file (dl->filename, NULL);
-                }
-            } else {
-                GdkPixbufLoader *loader;
-                char *extension = strrchr (dl->filename, '.');
-
-                /* parse file directly from memory */
-                if (extension) {
-                    loader = gdk_pixbuf_loader_new_with_type (extension+1, NULL);
-                    if (!gdk_pixbuf_loader_write (loader, (unsigned char*)g_bytes_get_data(body, NULL), g_bytes_get_size(body), NULL))
-                    {
-                        g_warning("Error: Decoding of image failed");
-                    }
-                    gdk_pixbuf_loader_close(loader, NULL);
+    return FALSE;
+}
 
-                    pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+static void
+osm_gps_map_download_pump_idle (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
 
-                    /* give up loader but keep the pixbuf */
-                    g_object_ref(pixbuf);
-                    g_object_unref(loader);
-                } else {
-                    g_warning("Error: Unable to determine image file format");
-                }
+    /* wait for the whole batch of tiles requested by a redraw, so they
+     * can be sorted before any of them is started */
+    if (priv->idle_download_pump == 0)
+        priv->idle_download_pump = g_idle_add ((GSourceFunc)osm_gps_map_download_pump, map);
+}
+
+/* drop queued, and cancel active, downloads of tiles which are no longer on
+ * screen. Tiles requested by osm_gps_map_download_maps are left alone */
+static void
+osm_gps_map_download_cancel_stale (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GHashTableIter iter;
+    OsmDownloadHost *host;
+    GList *l, *next;
+    guint n_dropped = 0;
+
+    g_hash_table_iter_init (&iter, priv->download_hosts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&host)) {
+        for (l = host->pending.head; l != NULL; l = next) {
+            OsmTileDownload *dl = l->data;
+            next = l->next;
+            if (dl->redraw && !osm_gps_map_tile_in_view (map, dl->zoom, dl->x, dl->y)) {
+                /* still wanted by a job, just not for the screen */
+                dl->redraw = FALSE;
+                if (dl->jobs)
+                    continue;
+                g_queue_delete_link (&host->pending, l);
+                osm_tile_index_remove (priv->tile_queue, dl->key);
+                osm_tile_download_free (dl);
+                n_dropped++;
             }
+        }
 
-            /* Store the tile into the cache */
-            if (G_LIKELY (pixbuf)) {
-                OsmCachedTile *tile = g_slice_new (OsmCachedTile);
-                tile->pixbuf = pixbuf;
-                tile->redraw_cycle = priv->redraw_cycle;
-                /* if the tile is already in the cache (it could be one
-                 * rendered from another zoom level), it will be
-                 * overwritten */
-                g_hash_table_insert (priv->tile_cache, dl->filename, tile);
-                /* NULL-ify dl->filename so that it won't be freed, as
-                 * we are using it as a key in the hash table */
-                dl->filename = NULL;
+        for (l = host->active.head; l != NULL; l = l->next) {
+            OsmTileDownload *dl = l->data;
+            if (dl->redraw && !osm_gps_map_tile_in_view (map, dl->zoom, dl->x, dl->y)) {
+                dl->redraw = FALSE;
+                if (!dl->jobs)
+                    g_cancellable_cancel (dl->cancellable);
             }
-            osm_gps_map_map_redraw_idle (map);
         }
-        g_hash_table_remove(priv->tile_queue, dl->uri);
+
+        /* the view moved, so did the priorities */
+        host->sorted = FALSE;
+    }
+
+    if (n_dropped) {
+        g_debug("Dropped %u queued tiles which left the screen", n_dropped);
         g_object_notify(G_OBJECT(map), "tiles-queued");
+    }
+}
+
+static void
+osm_write_queue_unref (OsmWriteQueue *queue)
+{
+    if (g_atomic_int_dec_and_test (&queue->ref_count))
+        g_free (queue);
+}
+
+static void
+osm_tile_write_free (OsmTileWrite *w)
+{
+    if (w->queue)
+        osm_write_queue_unref (w->queue);
+    osm_tile_store_unref (w->store);
+    g_bytes_unref (w->bytes);
+    g_slist_free_full (w->jobs, g_object_unref);
+    g_slice_free (OsmTileWrite, w);
+}
+
+/* back in the main loop, a tile of download jobs was written */
+static gboolean
+osm_gps_map_write_complete (OsmTileWrite *w)
+{
+    GSList *l;
+
+    for (l = w->jobs; l != NULL; l = l->next)
+        osm_gps_map_download_job_tile_done (l->data, w->zoom, w->x, w->y,
+                                            w->stored, g_bytes_get_size (w->bytes));
+    osm_tile_write_free (w);
+    return FALSE;
+}
+
+static void
+osm_gps_map_write_worker (gpointer data, gpointer user_data)
+{
+    OsmTileWrite *w = (OsmTileWrite *)data;
+    OsmWriteQueue *queue = user_data;
+    gboolean last;
+
+    w->stored = osm_tile_store_write (w->store, w->zoom, w->x, w->y, w->bytes);
+    last = g_atomic_int_dec_and_test (&queue->queued);
+
+    /* flush once the queue runs dry, or every so often while it doesn't */
+    if (g_atomic_int_get (&queue->sync)) {
+        queue->unsynced++;
+        if (queue->unsynced >= WRITE_SYNC_BATCH || last) {
+            osm_tile_store_sync (w->store);
+            queue->unsynced = 0;
+        }
+    }
+
+    /* the queue is not used by this thread after the last write */
+    w->queue = NULL;
+    osm_write_queue_unref (queue);
+
+    if (w->jobs)
+        g_idle_add ((GSourceFunc)osm_gps_map_write_complete, w);
+    else
+        osm_tile_write_free (w);
+}
+
+/* Write a downloaded tile to the tile store in the background. The jobs
+ * are told when done */
+static void
+osm_gps_map_queue_write (OsmGpsMap *map, OsmTileStore *store, int zoom, int x, int y,
+                         GBytes *bytes, GSList *jobs)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTileWrite *w;
+
+    if (!priv->write_queue) {
+        priv->write_queue = g_new0 (OsmWriteQueue, 1);
+        priv->write_queue->ref_count = 1;
+        priv->write_queue->sync = priv->tile_cache_sync;
+        /* one thread, the disk does not get faster with more */
+        priv->write_queue->pool = g_thread_pool_new (osm_gps_map_write_worker,
+                                                     priv->write_queue,
+                                                     1, FALSE, NULL);
+    }
+
+    w = g_slice_new0 (OsmTileWrite);
+    w->queue = priv->write_queue;
+    g_atomic_int_inc (&w->queue->ref_count);
+    w->store = osm_tile_store_ref (store);
+    w->zoom = zoom;
+    w->x = x;
+    w->y = y;
+    w->bytes = g_bytes_ref (bytes);
+    w->jobs = g_slist_copy_deep (jobs, (GCopyFunc)g_object_ref, NULL);
+
+    g_atomic_int_inc (&w->queue->queued);
+    g_thread_pool_push (w->queue->pool, w, NULL);
+}
+
+/* Lets the tiles queued so far be written by their own thread, and waits
+ * for them if wait is set. The next tile written starts a new thread */
+static void
+osm_gps_map_write_flush (OsmGpsMap *map, gboolean wait)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmWriteQueue *queue = priv->write_queue;
+
+    if (queue) {
+        priv->write_queue = NULL;
+        g_thread_pool_free (queue->pool, FALSE, wait);
+        osm_write_queue_unref (queue);
+    }
+}
+
+/* tell the jobs waiting for the tile how it went */
+static void
+osm_gps_map_download_jobs_done (OsmTileDownload *dl, gboolean ok, gsize bytes)
+{
+    GSList *l;
 
-        g_free(dl->folder);
-        g_free(dl->filename);
-        g_free(dl);
+    for (l = dl->jobs; l != NULL; l = l->next)
+        osm_gps_map_download_job_tile_done (l->data, dl->zoom, dl->x, dl->y, ok, bytes);
+}
+
+static void
+osm_gps_map_tile_download_complete (SoupSession *session, GAsyncResult *result, gpointer user_data)
+{
+    OsmTileDownload *dl = (OsmTileDownload *)user_data;
+    OsmGpsMap *map = OSM_GPS_MAP(dl->map);
+    OsmGpsMapPrivate *priv = map->priv;
+
+    GError *error = NULL;
+    SoupMessage *msg = soup_session_get_async_result_message(session, result);
+    SoupStatus soup_status = soup_message_get_status(msg);
+    GBytes *body = soup_session_send_and_read_finish (session, result, &error);
+
+    if (priv->is_disposed) {
+        /* aborted by osm_gps_map_dispose, the queues are already gone */
+        osm_tile_download_free(dl);
+        goto out;
+    }
+
+    g_queue_remove (&dl->host->active, dl);
+
+    if (dl->source != priv->tile_source) {
+        /* requested from the source used before, don't store it as a tile
+         * of this one. Its key is not the one of this source either */
+        g_debug("Dropping tile of the previous source %s", dl->uri);
+        osm_gps_map_download_jobs_done (dl, FALSE, 0);
+    } else if (SOUP_STATUS_IS_SUCCESSFUL (soup_status)) {
+        /* save tile into the cache if one has been specified, a job
+         * only counts the tile once it is saved */
+        if (dl->store) {
+            g_debug("Storing "MSG_RESPONSE_LEN_FORMAT" bytes for %s", g_bytes_get_size(body), dl->uri);
+            osm_gps_map_queue_write (map, dl->store, dl->zoom, dl->x, dl->y, body, dl->jobs);
+        } else {
+            osm_gps_map_download_jobs_done (dl, TRUE, g_bytes_get_size(body));
+        }
+
+        /* decode the tile directly from memory, in the background. It
+         * is put into the cache and the map redrawn when done */
+        if (dl->redraw)
+            osm_gps_map_queue_decode (map, dl->zoom, dl->x, dl->y, body, FALSE);
     } else {
         if ((soup_status == SOUP_STATUS_NOT_FOUND) || (soup_status == SOUP_STATUS_FORBIDDEN)) {
-            g_hash_table_insert(priv->missing_tiles, dl->uri, NULL);
-            g_hash_table_remove(priv->tile_queue, dl->uri);
-            g_object_notify(G_OBJECT(map), "tiles-queued");
+            osm_tile_index_insert(priv->missing_tiles, dl->key, GINT_TO_POINTER(TRUE));
         } else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-            /* called as application exit or after osm_gps_map_download_cancel_all */
-            g_hash_table_remove(priv->tile_queue, dl->uri);
-            g_object_notify(G_OBJECT(map), "tiles-queued");
+            /* called as application exit, after osm_gps_map_download_cancel_all
+             * or because the tile left the screen */
         } else {
             g_warning("Error downloading tile: %d - %s", soup_status, soup_status_get_phrase(soup_status));
             //dl->ttl--;
@@ -836,52 +1473,71 @@ osm_gps_map_tile_download_complete (SoupSession *session, GAsyncResult *result,
             //    soup_session_requeue_message(session, msg);
             //    return;
             //}
-
-            g_hash_table_remove(priv->tile_queue, dl->uri);
-            g_object_notify(G_OBJECT(map), "tiles-queued");
         }
+
+        osm_gps_map_download_jobs_done (dl, FALSE, 0);
     }
 
+    osm_tile_index_remove(priv->tile_queue, dl->key);
+    g_object_notify(G_OBJECT(map), "tiles-queued");
+    osm_tile_download_free(dl);
+
+    /* a connection is free, start the next tile */
+    osm_gps_map_download_pump(map);
 
+out:
+    if (body)
+        g_bytes_unref (body);
+    g_clear_error (&error);
+    g_object_unref (map);
 }
 
 static void
 osm_gps_map_download_tile (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw)
+{
+    osm_gps_map_download_tile_full (map, zoom, x, y, redraw, NULL);
+}
+
+/* returns TRUE if the tile was queued */
+static gboolean
+osm_gps_map_download_tile_full (OsmGpsMap *map, int zoom, int x, int y, gboolean redraw,
+                                OsmGpsMapDownloadJob *job)
 {
     SoupMessage *msg;
     OsmGpsMapPrivate *priv = map->priv;
-    OsmTileDownload *dl = g_new0(OsmTileDownload,1);
-
-    // set retries
-    dl->ttl = DOWNLOAD_RETRIES;
-
-    //calculate the uri to download
-    dl->uri = replace_map_uri(map, priv->repo_uri, zoom, x, y);
+    OsmTileDownload *dl;
+    guint64 key = OSM_TILE_KEY(priv->tile_source, zoom, x, y);
 
     //check the tile has not already been queued for download,
     //or has been attempted, and its missing
-    if (g_hash_table_lookup_extended(priv->tile_queue, dl->uri, NULL, NULL) ||
-        g_hash_table_lookup_extended(priv->missing_tiles, dl->uri, NULL, NULL) )
+    if (osm_tile_index_contains(priv->tile_queue, key) ||
+        osm_tile_index_contains(priv->missing_tiles, key) )
     {
-        g_debug("Tile already downloading (or missing)");
-        g_free(dl->uri);
-        g_free(dl);
+        tile_debug("Tile already downloading (or missing)");
     } else {
-        dl->folder = g_strdup_printf("%s%c%d%c%d%c",
-                            priv->cache_dir, G_DIR_SEPARATOR,
-                            zoom, G_DIR_SEPARATOR,
-                            x, G_DIR_SEPARATOR);
-        dl->filename = g_strdup_printf("%s%d.%s",
-                            dl->folder,
-                            y,
-                            priv->image_format);
+        dl = g_new0(OsmTileDownload,1);
+
+        // set retries
+        dl->ttl = DOWNLOAD_RETRIES;
+
+        //calculate the uri to download
+        dl->uri = replace_map_uri(map, priv->repo_uri, zoom, x, y);
+        dl->key = key;
+        dl->zoom = zoom;
+        dl->x = x;
+        dl->y = y;
         dl->map = map;
+        dl->source = priv->tile_source;
+        dl->store = priv->tile_store ? osm_tile_store_ref (priv->tile_store) : NULL;
         dl->redraw = redraw;
-
-        g_debug("Download tile: %d,%d z:%d\n\t%s --> %s", x, y, zoom, dl->uri, dl->filename);
+        if (job)
+            dl->jobs = g_slist_prepend (NULL, g_object_ref (job));
 
         msg = soup_message_new (SOUP_METHOD_GET, dl->uri);
         if (msg) {
+            const char *hostname;
+            OsmDownloadHost *host;
+
             if (priv->is_google) {
                 //Set maps.google.com as the referrer
                 g_debug("Setting Google Referrer");
@@ -895,152 +1551,514 @@ osm_gps_map_download_tile (OsmGpsMap *map, int zoom, int x, int y, gboolean redr
                     }
                 }
             }
+            dl->msg = msg;
+
+            /* queue it with the other tiles from the same server, it is
+             * started by osm_gps_map_download_pump */
+            hostname = g_uri_get_host(soup_message_get_uri(msg));
+            if (!hostname)
+                hostname = "";
+            host = g_hash_table_lookup(priv->download_hosts, hostname);
+            if (!host) {
+                host = g_new0(OsmDownloadHost, 1);
+                host->name = g_strdup(hostname);
+                g_hash_table_insert(priv->download_hosts, host->name, host);
+            }
+            dl->host = host;
+            g_queue_push_tail(&host->pending, dl);
+            host->sorted = FALSE;
 
-            GCancellable *cancellable = g_cancellable_new ();
-            g_hash_table_insert (priv->tile_queue, dl->uri, cancellable);
+            dl->cancellable = g_cancellable_new ();
+            osm_tile_index_insert (priv->tile_queue, dl->key, dl->cancellable);
             g_object_notify (G_OBJECT (map), "tiles-queued");
-            /* the soup session unrefs the message when the download finishes */
-            soup_session_send_and_read_async(priv->soup_session, msg,
-                                    G_PRIORITY_DEFAULT,
-                                    cancellable,
-                                    (GAsyncReadyCallback)osm_gps_map_tile_download_complete,
-                                    dl);
+
+            osm_gps_map_download_pump_idle(map);
+            return TRUE;
         } else {
             g_warning("Could not create soup message");
-            g_free(dl->uri);
-            g_free(dl->folder);
-            g_free(dl->filename);
-            g_free(dl);
+            osm_tile_download_free(dl);
         }
     }
+    return FALSE;
 }
 
-static GdkPixbuf *
-osm_gps_map_load_cached_tile (OsmGpsMap *map, int zoom, int x, int y)
+static OsmCachedTile *
+osm_gps_map_lookup_cached_tile (OsmGpsMap *map, int zoom, int x, int y)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    gchar *filename;
-    GdkPixbuf *pixbuf = NULL;
     OsmCachedTile *tile;
 
-    filename = g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                priv->cache_dir, G_DIR_SEPARATOR,
-                zoom, G_DIR_SEPARATOR,
-                x, G_DIR_SEPARATOR,
-                y,
-                priv->image_format);
-
-    tile = g_hash_table_lookup (priv->tile_cache, filename);
-    if (tile)
-    {
-        g_free (filename);
-    }
-    else
-    {
-        pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
-        if (pixbuf)
-        {
-            tile = g_slice_new (OsmCachedTile);
-            tile->pixbuf = pixbuf;
-            g_hash_table_insert (priv->tile_cache, filename, tile);
-        }
-        else
-        {
-            g_free (filename);
-        }
-    }
+    /* only the memory cache is consulted, tiles are read from the tile
+     * store in the background by osm_gps_map_queue_decode */
+    tile = osm_tile_index_lookup (priv->tile_cache,
+                                  OSM_TILE_KEY(priv->tile_source, zoom, x, y));
 
-    /* set/update the redraw_cycle timestamp on the tile */
+    /* mark the tile as the most recently used */
     if (tile)
     {
-        tile->redraw_cycle = priv->redraw_cycle;
-        pixbuf = g_object_ref (tile->pixbuf);
+        g_queue_unlink (&priv->tile_cache_lru, &tile->link);
+        g_queue_push_head_link (&priv->tile_cache_lru, &tile->link);
     }
 
-    return pixbuf;
+    return tile;
 }
 
-static GdkPixbuf *
-osm_gps_map_find_bigger_tile (OsmGpsMap *map, int zoom, int x, int y,
-                              int *zoom_found)
+/* evict the least recently used tiles until the cache fits its budget */
+static void
+osm_gps_map_tile_cache_trim (OsmGpsMap *map)
 {
-    GdkPixbuf *pixbuf;
-    int next_zoom, next_x, next_y;
+    OsmGpsMapPrivate *priv = map->priv;
 
-    if (zoom == 0) return NULL;
-    next_zoom = zoom - 1;
-    next_x = x / 2;
-    next_y = y / 2;
-    pixbuf = osm_gps_map_load_cached_tile (map, next_zoom, next_x, next_y);
-    if (pixbuf)
-        *zoom_found = next_zoom;
-    else
-        pixbuf = osm_gps_map_find_bigger_tile (map, next_zoom, next_x, next_y,
-                                               zoom_found);
-    return pixbuf;
+    /* always keep the most recent tile, even if it alone is over budget */
+    while (priv->tile_cache_bytes > priv->max_tile_cache_bytes &&
+           priv->tile_cache_lru.length > 1) {
+        OsmCachedTile *tile = priv->tile_cache_lru.tail->data;
+        osm_tile_index_remove (priv->tile_cache, tile->key);
+    }
 }
 
-static GdkPixbuf *
+/* takes a reference to surface */
+static void
+osm_gps_map_tile_cache_insert (OsmGpsMap *map, guint64 key, cairo_surface_t *surface,
+                               int detail_zoom, gboolean provisional)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmCachedTile *tile = g_slice_new0 (OsmCachedTile);
+
+    tile->surface = cairo_surface_reference (surface);
+    tile->bytes = (gsize)cairo_image_surface_get_stride (surface) *
+                  cairo_image_surface_get_height (surface);
+    tile->key = key;
+    tile->detail_zoom = detail_zoom;
+    tile->provisional = provisional;
+    tile->link.data = tile;
+    tile->priv = priv;
+
+    /* if the tile is already in the cache (it could be a provisional one
+     * rendered from another zoom level), it is replaced */
+    osm_tile_index_insert (priv->tile_cache, key, tile);
+    g_queue_push_head_link (&priv->tile_cache_lru, &tile->link);
+    priv->tile_cache_bytes += tile->bytes;
+
+    osm_gps_map_tile_cache_trim (map);
+}
+
+static void
+osm_tile_decode_free (OsmTileDecode *job)
+{
+    if (job->bytes)
+        g_bytes_unref (job->bytes);
+    if (job->surface)
+        cairo_surface_destroy (job->surface);
+    g_slice_free (OsmTileDecode, job);
+}
+
+/* Marks where a tile at zoom, x, y is drawn, directly or scaled for
+ * another zoom, as to be drawn again */
+static void
+osm_gps_map_tile_arrived (OsmGpsMap *map, int zoom, int x, int y)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GtkWidget *widget = GTK_WIDGET(map);
+    GdkRectangle tile, pixmap;
+    double size = ldexp (TILESIZE, priv->map_zoom - zoom);
+
+    if (!priv->pixmap_valid)
+        return;
+
+    pixmap.x = priv->map_x - priv->pixmap_border;
+    pixmap.y = priv->map_y - priv->pixmap_border;
+    pixmap.width = gtk_widget_get_allocated_width (widget) + priv->pixmap_border * 2;
+    pixmap.height = gtk_widget_get_allocated_height (widget) + priv->pixmap_border * 2;
+
+    /* tiles from far lower zooms cover more than fits in an int */
+    tile.x = CLAMP (floor (x * size), pixmap.x - 1, pixmap.x + pixmap.width + 1);
+    tile.y = CLAMP (floor (y * size), pixmap.y - 1, pixmap.y + pixmap.height + 1);
+    tile.width = CLAMP (ceil ((x + 1) * size), pixmap.x - 1, pixmap.x + pixmap.width + 1) - tile.x;
+    tile.height = CLAMP (ceil ((y + 1) * size), pixmap.y - 1, pixmap.y + pixmap.height + 1) - tile.y;
+
+    if (gdk_rectangle_intersect (&tile, &pixmap, &tile))
+        g_array_append_val (priv->dirty_tiles, tile);
+}
+
+static gboolean
+osm_gps_map_decode_complete (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTileDecode *job;
+    gboolean redraw = FALSE;
+
+    /* anything pushed after this point schedules another idle */
+    g_atomic_int_set (&priv->decode_idle_pending, 0);
+
+    while ((job = g_async_queue_try_pop (priv->decode_results)) != NULL) {
+        if (job->generation != priv->decode_generation) {
+            /* the tile source changed while this tile was decoded */
+        } else {
+            if (!job->bytes)
+                osm_tile_index_remove (priv->decode_queue, job->key);
+
+            if (job->surface) {
+                osm_gps_map_tile_cache_insert (map, job->key, job->surface,
+                                               job->zoom, FALSE);
+                osm_gps_map_tile_arrived (map, job->zoom, job->x, job->y);
+                redraw = TRUE;
+            } else if (job->download && priv->map_auto_download_enabled) {
+                /* not in the tile store, fetch it */
+                osm_gps_map_download_tile (map, job->zoom, job->x, job->y, TRUE);
+            }
+        }
+        osm_tile_decode_free (job);
+    }
+
+    /* one redraw for the whole batch, of only where the tiles are */
+    if (redraw)
+        osm_gps_map_map_update_idle (map);
+
+    return FALSE;
+}
+
+static void
+osm_gps_map_decode_worker (gpointer data, gpointer user_data)
+{
+    OsmTileDecode *job = (OsmTileDecode *)data;
+    OsmGpsMap *map = job->map;
+    OsmGpsMapPrivate *priv = map->priv;
+
+    /* skip the work if the result will be thrown away anyway */
+    if (job->generation == g_atomic_int_get (&priv->decode_generation)) {
+        GBytes *bytes = job->bytes;
+
+        if (!bytes)
+            bytes = osm_tile_store_read (priv->tile_store, job->zoom, job->x, job->y);
+
+        if (bytes) {
+            GdkPixbuf *pixbuf = osm_gps_map_decode_tile (bytes);
+            if (pixbuf) {
+                job->surface = osm_gps_map_tile_surface_new (pixbuf);
+                g_object_unref (pixbuf);
+            }
+            if (bytes != job->bytes)
+                g_bytes_unref (bytes);
+        }
+    }
+
+    g_async_queue_push (priv->decode_results, job);
+    if (g_atomic_int_compare_and_exchange (&priv->decode_idle_pending, 0, 1))
+        priv->idle_decode_complete = g_idle_add ((GSourceFunc)osm_gps_map_decode_complete, map);
+}
+
+/* Decode a tile without blocking the main loop. If bytes is NULL the tile is
+ * read from the tile store, and if download is set downloaded if it is not
+ * stored there */
+static void
+osm_gps_map_queue_decode (OsmGpsMap *map, int zoom, int x, int y, GBytes *bytes,
+                          gboolean download)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmTileDecode *job;
+    guint64 key = OSM_TILE_KEY(priv->tile_source, zoom, x, y);
+
+    if (!bytes) {
+        if (osm_tile_index_contains(priv->decode_queue, key))
+            return;
+
+        /* known not to be stored, don't bother a thread with it */
+        if (osm_tile_store_probe(priv->tile_store, zoom, x, y) == OSM_TILE_STORE_MISSING) {
+            if (download && priv->map_auto_download_enabled)
+                osm_gps_map_download_tile (map, zoom, x, y, TRUE);
+            return;
+        }
+
+        osm_tile_index_insert(priv->decode_queue, key, GINT_TO_POINTER(TRUE));
+    }
+
+    if (!priv->decode_pool) {
+        priv->decode_pool = g_thread_pool_new (osm_gps_map_decode_worker, NULL,
+                                               CLAMP(g_get_num_processors(), 1, MAX_DECODE_THREADS),
+                                               FALSE, NULL);
+    }
+
+    job = g_slice_new0 (OsmTileDecode);
+    job->key = key;
+    job->zoom = zoom;
+    job->x = x;
+    job->y = y;
+    job->bytes = bytes ? g_bytes_ref (bytes) : NULL;
+    job->download = download;
+    job->map = map;
+    job->generation = priv->decode_generation;
+
+    g_thread_pool_push (priv->decode_pool, job, NULL);
+}
+
+/* Waits for the decode threads to finish, and discards everything they
+ * were doing. Must be called before the tile store goes away */
+static void
+osm_gps_map_decode_cancel_all (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+
+    g_atomic_int_inc (&priv->decode_generation);
+
+    if (priv->decode_pool) {
+        /* queued jobs are run, but skip straight to the results */
+        g_thread_pool_free (priv->decode_pool, FALSE, TRUE);
+        priv->decode_pool = NULL;
+    }
+
+    osm_tile_index_remove_all (priv->decode_queue);
+}
+
+/* Find the closest ancestor of a tile in the memory cache which has more
+ * detail than detail_min. Ancestors which are in the tile store but not in
+ * memory are loaded in the background, for the next redraw */
+static cairo_surface_t *
+osm_gps_map_find_bigger_tile (OsmGpsMap *map, int zoom, int x, int y,
+                              int detail_min, int *zoom_found)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmCachedTile *tile;
+    int next_zoom, next_x, next_y;
+
+    if (zoom == 0) return NULL;
+    next_zoom = zoom - 1;
+    next_x = x / 2;
+    next_y = y / 2;
+    if (next_zoom <= detail_min) return NULL;
+
+    tile = osm_gps_map_lookup_cached_tile (map, next_zoom, next_x, next_y);
+    if (tile && !tile->provisional) {
+        *zoom_found = next_zoom;
+        return tile->surface;
+    }
+
+    if (priv->tile_store &&
+        osm_tile_store_probe (priv->tile_store, next_zoom, next_x, next_y) == OSM_TILE_STORE_PRESENT)
+        osm_gps_map_queue_decode (map, next_zoom, next_x, next_y, NULL, FALSE);
+
+    return osm_gps_map_find_bigger_tile (map, next_zoom, next_x, next_y,
+                                         detail_min, zoom_found);
+}
+
+static cairo_surface_t *
 osm_gps_map_render_missing_tile_upscaled (OsmGpsMap *map, int zoom,
-                                          int x, int y)
+                                          int x, int y, int detail_min,
+                                          int *detail_zoom)
 {
-    GdkPixbuf *pixbuf, *big;
+    cairo_surface_t *big;
     int zoom_big;
 
-    big = osm_gps_map_find_bigger_tile (map, zoom, x, y, &zoom_big);
+    big = osm_gps_map_find_bigger_tile (map, zoom, x, y, detail_min, &zoom_big);
     if (!big) return NULL;
 
-    g_debug ("Found bigger tile (zoom = %d, wanted = %d)", zoom_big, zoom);
+    tile_debug ("Found bigger tile (zoom = %d, wanted = %d)", zoom_big, zoom);
 
-    pixbuf = osm_gps_map_render_tile_upscaled (map, big, zoom_big,
-                                               zoom, x, y);
-    g_object_unref (big);
-
-    return pixbuf;
+    *detail_zoom = zoom_big;
+    return osm_gps_map_render_tile_upscaled (map, big, zoom_big,
+                                             zoom, x, y);
 }
-static GdkPixbuf*
-osm_gps_map_render_tile_upscaled (OsmGpsMap *map, GdkPixbuf *big, int zoom_big,
+static cairo_surface_t*
+osm_gps_map_render_tile_upscaled (OsmGpsMap *map, cairo_surface_t *big, int zoom_big,
                                   int zoom, int x, int y)
 {
-    GdkPixbuf *pixbuf, *area;
-    int area_size, area_x, area_y;
-    int modulo;
+    cairo_surface_t *surface;
+    cairo_t *cr;
     int zoom_diff;
 
-    /* get a Pixbuf for the area to magnify */
+    /* magnify the area of the big tile covering x,y into a new tile */
     zoom_diff = zoom - zoom_big;
 
-    g_debug ("Upscaling by %d levels into tile %d,%d", zoom_diff, x, y);
+    tile_debug ("Upscaling by %d levels into tile %d,%d", zoom_diff, x, y);
 
-    area_size = TILESIZE >> zoom_diff;
-    modulo = 1 << zoom_diff;
-    area_x = (x % modulo) * area_size;
-    area_y = (y % modulo) * area_size;
-    area = gdk_pixbuf_new_subpixbuf (big, area_x, area_y,
-                                     area_size, area_size);
-    pixbuf = gdk_pixbuf_scale_simple (area, TILESIZE, TILESIZE,
-                                      GDK_INTERP_NEAREST);
-    g_object_unref (area);
-    return pixbuf;
+    surface = cairo_surface_create_similar_image (big,
+                                                  cairo_image_surface_get_format (big),
+                                                  TILESIZE, TILESIZE);
+    cr = cairo_create (surface);
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+    osm_gps_map_paint_tile_upscaled (cr, big, zoom_diff, x, y, 0, 0);
+    cairo_destroy (cr);
+
+    return surface;
 }
 
-static GdkPixbuf *
-osm_gps_map_render_missing_tile (OsmGpsMap *map, int zoom, int x, int y)
+/* Shrink src by factor into the square at dst_x, dst_y of dst, each pixel
+ * the average of a factor x factor block (a box filter). Averaging is
+ * correct on the premultiplied pixels cairo uses */
+static void
+osm_gps_map_box_downsample (cairo_surface_t *dst, int dst_x, int dst_y,
+                            cairo_surface_t *src, int factor)
+{
+    int src_stride = cairo_image_surface_get_stride (src);
+    int dst_stride = cairo_image_surface_get_stride (dst);
+    gboolean src_alpha = cairo_image_surface_get_format (src) == CAIRO_FORMAT_ARGB32;
+    const guchar *src_data;
+    guchar *dst_data;
+    int size = TILESIZE / factor;
+    guint n = factor * factor;
+    int i, j, k, l;
+
+    cairo_surface_flush (src);
+    src_data = cairo_image_surface_get_data (src);
+    dst_data = cairo_image_surface_get_data (dst);
+
+    for (j = 0; j < size; j++) {
+        guint32 *out = (guint32 *)(dst_data + (dst_y + j) * dst_stride) + dst_x;
+
+        for (i = 0; i < size; i++) {
+            guint a = 0, r = 0, g = 0, b = 0;
+
+            for (l = 0; l < factor; l++) {
+                const guint32 *in = (const guint32 *)(src_data + (j * factor + l) * src_stride) + i * factor;
+
+                for (k = 0; k < factor; k++) {
+                    guint32 p = in[k];
+                    a += src_alpha ? p >> 24 : 0xff;
+                    r += (p >> 16) & 0xff;
+                    g += (p >> 8) & 0xff;
+                    b += p & 0xff;
+                }
+            }
+
+            out[i] = ((a + n / 2) / n) << 24 |
+                     ((r + n / 2) / n) << 16 |
+                     ((g + n / 2) / n) << 8 |
+                     ((b + n / 2) / n);
+        }
+    }
+}
+
+/* a real, full size tile from the memory cache, or NULL */
+static cairo_surface_t *
+osm_gps_map_find_child_tile (OsmGpsMap *map, int zoom, int x, int y)
+{
+    OsmCachedTile *tile = osm_gps_map_lookup_cached_tile (map, zoom, x, y);
+
+    if (tile && !tile->provisional &&
+        cairo_image_surface_get_width (tile->surface) == TILESIZE &&
+        cairo_image_surface_get_height (tile->surface) == TILESIZE)
+        return tile->surface;
+
+    return NULL;
+}
+
+/* Render a tile by shrinking its four children, where a child is missing
+ * its four children are used instead. Children that are in the tile store
+ * but not in memory are loaded in the background, if the tile itself would
+ * have to be downloaded */
+static cairo_surface_t *
+osm_gps_map_render_missing_tile_downscaled (OsmGpsMap *map, int zoom,
+                                            int x, int y)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_surface_t *children[4][4];
+    cairo_surface_t *surface;
+    cairo_format_t format = CAIRO_FORMAT_RGB24;
+    gboolean load, complete = TRUE;
+    int q, g;
+
+    load = priv->tile_store &&
+           osm_tile_store_probe (priv->tile_store, zoom, x, y) == OSM_TILE_STORE_MISSING;
+
+    /* children[q][0] is child q, or children[q][0..3] are its children */
+    for (q = 0; q < 4; q++) {
+        int cx = 2 * x + (q & 1);
+        int cy = 2 * y + (q >> 1);
+
+        children[q][0] = osm_gps_map_find_child_tile (map, zoom + 1, cx, cy);
+        children[q][1] = NULL;
+        if (!children[q][0]) {
+            /* when the child is stored, its children need not be loaded */
+            gboolean load_child = load;
+
+            if (load && osm_tile_store_probe (priv->tile_store, zoom + 1, cx, cy) == OSM_TILE_STORE_PRESENT) {
+                osm_gps_map_queue_decode (map, zoom + 1, cx, cy, NULL, FALSE);
+                load_child = FALSE;
+            }
+
+            for (g = 0; g < 4; g++) {
+                int gx = 2 * cx + (g & 1);
+                int gy = 2 * cy + (g >> 1);
+
+                children[q][g] = osm_gps_map_find_child_tile (map, zoom + 2, gx, gy);
+                if (!children[q][g]) {
+                    if (load_child && osm_tile_store_probe (priv->tile_store, zoom + 2, gx, gy) == OSM_TILE_STORE_PRESENT)
+                        osm_gps_map_queue_decode (map, zoom + 2, gx, gy, NULL, FALSE);
+                    complete = FALSE;
+                }
+            }
+        }
+    }
+
+    if (!complete)
+        return NULL;
+
+    for (q = 0; q < 4; q++)
+        for (g = 0; g < (children[q][1] ? 4 : 1); g++)
+            if (cairo_image_surface_get_format (children[q][g]) == CAIRO_FORMAT_ARGB32)
+                format = CAIRO_FORMAT_ARGB32;
+
+    tile_debug ("Downscaling children into tile %d,%d z:%d", x, y, zoom);
+
+    surface = cairo_image_surface_create (format, TILESIZE, TILESIZE);
+    if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy (surface);
+        return NULL;
+    }
+
+    cairo_surface_flush (surface);
+    for (q = 0; q < 4; q++) {
+        int qx = (q & 1) * TILESIZE / 2;
+        int qy = (q >> 1) * TILESIZE / 2;
+
+        if (!children[q][1]) {
+            osm_gps_map_box_downsample (surface, qx, qy, children[q][0], 2);
+        } else {
+            for (g = 0; g < 4; g++)
+                osm_gps_map_box_downsample (surface,
+                                            qx + (g & 1) * TILESIZE / 4,
+                                            qy + (g >> 1) * TILESIZE / 4,
+                                            children[q][g], 4);
+        }
+    }
+    cairo_surface_mark_dirty (surface);
+
+    return surface;
+}
+
+/* Render a stand-in for a tile which is not loaded yet, from cached tiles of
+ * other zoom levels with more detail than detail_min. detail_zoom is set to
+ * the zoom level it was rendered from */
+static cairo_surface_t *
+osm_gps_map_render_missing_tile (OsmGpsMap *map, int zoom, int x, int y,
+                                 int detail_min, int *detail_zoom)
 {
-    /* maybe TODO: render from downscaled tiles, if the following fails */
-    return osm_gps_map_render_missing_tile_upscaled (map, zoom, x, y);
+    cairo_surface_t *surface;
+
+    /* children have all the detail the tile could have, so are preferred
+     * to any ancestor */
+    if (detail_min <= zoom) {
+        surface = osm_gps_map_render_missing_tile_downscaled (map, zoom, x, y);
+        if (surface) {
+            *detail_zoom = zoom + 1;
+            return surface;
+        }
+    }
+
+    return osm_gps_map_render_missing_tile_upscaled (map, zoom, x, y,
+                                                     detail_min, detail_zoom);
 }
 
 static void
 osm_gps_map_load_tile (OsmGpsMap *map, cairo_t *cr, int zoom, int x, int y, int offset_x, int offset_y)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    gchar *filename;
-    GdkPixbuf *pixbuf;
+    cairo_surface_t *surface;
+    OsmCachedTile *tile;
     int zoom_offset = priv->tile_zoom_offset;
-    int target_x, target_y;
+    int target_x, target_y, detail_zoom;
 
-    g_debug("Load virtual tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
+    tile_debug("Load virtual tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
 
     if (zoom > MIN_ZOOM) {
       zoom -= zoom_offset;
@@ -1051,7 +2069,7 @@ osm_gps_map_load_tile (OsmGpsMap *map, cairo_t *cr, int zoom, int x, int y, int
     target_x = x;
     target_y = y;
 
-    g_debug("Load actual tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
+    tile_debug("Load actual tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
 
     if (priv->map_source == OSM_GPS_MAP_SOURCE_NULL && priv->repo_uri == NULL) {
         osm_gps_map_blit_tile(map, priv->null_tile, cr, offset_x, offset_y,
@@ -1059,80 +2077,81 @@ osm_gps_map_load_tile (OsmGpsMap *map, cairo_t *cr, int zoom, int x, int y, int
         return;
     }
 
-    filename = g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                priv->cache_dir, G_DIR_SEPARATOR,
-                zoom, G_DIR_SEPARATOR,
-                x, G_DIR_SEPARATOR,
-                y,
-                priv->image_format);
+    /* try to get file from internal cache first, then from the tile store */
+    tile = osm_gps_map_lookup_cached_tile(map, zoom, x, y);
 
-    /* try to get file from internal cache first */
-    if(!(pixbuf = osm_gps_map_load_cached_tile(map, zoom, x, y)))
-        pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
+    if(tile && !tile->provisional) {
+        tile_debug("Found tile %d,%d z:%d", x, y, zoom);
+        osm_gps_map_blit_tile(map, tile->surface, cr, offset_x, offset_y,
+                              zoom, target_x, target_y);
+        return;
+    }
+
+    if (priv->tile_store) {
+        /* load it in the background, this downloads it if needed */
+        osm_gps_map_queue_decode(map, zoom, x, y, NULL, TRUE);
+    } else if (priv->map_auto_download_enabled) {
+        osm_gps_map_download_tile(map, zoom, x, y, TRUE);
+    }
 
-    if(pixbuf) {
-        g_debug("Found tile %s", filename);
-        osm_gps_map_blit_tile(map, pixbuf, cr, offset_x, offset_y,
+    /* try to render the tile by scaling cached tiles from other zoom
+     * levels. A stand-in rendered earlier is reused, unless more detail
+     * has been loaded since */
+    surface = osm_gps_map_render_missing_tile (map, zoom, x, y,
+                                               tile ? tile->detail_zoom : -1,
+                                               &detail_zoom);
+    if (surface) {
+        osm_gps_map_tile_cache_insert (map, OSM_TILE_KEY(priv->tile_source, zoom, x, y),
+                                       surface, detail_zoom, TRUE);
+        osm_gps_map_blit_tile(map, surface, cr, offset_x, offset_y,
+                               zoom, target_x, target_y);
+        cairo_surface_destroy (surface);
+    } else if (tile) {
+        osm_gps_map_blit_tile(map, tile->surface, cr, offset_x, offset_y,
                               zoom, target_x, target_y);
-        g_object_unref (pixbuf);
     } else {
-        if (priv->map_auto_download_enabled) {
-            osm_gps_map_download_tile(map, zoom, x, y, TRUE);
-        }
-
-        /* try to render the tile by scaling cached tiles from other zoom
-         * levels */
-        pixbuf = osm_gps_map_render_missing_tile (map, zoom, x, y);
-        if (pixbuf) {
-            osm_gps_map_blit_tile(map, pixbuf, cr, offset_x, offset_y,
-                                   zoom, target_x, target_y);
-            g_object_unref (pixbuf);
-        } else {
-            /* prevent some artifacts when drawing not yet loaded areas. */
-            g_warning ("Error getting missing tile"); /* FIXME: is this a warning? */
-            draw_white_rectangle (cr, offset_x, offset_y, TILESIZE, TILESIZE);
-        }
+        /* prevent some artifacts when drawing not yet loaded areas. */
+        tile_debug ("Error getting missing tile");
+        draw_white_rectangle (cr, offset_x, offset_y, TILESIZE, TILESIZE);
     }
-    g_free(filename);
 }
 
+/* Draws the tiles covering area, in pixmap coordinates */
 static void
-osm_gps_map_fill_tiles_pixel (OsmGpsMap *map, cairo_t *cr)
+osm_gps_map_fill_tiles_pixel (OsmGpsMap *map, cairo_t *cr, const GdkRectangle *area)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    GtkAllocation allocation;
-    int i,j, tile_x0, tile_y0, tiles_nx, tiles_ny;
-    int offset_xn = 0;
-    int offset_yn = 0;
-    int offset_x;
-    int offset_y;
+    int i,j, tile_x0, tile_y0, tile_x1, tile_y1, max_tile;
+    int map_x0, map_y0;
 
-    g_debug("Fill tiles: %d,%d z:%d", priv->map_x, priv->map_y, priv->map_zoom);
+    tile_debug("Fill tiles: %d,%d z:%d (%d,%d %dx%d)", priv->map_x, priv->map_y, priv->map_zoom,
+               area->x, area->y, area->width, area->height);
 
-    gtk_widget_get_allocation(GTK_WIDGET(map), &allocation);
-
-    offset_x = - priv->map_x % TILESIZE;
-    offset_y = - priv->map_y % TILESIZE;
-    if (offset_x > 0) offset_x -= TILESIZE;
-    if (offset_y > 0) offset_y -= TILESIZE;
+    if (area->width <= 0 || area->height <= 0)
+        return;
 
-    offset_xn = offset_x + EXTRA_BORDER;
-    offset_yn = offset_y + EXTRA_BORDER;
+    map_x0 = priv->map_x - priv->pixmap_border;
+    map_y0 = priv->map_y - priv->pixmap_border;
 
-    tiles_nx = (allocation.width  - offset_x) / TILESIZE + 1;
-    tiles_ny = (allocation.height - offset_y) / TILESIZE + 1;
+    /* round down, map_x,y are negative when zoomed right out */
+    tile_x0 = floor ((double)(map_x0 + area->x) / TILESIZE);
+    tile_y0 = floor ((double)(map_y0 + area->y) / TILESIZE);
+    tile_x1 = floor ((double)(map_x0 + area->x + area->width - 1) / TILESIZE);
+    tile_y1 = floor ((double)(map_y0 + area->y + area->height - 1) / TILESIZE);
 
-    tile_x0 =  priv->map_x / TILESIZE;
-    tile_y0 =  priv->map_y / TILESIZE;
+    max_tile = 1 << priv->map_zoom;
 
-    for (i=tile_x0; i<(tile_x0+tiles_nx);i++)
+    for (i=tile_x0; i<=tile_x1;i++)
     {
-        for (j=tile_y0;  j<(tile_y0+tiles_ny); j++)
+        for (j=tile_y0; j<=tile_y1; j++)
         {
-            if( j<0 || i<0 || i>=exp(priv->map_zoom * M_LN2) || j>=exp(priv->map_zoom * M_LN2))
+            int offset_x = i * TILESIZE - map_x0;
+            int offset_y = j * TILESIZE - map_y0;
+
+            if( j<0 || i<0 || i>=max_tile || j>=max_tile)
             {
                 /* draw white in areas outside map (i.e. when zoomed right out) */
-                draw_white_rectangle (cr, offset_xn, offset_yn, TILESIZE, TILESIZE);
+                draw_white_rectangle (cr, offset_x, offset_y, TILESIZE, TILESIZE);
             }
             else
             {
@@ -1140,35 +2159,145 @@ osm_gps_map_fill_tiles_pixel (OsmGpsMap *map, cairo_t *cr)
                                       cr,
                                       priv->map_zoom,
                                       i,j,
-                                      offset_xn - EXTRA_BORDER,offset_yn - EXTRA_BORDER);
+                                      offset_x,offset_y);
             }
-            offset_yn += TILESIZE;
         }
-        offset_xn += TILESIZE;
-        offset_yn = offset_y + EXTRA_BORDER;
     }
 }
 
+/* Clips the segment x0,y0 - x1,y1 to box (x_min, y_min, x_max, y_max),
+ * Liang-Barsky. Returns FALSE if none of it is inside */
+static gboolean
+osm_gps_map_clip_segment (double *x0, double *y0, double *x1, double *y1, const double *box)
+{
+    double dx = *x1 - *x0;
+    double dy = *y1 - *y0;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { *x0 - box[0], box[2] - *x0, *y0 - box[1], box[3] - *y0 };
+    double t0 = 0.0, t1 = 1.0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (p[i] == 0.0) {
+            if (q[i] < 0.0)
+                return FALSE;
+        } else {
+            double t = q[i] / p[i];
+            if (p[i] < 0.0) {
+                if (t > t1)
+                    return FALSE;
+                t0 = MAX(t0, t);
+            } else {
+                if (t < t0)
+                    return FALSE;
+                t1 = MIN(t1, t);
+            }
+        }
+    }
+
+    if (t1 < 1.0) {
+        *x1 = *x0 + t1 * dx;
+        *y1 = *y0 + t1 * dy;
+    }
+    if (t0 > 0.0) {
+        *x0 += t0 * dx;
+        *y0 += t0 * dy;
+    }
+    return TRUE;
+}
+
+/* A path of the visible parts of a polyline, all stroked at once */
+typedef struct {
+    cairo_t *cr;
+    /* the clip extents, plus the line width */
+    double box[4];
+    /* the path currently ends at last_x,y */
+    gboolean pen_down;
+    double last_x;
+    double last_y;
+} OsmTrackPath;
+
+static void
+osm_track_path_segment (OsmTrackPath *path, double x0, double y0, double x1, double y1)
+{
+    /* cairo uses fixed point, so far away vertices must not reach it */
+    if (!osm_gps_map_clip_segment (&x0, &y0, &x1, &y1, path->box)) {
+        path->pen_down = FALSE;
+        return;
+    }
+
+    if (!path->pen_down || x0 != path->last_x || y0 != path->last_y)
+        cairo_move_to (path->cr, x0, y0);
+    cairo_line_to (path->cr, x1, y1);
+
+    path->pen_down = TRUE;
+    path->last_x = x1;
+    path->last_y = y1;
+}
+
+static gboolean
+osm_track_path_visible (OsmTrackPath *path, double x, double y)
+{
+    return x >= path->box[0] && x <= path->box[2] &&
+           y >= path->box[1] && y <= path->box[3];
+}
+
+/* The positions on the backing surfaces of the points of track at the
+ * positions in lod, or of all of them when lod is NULL. x and y
+ * interleaved, to be freed */
+static double *
+osm_gps_map_track_to_pixmap (OsmGpsMap *map, OsmGpsMapTrack *track, GArray *lod)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    const double *world = osm_gps_map_track_get_world (track);
+    double *xy;
+    guint i, n;
+
+    if (lod) {
+        n = lod->len;
+        xy = g_new (double, 2 * n);
+        for (i = 0; i < n; i++) {
+            guint k = g_array_index (lod, guint, i);
+            xy[2*i] = world[2*k];
+            xy[2*i+1] = world[2*k+1];
+        }
+        world = xy;
+    } else {
+        n = osm_gps_map_track_n_points (track);
+        xy = g_new (double, 2 * n);
+    }
+
+    world2pixel (priv->map_zoom, world, n,
+                 priv->map_x - priv->pixmap_border,
+                 priv->map_y - priv->pixmap_border,
+                 xy);
+    return xy;
+}
+
 static void
 osm_gps_map_print_track (OsmGpsMap *map, OsmGpsMapTrack *track, cairo_t *cr)
 {
     OsmGpsMapPrivate *priv = map->priv;
 
-    GSList *pt,*points;
-    int x,y;
-    int min_x = 0,min_y = 0,max_x = 0,max_y = 0;
+    const OsmGpsMapPoint *points;
+    guint n_points;
+    double x, y;
+    double *xy;
     gfloat lw, alpha;
-    int map_x0, map_y0;
+    int map_x0;
     GdkRGBA color;
+    OsmTrackPath path;
+    GArray *lod;
+    guint i;
 
+    points = osm_gps_map_track_get_point_array (track, &n_points);
     g_object_get (track,
-                  "track", &points,
                   "line-width", &lw,
                   "alpha", &alpha,
                   NULL);
     osm_gps_map_track_get_color(track, &color);
 
-    if (points == NULL)
+    if (n_points == 0)
         return;
 
     gboolean path_editable = FALSE;
@@ -1179,359 +2308,1101 @@ osm_gps_map_print_track (OsmGpsMap *map, OsmGpsMapTrack *track, cairo_t *cr)
     cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
     cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
 
-    map_x0 = priv->map_x - EXTRA_BORDER;
-    map_y0 = priv->map_y - EXTRA_BORDER;
-
-    int last_x = 0, last_y = 0;
-    int x_pi = lon2pixel(priv->map_zoom, M_PI) - map_x0;
-    int x_minus_pi = lon2pixel(priv->map_zoom, - M_PI) - map_x0;
-    int double_pi = x_pi - x_minus_pi;
-    float last_lon;
-    for(pt = points; pt != NULL; pt = pt->next)
+    map_x0 = priv->map_x - priv->pixmap_border;
+
+    /* only what is inside the clip, which may be a lot smaller than the
+     * map after a pan, is drawn */
+    path.cr = cr;
+    path.pen_down = FALSE;
+    cairo_clip_extents (cr, &path.box[0], &path.box[1], &path.box[2], &path.box[3]);
+    path.box[0] -= lw + DOT_RADIUS;
+    path.box[1] -= lw + DOT_RADIUS;
+    path.box[2] += lw + DOT_RADIUS;
+    path.box[3] += lw + DOT_RADIUS;
+
+    double last_x = 0, last_y = 0;
+    double x_pi = lon2pixel(priv->map_zoom, M_PI) - map_x0;
+    double x_minus_pi = lon2pixel(priv->map_zoom, - M_PI) - map_x0;
+    double double_pi = x_pi - x_minus_pi;
+    float last_lon = 0;
+
+    /* the line leaves out points too close to it to make a difference */
+    lod = osm_gps_map_track_get_lod (track, priv->map_zoom);
+    xy = osm_gps_map_track_to_pixmap (map, track, lod);
+
+    cairo_new_path (cr);
+    for(i = 0; i < lod->len; i++)
     {
-        OsmGpsMapPoint *tp = pt->data;
+        const OsmGpsMapPoint *tp = &points[g_array_index (lod, guint, i)];
 
-        x = lon2pixel(priv->map_zoom, tp->rlon) - map_x0;
-        y = lat2pixel(priv->map_zoom, tp->rlat) - map_y0;
+        x = xy[2*i];
+        y = xy[2*i+1];
 
         /* first time through loop */
-        if (pt == points)
+        if (i == 0)
         {
-            cairo_move_to(cr, x, y);
+            /* a single point is drawn as a dot */
+            if (lod->len == 1)
+                osm_track_path_segment (&path, x, y, x, y);
         }
         else if (fabs(tp->rlon - last_lon) > M_PI && x != last_x)
         {
             /* instead of drawing to (x, y), draw a first segment to the date change line,
                and a second segment from the other date change line to (x, y) */
-            int interm_y;
+            double interm_y;
             if (last_lon > 0)
             {
                 /* tp->rlon is < 0 */
-                interm_y = (int)(last_y + (float)(y - last_y) / (float)((x + double_pi) - last_x) * (float)(x_pi - last_x));
-                cairo_line_to(cr, x_pi, interm_y);
-                cairo_stroke(cr);
-                cairo_move_to(cr, x_minus_pi, interm_y);
+                interm_y = last_y + (y - last_y) / ((x + double_pi) - last_x) * (x_pi - last_x);
+                osm_track_path_segment (&path, last_x, last_y, x_pi, interm_y);
+                path.pen_down = FALSE;
+                osm_track_path_segment (&path, x_minus_pi, interm_y, x, y);
             }
             else
             {
                 /* tp->rlon is > 0 */
-                interm_y = (int)(last_y + (float)(y - last_y) / (float)((x - double_pi) - last_x) * (float)(x_minus_pi - last_x));
-                cairo_line_to(cr, x_minus_pi, interm_y);
-                cairo_stroke(cr);
-                cairo_move_to(cr, x_pi, interm_y);
+                interm_y = last_y + (y - last_y) / ((x - double_pi) - last_x) * (x_minus_pi - last_x);
+                osm_track_path_segment (&path, last_x, last_y, x_minus_pi, interm_y);
+                path.pen_down = FALSE;
+                osm_track_path_segment (&path, x_pi, interm_y, x, y);
+            }
+        }
+        else
+        {
+            osm_track_path_segment (&path, last_x, last_y, x, y);
+        }
+
+        last_x = x;
+        last_y = y;
+        last_lon = tp->rlon;
+    }
+    cairo_stroke(cr);
+    g_free (xy);
+
+    if(path_editable)
+    {
+        xy = osm_gps_map_track_to_pixmap (map, track, NULL);
+
+        /* a dot on every point, and a lighter one between them */
+        for(i = 0; i < n_points; i++)
+        {
+            x = xy[2*i];
+            y = xy[2*i+1];
+            if (osm_track_path_visible (&path, x, y))
+            {
+                cairo_new_sub_path (cr);
+                cairo_arc (cr, x, y, DOT_RADIUS, 0.0, 2 * M_PI);
+            }
+        }
+        cairo_stroke(cr);
+
+        cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha*0.75);
+        for(i = 0; i < n_points; i++)
+        {
+            x = xy[2*i];
+            y = xy[2*i+1];
+            if (i != 0 &&
+                osm_track_path_visible (&path, (last_x + x)/2.0, (last_y+y)/2.0))
+            {
+                cairo_new_sub_path (cr);
+                cairo_arc(cr, (last_x + x)/2.0, (last_y+y)/2.0, DOT_RADIUS, 0.0, 2*M_PI);
             }
-            max_x = x_pi;
-            min_x = x_minus_pi;
+            last_x = x;
+            last_y = y;
+        }
+        cairo_stroke(cr);
+        g_free (xy);
+    }
+}
+
+/* Prints the gps trip history, and any other tracks */
+static void
+osm_gps_map_print_tracks (OsmGpsMap *map, cairo_t *cr)
+{
+    GSList *tmp;
+    OsmGpsMapPrivate *priv = map->priv;
+
+    if (priv->trip_history_show_enabled) {
+        osm_gps_map_print_track (map, priv->gps_track, cr);
+    }
+
+    if (priv->tracks) {
+        tmp = priv->tracks;
+        while (tmp != NULL) {
+            osm_gps_map_print_track (map, OSM_GPS_MAP_TRACK(tmp->data), cr);
+            tmp = g_slist_next(tmp);
         }
+    }
+}
+
+/* Sutherland-Hodgman. Clips the closed polygon xy, of n points, to box
+ * (x_min, y_min, x_max, y_max). Returns the points left, x and y
+ * interleaved, to be freed */
+static GArray *
+osm_gps_map_clip_polygon (const double *xy, guint n, const double *box)
+{
+    GArray *in = g_array_sized_new (FALSE, FALSE, sizeof (double), 2 * n);
+    GArray *out = g_array_sized_new (FALSE, FALSE, sizeof (double), 2 * n);
+    int edge;
+
+    g_array_append_vals (in, xy, 2 * n);
+
+    /* left, top, right, bottom */
+    for (edge = 0; edge < 4 && in->len; edge++) {
+        int axis = edge % 2;
+        double bound = box[edge];
+        gboolean keep_above = edge < 2;
+        guint m = in->len / 2;
+        guint k;
+        GArray *tmp;
+
+        g_array_set_size (out, 0);
+        for (k = 0; k < m; k++) {
+            const double *cur = &g_array_index (in, double, 2 * k);
+            const double *prev = &g_array_index (in, double, 2 * ((k + m - 1) % m));
+            gboolean cur_in = keep_above ? cur[axis] >= bound : cur[axis] <= bound;
+            gboolean prev_in = keep_above ? prev[axis] >= bound : prev[axis] <= bound;
+
+            if (cur_in != prev_in) {
+                double t = (bound - prev[axis]) / (cur[axis] - prev[axis]);
+                double p[2];
+                p[axis] = bound;
+                p[1 - axis] = prev[1 - axis] + t * (cur[1 - axis] - prev[1 - axis]);
+                g_array_append_vals (out, p, 2);
+            }
+            if (cur_in)
+                g_array_append_vals (out, cur, 2);
+        }
+
+        tmp = in;
+        in = out;
+        out = tmp;
+    }
+
+    g_array_free (out, TRUE);
+    return in;
+}
+
+/* The outline of a polygon as drawn at one zoom, kept while the zoom and
+ * the points of its track stay the same */
+typedef struct {
+    OsmGpsMapTrack *track;
+    guint stamp;
+    int zoom;
+    /* the simplified outline, in pixels at zoom from the top left of the
+     * world, x and y interleaved */
+    double *xy;
+    guint n;
+    /* its bounds, x_min, y_min, x_max, y_max */
+    double bounds[4];
+    /* the outline as a path from bounds[0], bounds[1]. Made the first time
+     * all of it is drawn, so that it fits in cairo's fixed point */
+    cairo_path_t *path;
+} OsmPolygonCache;
+
+static void
+osm_polygon_cache_free (OsmPolygonCache *cache)
+{
+    g_free (cache->xy);
+    if (cache->path)
+        cairo_path_destroy (cache->path);
+    g_clear_object (&cache->track);
+    g_free (cache);
+}
+
+static OsmPolygonCache *
+osm_gps_map_polygon_cache (OsmGpsMap *map, OsmGpsMapPolygon *poly, OsmGpsMapTrack *track)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmPolygonCache *cache = g_hash_table_lookup (priv->polygon_cache, poly);
+    const double *world;
+    GArray *lod;
+    guint i;
+
+    if (cache && cache->track == track && cache->zoom == priv->map_zoom &&
+        cache->stamp == osm_gps_map_track_get_stamp (track))
+        return cache;
+
+    if (!cache) {
+        cache = g_new0 (OsmPolygonCache, 1);
+        g_hash_table_insert (priv->polygon_cache, poly, cache);
+    }
+    g_free (cache->xy);
+    if (cache->path)
+        cairo_path_destroy (cache->path);
+    cache->path = NULL;
+
+    g_set_object (&cache->track, track);
+    cache->stamp = osm_gps_map_track_get_stamp (track);
+    cache->zoom = priv->map_zoom;
+
+    /* the outline leaves out points too close to it to make a difference */
+    lod = osm_gps_map_track_get_lod (track, priv->map_zoom);
+    world = osm_gps_map_track_get_world (track);
+    cache->n = lod->len;
+    cache->xy = g_new (double, 2 * cache->n);
+    for (i = 0; i < cache->n; i++) {
+        guint k = g_array_index (lod, guint, i);
+        cache->xy[2*i] = world[2*k];
+        cache->xy[2*i+1] = world[2*k+1];
+    }
+    world2pixel (priv->map_zoom, cache->xy, cache->n, 0.0, 0.0, cache->xy);
+
+    cache->bounds[0] = cache->bounds[1] = G_MAXDOUBLE;
+    cache->bounds[2] = cache->bounds[3] = -G_MAXDOUBLE;
+    for (i = 0; i < cache->n; i++) {
+        cache->bounds[0] = MIN (cache->bounds[0], cache->xy[2*i]);
+        cache->bounds[1] = MIN (cache->bounds[1], cache->xy[2*i+1]);
+        cache->bounds[2] = MAX (cache->bounds[2], cache->xy[2*i]);
+        cache->bounds[3] = MAX (cache->bounds[3], cache->xy[2*i+1]);
+    }
+
+    return cache;
+}
+
+static void
+osm_gps_map_polygon_path (cairo_t *cr, const double *xy, guint n, double x0, double y0)
+{
+    guint i;
+
+    for (i = 0; i < n; i++)
+        cairo_line_to (cr, xy[2*i] - x0, xy[2*i+1] - y0);
+    cairo_close_path (cr);
+}
+
+static void
+osm_gps_map_print_polygon (OsmGpsMap *map, OsmGpsMapPolygon *poly, cairo_t *cr)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+
+    guint n_points;
+    double x, y;
+    gfloat lw, alpha;
+    int map_x0, map_y0;
+    GdkRGBA color;
+    gfloat shade_alpha;
+    OsmPolygonCache *cache;
+    double box[4];
+    guint i;
+
+    OsmGpsMapTrack* track = osm_gps_map_polygon_get_track(poly);
+
+    if(!track)
+        return;
+    n_points = osm_gps_map_track_n_points (track);
+    g_object_get (track,
+                  "line-width", &lw,
+                  "alpha", &alpha,
+                  NULL);
+    osm_gps_map_track_get_color(track, &color);
+
+    if (n_points == 0)
+        return;
+
+    gboolean path_editable = FALSE;
+    gboolean poly_shaded = FALSE;
+    gboolean breakable = TRUE;
+    g_object_get(poly, "editable", &path_editable, NULL);
+    g_object_get(poly, "shaded", &poly_shaded, NULL);
+    g_object_get(poly, "shade_alpha", &shade_alpha, NULL);
+    g_object_get(poly, "breakable", &breakable, NULL);
+
+    map_x0 = priv->map_x - priv->pixmap_border;
+    map_y0 = priv->map_y - priv->pixmap_border;
+
+    /* what is drawn, plus the line width and the dots, in pixels from the
+     * top left of the world */
+    cairo_clip_extents (cr, &box[0], &box[1], &box[2], &box[3]);
+    box[0] += map_x0 - (lw + DOT_RADIUS);
+    box[1] += map_y0 - (lw + DOT_RADIUS);
+    box[2] += map_x0 + (lw + DOT_RADIUS);
+    box[3] += map_y0 + (lw + DOT_RADIUS);
+
+    cache = osm_gps_map_polygon_cache (map, poly, track);
+    if (cache->bounds[2] < box[0] || cache->bounds[0] > box[2] ||
+        cache->bounds[3] < box[1] || cache->bounds[1] > box[3])
+        return;
+
+    cairo_set_line_width (cr, lw);
+    cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+
+    /* one path for the fill and the outline. When all of the polygon is
+     * drawn it is only made once, otherwise it is clipped to what is
+     * drawn, as cairo takes every vertex and only has fixed point */
+    cairo_new_path (cr);
+    if (cache->bounds[0] >= box[0] && cache->bounds[2] <= box[2] &&
+        cache->bounds[1] >= box[1] && cache->bounds[3] <= box[3])
+    {
+        cairo_save (cr);
+        cairo_translate (cr, cache->bounds[0] - map_x0, cache->bounds[1] - map_y0);
+        if (cache->path) {
+            cairo_append_path (cr, cache->path);
+        } else {
+            osm_gps_map_polygon_path (cr, cache->xy, cache->n, cache->bounds[0], cache->bounds[1]);
+            cache->path = cairo_copy_path (cr);
+        }
+        cairo_restore (cr);
+    }
+    else
+    {
+        GArray *clipped = osm_gps_map_clip_polygon (cache->xy, cache->n, box);
+        osm_gps_map_polygon_path (cr, (double *)clipped->data, clipped->len / 2, map_x0, map_y0);
+        g_array_free (clipped, TRUE);
+    }
+
+    if(poly_shaded)
+    {
+        cairo_set_source_rgba (cr, color.red, color.green, color.blue, shade_alpha);
+        cairo_fill_preserve (cr);
+    }
+    cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha);
+    cairo_stroke (cr);
+
+    if(path_editable)
+    {
+        double *all = osm_gps_map_track_to_pixmap (map, track, NULL);
+
+        /* the box in pixmap pixels, dots outside of it are not drawn */
+        box[0] -= map_x0;
+        box[1] -= map_y0;
+        box[2] -= map_x0;
+        box[3] -= map_y0;
+
+        /* a dot on every point, and a lighter one between them */
+        for(i = 0; i < n_points; i++)
+        {
+            x = all[2*i];
+            y = all[2*i+1];
+            if (x < box[0] || x > box[2] || y < box[1] || y > box[3])
+                continue;
+
+            cairo_new_sub_path (cr);
+            cairo_arc (cr, x, y, DOT_RADIUS, 0.0, 2 * M_PI);
+        }
+        cairo_stroke(cr);
+
+        if(breakable)
+        {
+            cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha*0.75);
+            for(i = 1; i <= n_points; i++)
+            {
+                /* the last closes the polygon */
+                guint k = (i < n_points) ? i : 0;
+
+                x = (all[2*i-2] + all[2*k]) / 2.0;
+                y = (all[2*i-1] + all[2*k+1]) / 2.0;
+                if (x < box[0] || x > box[2] || y < box[1] || y > box[3])
+                    continue;
+
+                cairo_new_sub_path (cr);
+                cairo_arc(cr, x, y, DOT_RADIUS, 0.0, 2*M_PI);
+            }
+            cairo_stroke(cr);
+        }
+        g_free (all);
+    }
+}
+
+static void
+osm_gps_map_print_polygons (OsmGpsMap *map, cairo_t* cr)
+{
+    GSList *tmp;
+    OsmGpsMapPrivate *priv = map->priv;
+
+    if (priv->polygons) {
+        tmp = priv->polygons;
+        while (tmp != NULL) {
+            osm_gps_map_print_polygon (map, OSM_GPS_MAP_POLYGON(tmp->data), cr);
+            tmp = g_slist_next(tmp);
+        }
+    }
+}
+
+
+/* (re)creates the backing surfaces for the current size and drag-margin */
+static void
+osm_gps_map_create_pixmap (OsmGpsMap *map)
+{
+    int w,h;
+    GtkWidget *widget = GTK_WIDGET(map);
+    OsmGpsMapPrivate *priv = map->priv;
+
+    if (priv->pixmap)
+        cairo_surface_destroy (priv->pixmap);
+    if (priv->pixmap_spare)
+        cairo_surface_destroy (priv->pixmap_spare);
+    if (priv->overlay)
+        cairo_surface_destroy (priv->overlay);
+    if (priv->overlay_spare)
+        cairo_surface_destroy (priv->overlay_spare);
+
+    w = gtk_widget_get_allocated_width (widget) + priv->pixmap_border * 2;
+    h = gtk_widget_get_allocated_height (widget) + priv->pixmap_border * 2;
+
+    priv->pixmap = gdk_window_create_similar_surface (
+                        gtk_widget_get_window(widget),
+                        CAIRO_CONTENT_COLOR,
+                        w, h);
+    priv->pixmap_spare = cairo_surface_create_similar (
+                        priv->pixmap,
+                        CAIRO_CONTENT_COLOR,
+                        w, h);
+    priv->overlay = cairo_surface_create_similar (
+                        priv->pixmap,
+                        CAIRO_CONTENT_COLOR_ALPHA,
+                        w, h);
+    priv->overlay_spare = cairo_surface_create_similar (
+                        priv->pixmap,
+                        CAIRO_CONTENT_COLOR_ALPHA,
+                        w, h);
+    priv->pixmap_valid = FALSE;
+    priv->overlay_valid = FALSE;
+}
+
+/* Copies *surface dx,dy pixels up and to the left into *spare, then
+ * swaps the two */
+static void
+osm_gps_map_scroll_surface (cairo_surface_t **surface, cairo_surface_t **spare, int dx, int dy)
+{
+    cairo_surface_t *tmp;
+    cairo_t *cr;
+
+    /* cairo can't reliably copy a surface onto itself. Uncovered pixels
+     * are cleared */
+    cr = cairo_create (*spare);
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface (cr, *surface, -dx, -dy);
+    cairo_paint (cr);
+    cairo_destroy (cr);
+
+    tmp = *surface;
+    *surface = *spare;
+    *spare = tmp;
+}
+
+/* The band along the edges exposed by scrolling dx,dy, as up to two
+ * rectangles */
+static int
+osm_gps_map_exposed_band (int dx, int dy, int w, int h, GdkRectangle *band)
+{
+    int n = 0;
+
+    /* a full height column, then the rest of the row */
+    if (dx) {
+        band[n].x = dx > 0 ? w - dx : 0;
+        band[n].y = 0;
+        band[n].width = ABS(dx);
+        band[n].height = h;
+        n++;
+    }
+    if (dy) {
+        band[n].x = dx > 0 ? 0 : -dx;
+        band[n].y = dy > 0 ? h - dy : 0;
+        band[n].width = w - ABS(dx);
+        band[n].height = ABS(dy);
+        n++;
+    }
+    return n;
+}
+
+static cairo_t *
+osm_gps_map_create_clipped (cairo_surface_t *surface, const GdkRectangle *band, int n)
+{
+    cairo_t *cr = cairo_create (surface);
+    int i;
+
+    for (i = 0; i < n; i++)
+        cairo_rectangle (cr, band[i].x, band[i].y, band[i].width, band[i].height);
+    cairo_clip (cr);
+
+    return cr;
+}
+
+static void
+osm_gps_map_render_tiles (OsmGpsMap *map, const GdkRectangle *band, int n)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_t *cr;
+    int i;
+
+    if (n == 0)
+        return;
+
+    cr = osm_gps_map_create_clipped (priv->pixmap, band, n);
+
+    /* clear white background */
+    cairo_set_source_rgb (cr, 1, 1, 1);
+    cairo_paint (cr);
+
+    for (i = 0; i < n; i++)
+        osm_gps_map_fill_tiles_pixel(map, cr, &band[i]);
+    osm_gps_map_download_cancel_stale(map);
+
+    cairo_destroy (cr);
+}
+
+static void
+osm_gps_map_render_overlay (OsmGpsMap *map, const GdkRectangle *band, int n)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_t *cr;
+
+    if (n == 0)
+        return;
+
+    cr = osm_gps_map_create_clipped (priv->overlay, band, n);
+
+    cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+    osm_gps_map_print_tracks(map, cr);
+    osm_gps_map_print_polygons(map, cr);
+    osm_gps_map_print_images(map, cr);
+
+    cairo_destroy (cr);
+}
+
+/* Brings the backing surfaces up to date. Tiles and overlays are each
+ * drawn again only if they were invalidated. Otherwise, if the map moved
+ * since they were drawn, they are scrolled and only the exposed band
+ * is drawn. If pan is not set everything is drawn again */
+static gboolean
+osm_gps_map_map_render (OsmGpsMap *map, gboolean pan)
+{
+    int w, h, dx, dy, n;
+    gboolean scroll;
+    GdkRectangle band[2], all;
+    OsmGpsMapPrivate *priv = map->priv;
+    GtkWidget *widget = GTK_WIDGET(map);
+    gint64 start = g_get_monotonic_time ();
+
+    /* drawn now, rather than at the next frame */
+    if (priv->tick_map_redraw != 0) {
+        gtk_widget_remove_tick_callback (widget, priv->tick_map_redraw);
+        priv->tick_map_redraw = 0;
+    }
+
+    /* dont't redraw if we have not been shown yet */
+    if (!priv->pixmap)
+        return FALSE;
+
+    if (!pan) {
+        priv->pixmap_valid = FALSE;
+        priv->overlay_valid = FALSE;
+    }
+
+    /* drawn once the zoom settles, so that no tiles are loaded for the
+     * zooms passed through */
+    if (priv->zoom_snapshot)
+        return FALSE;
+
+    /* don't redraw the entire map while the OSD is doing */
+    /* some animation or the like. This is to keep the animation */
+    /* fluid */
+    if (priv->layers) {
+        GSList *list;
+        for(list = priv->layers; list != NULL; list = list->next) {
+            OsmGpsMapLayer *layer = list->data;
+            if (osm_gps_map_layer_busy(layer))
+                return FALSE;
+        }
+    }
+
+    w = gtk_widget_get_allocated_width (widget) + priv->pixmap_border * 2;
+    h = gtk_widget_get_allocated_height (widget) + priv->pixmap_border * 2;
+    dx = priv->map_x - priv->pixmap_map_x;
+    dy = priv->map_y - priv->pixmap_map_y;
+
+    all.x = 0;
+    all.y = 0;
+    all.width = w;
+    all.height = h;
+
+    scroll = priv->pixmap_zoom == priv->map_zoom && ABS(dx) < w && ABS(dy) < h;
+    n = scroll ? osm_gps_map_exposed_band (dx, dy, w, h, band) : 0;
+
+    if (priv->pixmap_valid && scroll) {
+        GArray *rects = g_array_sized_new (FALSE, FALSE, sizeof (GdkRectangle),
+                                           n + priv->dirty_tiles->len);
+        guint i;
+
+        if (n)
+            osm_gps_map_scroll_surface (&priv->pixmap, &priv->pixmap_spare, dx, dy);
+
+        /* the exposed band, and where tiles arrived */
+        g_array_append_vals (rects, band, n);
+        for (i = 0; i < priv->dirty_tiles->len; i++) {
+            GdkRectangle tile = g_array_index (priv->dirty_tiles, GdkRectangle, i);
+
+            tile.x -= priv->map_x - priv->pixmap_border;
+            tile.y -= priv->map_y - priv->pixmap_border;
+            if (gdk_rectangle_intersect (&tile, &all, &tile))
+                g_array_append_val (rects, tile);
+        }
+        osm_gps_map_render_tiles (map, (GdkRectangle *)rects->data, rects->len);
+        g_array_free (rects, TRUE);
+    } else {
+        osm_gps_map_render_tiles (map, &all, 1);
+    }
+    g_array_set_size (priv->dirty_tiles, 0);
+
+    if (priv->overlay_valid && scroll) {
+        if (n)
+            osm_gps_map_scroll_surface (&priv->overlay, &priv->overlay_spare, dx, dy);
+        osm_gps_map_render_overlay (map, band, n);
+    } else {
+        osm_gps_map_render_overlay (map, &all, 1);
+    }
+
+    priv->pixmap_map_x = priv->map_x;
+    priv->pixmap_map_y = priv->map_y;
+    priv->pixmap_zoom = priv->map_zoom;
+    priv->pixmap_valid = TRUE;
+    priv->overlay_valid = TRUE;
+
+    if (priv->layers) {
+        GSList *list;
+        for(list = priv->layers; list != NULL; list = list->next) {
+            OsmGpsMapLayer *layer = list->data;
+            osm_gps_map_layer_render (layer, map);
+        }
+    }
+
+    gtk_widget_queue_draw (GTK_WIDGET (map));
+
+    g_signal_emit_by_name (map, "frame-rendered",
+                           (g_get_monotonic_time () - start) / 1000.0);
+
+    return FALSE;
+}
 
-        cairo_line_to(cr, x, y);
-        cairo_stroke(cr);
-        if(path_editable)
-        {
-            cairo_arc (cr, x, y, DOT_RADIUS, 0.0, 2 * M_PI);
-            cairo_stroke(cr);
+gboolean
+osm_gps_map_map_redraw (OsmGpsMap *map)
+{
+    return osm_gps_map_map_render (map, FALSE);
+}
 
-            if(pt != points)
-            {
-                cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha*0.75);
-                cairo_arc(cr, (last_x + x)/2.0, (last_y+y)/2.0, DOT_RADIUS, 0.0, 2*M_PI);
-                cairo_stroke(cr);
-                cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha);
-            }
-        }
+/* Runs at most once per frame, before it is painted, however many times
+ * the map was invalidated since the last one */
+static gboolean
+osm_gps_map_map_redraw_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+    OsmGpsMap *map = OSM_GPS_MAP(widget);
 
-        cairo_move_to(cr, x, y);
+    /* removed by returning */
+    map->priv->tick_map_redraw = 0;
 
-        max_x = MAX(x,max_x);
-        min_x = MIN(x,min_x);
-        max_y = MAX(y,max_y);
-        min_y = MIN(y,min_y);
+    /* whatever needs drawing again was invalidated when it was queued */
+    osm_gps_map_map_render (map, TRUE);
 
-        last_x = x;
-        last_y = y;
-        last_lon = tp->rlon;
-    }
+    return G_SOURCE_REMOVE;
+}
 
-    gtk_widget_queue_draw_area (
-        GTK_WIDGET(map),
-        min_x - lw,
-        min_y - lw,
-        max_x + (lw * 2),
-        max_y + (lw * 2));
+/* Like osm_gps_map_map_redraw_idle(), but only draws what was exposed if
+ * map_x,y changed, and the layers */
+static void
+osm_gps_map_map_update_idle (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
 
-    cairo_stroke(cr);
+    if (priv->tick_map_redraw == 0)
+        priv->tick_map_redraw = gtk_widget_add_tick_callback (GTK_WIDGET (map),
+                                                              osm_gps_map_map_redraw_tick,
+                                                              NULL, NULL);
 }
 
-/* Prints the gps trip history, and any other tracks */
+void
+osm_gps_map_map_redraw_idle (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+
+    priv->pixmap_valid = FALSE;
+    priv->overlay_valid = FALSE;
+    osm_gps_map_map_update_idle (map);
+}
+
+/* Draws the tracks, polygons and images again, but not the tiles */
 static void
-osm_gps_map_print_tracks (OsmGpsMap *map, cairo_t *cr)
+osm_gps_map_overlay_redraw_idle (OsmGpsMap *map)
+{
+    map->priv->overlay_valid = FALSE;
+    osm_gps_map_map_update_idle (map);
+}
+
+/* The map as shown: the world position (0 to 1) at the center of the
+ * widget, and the number of pixels across the whole world */
+static void
+osm_gps_map_get_view (OsmGpsMap *map, double *view)
 {
-    GSList *tmp;
     OsmGpsMapPrivate *priv = map->priv;
+    GtkWidget *widget = GTK_WIDGET(map);
 
-    if (priv->trip_history_show_enabled) {
-        osm_gps_map_print_track (map, priv->gps_track, cr);
+    if (priv->zoom_snapshot) {
+        memcpy (view, priv->zoom_view, sizeof (priv->zoom_view));
+        return;
     }
 
-    if (priv->tracks) {
-        tmp = priv->tracks;
-        while (tmp != NULL) {
-            osm_gps_map_print_track (map, OSM_GPS_MAP_TRACK(tmp->data), cr);
-            tmp = g_slist_next(tmp);
-        }
-    }
+    view[2] = (double)TILESIZE * (1 << priv->map_zoom);
+    view[0] = (priv->map_x + gtk_widget_get_allocated_width (widget) / 2) / view[2];
+    view[1] = (priv->map_y + gtk_widget_get_allocated_height (widget) / 2) / view[2];
 }
 
 static void
-osm_gps_map_print_polygon (OsmGpsMap *map, OsmGpsMapPolygon *poly, cairo_t *cr)
+osm_gps_map_zoom_animation_stop (OsmGpsMap *map)
 {
     OsmGpsMapPrivate *priv = map->priv;
 
-    GSList *pt,*points;
-    int x,y;
-    int min_x = 0,min_y = 0,max_x = 0,max_y = 0;
-    gfloat lw, alpha;
-    int map_x0, map_y0;
-    GdkRGBA color;
-    gfloat shade_alpha;
+    if (!priv->zoom_snapshot)
+        return;
 
-    OsmGpsMapTrack* track = osm_gps_map_polygon_get_track(poly);
+    if (priv->tick_zoom_animation != 0) {
+        gtk_widget_remove_tick_callback (GTK_WIDGET (map), priv->tick_zoom_animation);
+        priv->tick_zoom_animation = 0;
+    }
+    cairo_surface_destroy (priv->zoom_snapshot);
+    priv->zoom_snapshot = NULL;
 
-    if(!track)
-        return;
-    g_object_get (track,
-                  "track", &points,
-                  "line-width", &lw,
-                  "alpha", &alpha,
-                  NULL);
-    osm_gps_map_track_get_color(track, &color);
+    /* the surfaces were invalidated when the zoom changed */
+    osm_gps_map_map_update_idle (map);
+}
 
-    if (points == NULL)
-        return;
+static gboolean
+osm_gps_map_zoom_animation_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+    OsmGpsMap *map = OSM_GPS_MAP(widget);
+    OsmGpsMapPrivate *priv = map->priv;
+    double t, scale;
 
-    gboolean path_editable = FALSE;
-    gboolean poly_shaded = FALSE;
-    gboolean breakable = TRUE;
-    g_object_get(poly, "editable", &path_editable, NULL);
-    g_object_get(poly, "shaded", &poly_shaded, NULL);
-    g_object_get(poly, "shade_alpha", &shade_alpha, NULL);
-    g_object_get(poly, "breakable", &breakable, NULL);
+    t = (gdk_frame_clock_get_frame_time (clock) - priv->zoom_animation_start) /
+        (1000.0 * priv->zoom_animation_duration);
 
-    cairo_set_line_width (cr, lw);
-    cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha);
-    cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
-    cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+    if (t >= 1.0) {
+        /* removed by returning */
+        priv->tick_zoom_animation = 0;
+        osm_gps_map_zoom_animation_stop (map);
+        return G_SOURCE_REMOVE;
+    }
 
-    map_x0 = priv->map_x - EXTRA_BORDER;
-    map_y0 = priv->map_y - EXTRA_BORDER;
+    /* slowing down towards the end, the scale changing by the same factor
+     * in the same time, about the fixed position */
+    t = 1.0 - (1.0 - t) * (1.0 - t) * (1.0 - t);
+    scale = priv->zoom_from[2] * pow (priv->zoom_to_scale / priv->zoom_from[2], t);
+    priv->zoom_view[0] = priv->zoom_fixed[0] + (priv->zoom_from[0] - priv->zoom_fixed[0]) * priv->zoom_from[2] / scale;
+    priv->zoom_view[1] = priv->zoom_fixed[1] + (priv->zoom_from[1] - priv->zoom_fixed[1]) * priv->zoom_from[2] / scale;
+    priv->zoom_view[2] = scale;
 
-    int first_x = 0, first_y = 0;
-    for(pt = points; pt != NULL; pt = pt->next)
-    {
-        OsmGpsMapPoint *tp = pt->data;
+    gtk_widget_queue_draw (widget);
 
-        x = lon2pixel(priv->map_zoom, tp->rlon) - map_x0;
-        y = lat2pixel(priv->map_zoom, tp->rlat) - map_y0;
+    return G_SOURCE_CONTINUE;
+}
 
-        /* first time through loop */
-        if (pt == points)
-        {
-            cairo_move_to(cr, x, y);
-            first_x = x; first_y = y;
-        }
+/* Called once map_zoom, map_x and map_y are those zoomed to, from the map
+ * as shown, or as the animation running shows it */
+static void
+osm_gps_map_zoom_animation_start (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    int w = gtk_widget_get_allocated_width (GTK_WIDGET (map));
+    int h = gtk_widget_get_allocated_height (GTK_WIDGET (map));
+    double from[3], to[3];
 
-        cairo_line_to(cr, x, y);
-    }
-    //close off polygon
-    cairo_line_to(cr, first_x, first_y);
-    cairo_stroke(cr);
+    if (priv->zoom_animation_duration == 0 || !priv->pixmap ||
+        !gtk_widget_get_mapped (GTK_WIDGET (map)))
+        return;
 
-    if(path_editable)
-    {
-        int last_x = 0, last_y = 0;
-        for(pt = points; pt != NULL; pt = pt->next)
-        {
-            OsmGpsMapPoint *tp = pt->data;
+    /* keep the map the way it was drawn, tiles and overlay together */
+    if (!priv->zoom_snapshot) {
+        cairo_t *cr;
 
-            x = lon2pixel(priv->map_zoom, tp->rlon) - map_x0;
-            y = lat2pixel(priv->map_zoom, tp->rlat) - map_y0;
+        if (!priv->pixmap_valid || !priv->overlay_valid)
+            return;
 
-            cairo_arc (cr, x, y, DOT_RADIUS, 0.0, 2 * M_PI);
-            cairo_stroke(cr);
+        priv->zoom_snapshot = cairo_surface_create_similar (priv->pixmap, CAIRO_CONTENT_COLOR,
+                                                            w + priv->pixmap_border * 2,
+                                                            h + priv->pixmap_border * 2);
+        cr = cairo_create (priv->zoom_snapshot);
+        cairo_set_source_surface (cr, priv->pixmap, 0, 0);
+        cairo_paint (cr);
+        cairo_set_source_surface (cr, priv->overlay, 0, 0);
+        cairo_paint (cr);
+        cairo_destroy (cr);
 
-            if((pt != points) && (breakable))
-            {
-                cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha*0.75);
-                cairo_arc(cr, (last_x + x)/2.0, (last_y+y)/2.0, DOT_RADIUS, 0.0, 2*M_PI);
-                cairo_stroke(cr);
-                cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha);
-            }
-            last_x = x; last_y = y;
-        }
+        priv->zoom_snapshot_view[2] = (double)TILESIZE * (1 << priv->pixmap_zoom);
+        priv->zoom_snapshot_view[0] = (priv->pixmap_map_x - priv->pixmap_border) / priv->zoom_snapshot_view[2];
+        priv->zoom_snapshot_view[1] = (priv->pixmap_map_y - priv->pixmap_border) / priv->zoom_snapshot_view[2];
 
-        x = first_x; y = first_y;
-        if(breakable)
-        {
-            cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha*0.75);
-            cairo_arc(cr, (last_x + x)/2.0, (last_y+y)/2.0, DOT_RADIUS, 0.0, 2*M_PI);
-            cairo_stroke(cr);
-        }
-        cairo_set_source_rgba (cr, color.red, color.green, color.blue, alpha);
+        /* the center may have been moved already, but not drawn */
+        from[2] = priv->zoom_snapshot_view[2];
+        from[0] = (priv->pixmap_map_x + w / 2) / from[2];
+        from[1] = (priv->pixmap_map_y + h / 2) / from[2];
+    } else {
+        memcpy (from, priv->zoom_view, sizeof (from));
     }
 
-    if(poly_shaded)
-    {
-        cairo_set_source_rgba (cr, color.red, color.green, color.blue, shade_alpha);
-        first_x = 0;
-        first_y = 0;
-        for(pt = points; pt != NULL; pt = pt->next)
-        {
-            OsmGpsMapPoint *tp = pt->data;
+    to[2] = (double)TILESIZE * (1 << priv->map_zoom);
+    to[0] = (priv->map_x + w / 2) / to[2];
+    to[1] = (priv->map_y + h / 2) / to[2];
 
-            x = lon2pixel(priv->map_zoom, tp->rlon) - map_x0;
-            y = lat2pixel(priv->map_zoom, tp->rlat) - map_y0;
+    if (from[2] == to[2]) {
+        osm_gps_map_zoom_animation_stop (map);
+        return;
+    }
 
-            /* first time through loop */
-            if (pt == points)
-            {
-                cairo_move_to(cr, x, y);
-                first_x = x; first_y = y;
-            }
+    /* the one position shown at the same place in both views */
+    priv->zoom_fixed[0] = (from[0] * from[2] - to[0] * to[2]) / (from[2] - to[2]);
+    priv->zoom_fixed[1] = (from[1] * from[2] - to[1] * to[2]) / (from[2] - to[2]);
+    memcpy (priv->zoom_from, from, sizeof (priv->zoom_from));
+    memcpy (priv->zoom_view, from, sizeof (priv->zoom_view));
+    priv->zoom_to_scale = to[2];
+    priv->zoom_animation_start = g_get_monotonic_time ();
+
+    if (priv->tick_zoom_animation == 0)
+        priv->tick_zoom_animation = gtk_widget_add_tick_callback (GTK_WIDGET (map),
+                                                                  osm_gps_map_zoom_animation_tick,
+                                                                  NULL, NULL);
+
+    /* the tiles it ends at load while it plays */
+    osm_gps_map_prefetch_tiles (map, priv->map_x, priv->map_y);
+}
 
-            cairo_line_to(cr, x, y);
-        }
-        //close off polygon
-        cairo_line_to(cr, first_x, first_y);
-        cairo_fill(cr);
-    }
+/* Shows zoom_snapshot at zoom_view */
+static void
+osm_gps_map_draw_zoom_animation (OsmGpsMap *map, cairo_t *cr)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GtkWidget *widget = GTK_WIDGET(map);
+    int w = gtk_widget_get_allocated_width (widget);
+    int h = gtk_widget_get_allocated_height (widget);
+    double *view = priv->zoom_view;
+    double *snapshot = priv->zoom_snapshot_view;
 
-    gtk_widget_queue_draw_area (
-        GTK_WIDGET(map),
-        min_x - lw,
-        min_y - lw,
-        max_x + (lw * 2),
-        max_y + (lw * 2));
+    draw_white_rectangle (cr, 0, 0, w, h);
 
+    cairo_save (cr);
+    cairo_translate (cr,
+                     w / 2 + (snapshot[0] - view[0]) * view[2],
+                     h / 2 + (snapshot[1] - view[1]) * view[2]);
+    cairo_scale (cr, view[2] / snapshot[2], view[2] / snapshot[2]);
+    cairo_set_source_surface (cr, priv->zoom_snapshot, 0, 0);
+    cairo_paint (cr);
+    cairo_restore (cr);
 }
 
+/* Starts loading the tiles which would be drawn with the map at map_x,y,
+ * without drawing them */
 static void
-osm_gps_map_print_polygons (OsmGpsMap *map, cairo_t* cr)
+osm_gps_map_prefetch_tiles (OsmGpsMap *map, int map_x, int map_y)
 {
-    GSList *tmp;
     OsmGpsMapPrivate *priv = map->priv;
+    GtkWidget *widget = GTK_WIDGET(map);
+    int zoom = priv->map_zoom;
+    int zoom_offset = 0;
+    int i, j, tile_x0, tile_y0, tile_x1, tile_y1, max_tile;
 
-    if (priv->polygons) {
-        tmp = priv->polygons;
-        while (tmp != NULL) {
-            osm_gps_map_print_polygon (map, OSM_GPS_MAP_POLYGON(tmp->data), cr);
-            tmp = g_slist_next(tmp);
-        }
+    if (priv->map_source == OSM_GPS_MAP_SOURCE_NULL && priv->repo_uri == NULL)
+        return;
+
+    /* as in osm_gps_map_load_tile() */
+    if (zoom > MIN_ZOOM) {
+        zoom_offset = priv->tile_zoom_offset;
+        zoom -= zoom_offset;
     }
-}
 
+    tile_x0 = floor ((double)(map_x - priv->pixmap_border) / TILESIZE);
+    tile_y0 = floor ((double)(map_y - priv->pixmap_border) / TILESIZE);
+    tile_x1 = floor ((double)(map_x + gtk_widget_get_allocated_width (widget) + priv->pixmap_border - 1) / TILESIZE);
+    tile_y1 = floor ((double)(map_y + gtk_widget_get_allocated_height (widget) + priv->pixmap_border - 1) / TILESIZE);
 
-static gboolean
-osm_gps_map_purge_cache_check(gpointer key, gpointer value, gpointer user)
-{
-   return (((OsmCachedTile*)value)->redraw_cycle != ((OsmGpsMapPrivate*)user)->redraw_cycle);
+    max_tile = 1 << priv->map_zoom;
+    tile_x0 = MAX (tile_x0, 0) >> zoom_offset;
+    tile_y0 = MAX (tile_y0, 0) >> zoom_offset;
+    tile_x1 = MIN (tile_x1, max_tile - 1) >> zoom_offset;
+    tile_y1 = MIN (tile_y1, max_tile - 1) >> zoom_offset;
+
+    for (i = tile_x0; i <= tile_x1; i++) {
+        for (j = tile_y0; j <= tile_y1; j++) {
+            OsmCachedTile *tile = osm_gps_map_lookup_cached_tile (map, zoom, i, j);
+
+            if (tile && !tile->provisional)
+                continue;
+
+            if (priv->tile_store)
+                osm_gps_map_queue_decode (map, zoom, i, j, NULL, TRUE);
+            else if (priv->map_auto_download_enabled)
+                osm_gps_map_download_tile (map, zoom, i, j, TRUE);
+        }
+    }
 }
 
+/* Stops kinetic scrolling where the map is now */
 static void
-osm_gps_map_purge_cache (OsmGpsMap *map)
+osm_gps_map_kinetic_stop (OsmGpsMap *map)
 {
-   OsmGpsMapPrivate *priv = map->priv;
+    OsmGpsMapPrivate *priv = map->priv;
 
-   if (g_hash_table_size (priv->tile_cache) < priv->max_tile_cache_size)
-       return;
+    if (priv->tick_kinetic == 0)
+        return;
 
-   /* run through the cache, and remove the tiles which have not been used
-    * during the last redraw operation */
-   g_hash_table_foreach_remove(priv->tile_cache, osm_gps_map_purge_cache_check, priv);
+    gtk_widget_remove_tick_callback (GTK_WIDGET (map), priv->tick_kinetic);
+    priv->tick_kinetic = 0;
+    center_coord_update (map);
 }
 
-gboolean
-osm_gps_map_map_redraw (OsmGpsMap *map)
+static gboolean
+osm_gps_map_kinetic_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
 {
-    cairo_t *cr;
-    int w, h;
+    OsmGpsMap *map = OSM_GPS_MAP(widget);
     OsmGpsMapPrivate *priv = map->priv;
-    GtkWidget *widget = GTK_WIDGET(map);
+    double t, f, left;
 
-    priv->idle_map_redraw = 0;
-
-    /* dont't redraw if we have not been shown yet */
-    if (!priv->pixmap)
-        return FALSE;
+    t = (gdk_frame_clock_get_frame_time (clock) - priv->kinetic_start) / 1000000.0;
+    f = 1.0 - exp (-t / KINETIC_TIME_CONSTANT);
+    left = hypot (priv->kinetic_velocity[0], priv->kinetic_velocity[1]) *
+           KINETIC_TIME_CONSTANT * (1.0 - f);
 
-    /* don't redraw the entire map while the OSD is doing */
-    /* some animation or the like. This is to keep the animation */
-    /* fluid */
-    if (priv->layers) {
-        GSList *list;
-        for(list = priv->layers; list != NULL; list = list->next) {
-            OsmGpsMapLayer *layer = list->data;
-            if (osm_gps_map_layer_busy(layer))
-                return FALSE;
-        }
+    if (left < 0.5) {
+        priv->map_x = priv->kinetic_to[0];
+        priv->map_y = priv->kinetic_to[1];
+    } else {
+        priv->map_x = priv->kinetic_from[0] + lround (priv->kinetic_velocity[0] * KINETIC_TIME_CONSTANT * f);
+        priv->map_y = priv->kinetic_from[1] + lround (priv->kinetic_velocity[1] * KINETIC_TIME_CONSTANT * f);
     }
 
-    /* the motion_notify handler uses priv->surface to redraw the area; if we
-     * change it while we are dragging, we will end up showing it in the wrong
-     * place. This could be fixed by carefully recompute the coordinates, but
-     * for now it's easier just to disable redrawing the map while dragging */
-    if (priv->is_dragging)
-        return FALSE;
+    /* drawn now, for this frame */
+    osm_gps_map_map_render (map, TRUE);
 
-    /* paint to the backing surface */
-    cr = cairo_create (priv->pixmap);
+    if (left < 0.5) {
+        /* removed by returning */
+        priv->tick_kinetic = 0;
+        center_coord_update (map);
+        return G_SOURCE_REMOVE;
+    }
 
-    /* undo all offsets that may have happened when dragging */
-    priv->drag_mouse_dx = 0;
-    priv->drag_mouse_dy = 0;
+    return G_SOURCE_CONTINUE;
+}
 
-    priv->redraw_cycle++;
+/* Keeps the map moving after a drag, at the velocity it was dragged */
+static void
+osm_gps_map_kinetic_start (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    double *v = priv->drag_velocity;
+    double speed = hypot (v[0], v[1]);
 
-    /* clear white background */
-    w = gtk_widget_get_allocated_width (widget);
-    h = gtk_widget_get_allocated_height (widget);
-    draw_white_rectangle(cr, 0, 0, w + EXTRA_BORDER * 2, h + EXTRA_BORDER * 2);
+    /* the pointer stopped before it was released */
+    if (g_get_monotonic_time () - priv->drag_last_time > 100000)
+        return;
+    if (!priv->kinetic_scrolling || speed < KINETIC_MIN_VELOCITY)
+        return;
 
-    osm_gps_map_fill_tiles_pixel(map, cr);
+    if (speed > KINETIC_MAX_VELOCITY) {
+        v[0] *= KINETIC_MAX_VELOCITY / speed;
+        v[1] *= KINETIC_MAX_VELOCITY / speed;
+    }
 
-    osm_gps_map_print_tracks(map, cr);
-    osm_gps_map_print_polygons(map, cr);
-    osm_gps_map_print_images(map, cr);
+    priv->kinetic_start = g_get_monotonic_time ();
+    priv->kinetic_from[0] = priv->map_x;
+    priv->kinetic_from[1] = priv->map_y;
+    priv->kinetic_velocity[0] = v[0];
+    priv->kinetic_velocity[1] = v[1];
+    priv->kinetic_to[0] = priv->map_x + lround (v[0] * KINETIC_TIME_CONSTANT);
+    priv->kinetic_to[1] = priv->map_y + lround (v[1] * KINETIC_TIME_CONSTANT);
+
+    priv->tick_kinetic = gtk_widget_add_tick_callback (GTK_WIDGET (map),
+                                                       osm_gps_map_kinetic_tick,
+                                                       NULL, NULL);
+
+    /* where it stops is known, so load it before it gets there. Tiles
+     * which were wanted for the drag, but which are not on the way, are
+     * dropped by osm_gps_map_download_cancel_stale() */
+    osm_gps_map_prefetch_tiles (map, priv->kinetic_to[0], priv->kinetic_to[1]);
+}
 
-    /* draw the gps point using the appropriate virtual private method */
-    if (priv->gps_track_used && priv->gps_point_enabled) {
-        OsmGpsMapClass *klass = OSM_GPS_MAP_GET_CLASS(map);
-        if (klass->draw_gps_point)
-            klass->draw_gps_point (map, cr);
-    }
+/* Draws the segment to the point just added to track straight onto the
+ * overlay, where osm_gps_map_print_track() would have drawn it. Returns
+ * FALSE if the whole overlay has to be drawn again instead */
+static gboolean
+osm_gps_map_print_track_append (OsmGpsMap *map, OsmGpsMapTrack *track)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    OsmGpsMapTrack *top;
+    const OsmGpsMapPoint *points, *p0, *p1;
+    guint n_points;
+    gboolean path_editable = FALSE;
+    gfloat lw, alpha;
+    GdkRGBA color;
+    int map_x0, map_y0, pad;
+    double xy[4];
+    OsmTrackPath path;
 
-    if (priv->layers) {
-        GSList *list;
-        for(list = priv->layers; list != NULL; list = list->next) {
-            OsmGpsMapLayer *layer = list->data;
-            osm_gps_map_layer_render (layer, map);
-        }
-    }
+    if (!priv->overlay || !priv->overlay_valid || priv->pixmap_zoom != priv->map_zoom)
+        return FALSE;
 
-    osm_gps_map_purge_cache(map);
-    gtk_widget_queue_draw (GTK_WIDGET (map));
+    /* the segment would be drawn over things drawn after the track */
+    if (priv->polygons || priv->images)
+        return FALSE;
+    top = priv->tracks ? g_slist_last (priv->tracks)->data :
+          priv->trip_history_show_enabled ? priv->gps_track : NULL;
+    if (track != top)
+        return FALSE;
 
-    cairo_destroy (cr);
+    points = osm_gps_map_track_get_point_array (track, &n_points);
+    g_object_get (track,
+                  "line-width", &lw,
+                  "alpha", &alpha,
+                  "editable", &path_editable,
+                  NULL);
+    osm_gps_map_track_get_color(track, &color);
 
-    return FALSE;
-}
+    /* the whole track is stroked at once, so a translucent segment would
+     * show where it overlaps the last one, and the dots are drawn last */
+    if (alpha < 1.0 || path_editable)
+        return FALSE;
 
-void
-osm_gps_map_map_redraw_idle (OsmGpsMap *map)
-{
-    OsmGpsMapPrivate *priv = map->priv;
+    if (n_points < 2)
+        return FALSE;
+    p0 = &points[n_points - 2];
+    p1 = &points[n_points - 1];
+
+    /* crossing the date line */
+    if (fabs(p1->rlon - p0->rlon) > M_PI)
+        return FALSE;
 
-    if (priv->idle_map_redraw == 0)
-        priv->idle_map_redraw = g_idle_add ((GSourceFunc)osm_gps_map_map_redraw, map);
+    /* the overlay is where it was drawn, which may not be where the map
+     * is now */
+    map_x0 = priv->pixmap_map_x - priv->pixmap_border;
+    map_y0 = priv->pixmap_map_y - priv->pixmap_border;
+    world2pixel (priv->map_zoom,
+                 osm_gps_map_track_get_world (track) + 2 * (n_points - 2), 2,
+                 map_x0, map_y0, xy);
+
+    path.cr = cairo_create (priv->overlay);
+    path.pen_down = FALSE;
+    cairo_clip_extents (path.cr, &path.box[0], &path.box[1], &path.box[2], &path.box[3]);
+    path.box[0] -= lw;
+    path.box[1] -= lw;
+    path.box[2] += lw;
+    path.box[3] += lw;
+
+    cairo_set_line_width (path.cr, lw);
+    cairo_set_source_rgba (path.cr, color.red, color.green, color.blue, alpha);
+    cairo_set_line_cap (path.cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join (path.cr, CAIRO_LINE_JOIN_ROUND);
+
+    osm_track_path_segment (&path, xy[0], xy[1], xy[2], xy[3]);
+    cairo_stroke (path.cr);
+    cairo_destroy (path.cr);
+
+    /* in widget coordinates */
+    pad = lw + 2;
+    gtk_widget_queue_draw_area (GTK_WIDGET(map),
+                                floor(MIN(xy[0], xy[2])) - pad + map_x0 - priv->map_x,
+                                floor(MIN(xy[1], xy[3])) - pad + map_y0 - priv->map_y,
+                                ceil(fabs(xy[2] - xy[0])) + 2 * pad + 1,
+                                ceil(fabs(xy[3] - xy[1])) + 2 * pad + 1);
+    return TRUE;
 }
 
 /* call this to update center_rlat and center_rlon after
@@ -1555,14 +3426,14 @@ center_coord_update(OsmGpsMap *map) {
 
 /* Automatically center the map if the current point, i.e the most recent
  * gps point, approaches the edge, and map_auto_center is set. Does not
- * request the map be redrawn */
-static void
+ * request the map be redrawn, returns TRUE if it moved */
+static gboolean
 maybe_autocenter_map (OsmGpsMap *map)
 {
     OsmGpsMapPrivate *priv;
     GtkAllocation allocation;
 
-    g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
+    g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), FALSE);
     priv = map->priv;
     gtk_widget_get_allocation(GTK_WIDGET(map), &allocation);
 
@@ -1579,8 +3450,10 @@ maybe_autocenter_map (OsmGpsMap *map)
             priv->map_x = pixel_x - allocation.width/2;
             priv->map_y = pixel_y - allocation.height/2;
             center_coord_update(map);
+            return TRUE;
         }
     }
+    return FALSE;
 }
 
 static gboolean
@@ -1628,25 +3501,25 @@ on_window_key_press(GtkWidget *widget, GdkEventKey *event, OsmGpsMapPrivate *pri
             case OSM_GPS_MAP_KEY_UP:
                 priv->map_y -= step;
                 center_coord_update(map);
-                osm_gps_map_map_redraw_idle(map);
+                osm_gps_map_map_update_idle(map);
                 handled = TRUE;
                 break;
             case OSM_GPS_MAP_KEY_DOWN:
                 priv->map_y += step;
                 center_coord_update(map);
-                osm_gps_map_map_redraw_idle(map);
+                osm_gps_map_map_update_idle(map);
                 handled = TRUE;
                 break;
               case OSM_GPS_MAP_KEY_LEFT:
                 priv->map_x -= step;
                 center_coord_update(map);
-                osm_gps_map_map_redraw_idle(map);
+                osm_gps_map_map_update_idle(map);
                 handled = TRUE;
                 break;
             case OSM_GPS_MAP_KEY_RIGHT:
                 priv->map_x += step;
                 center_coord_update(map);
-                osm_gps_map_map_redraw_idle(map);
+                osm_gps_map_map_update_idle(map);
                 handled = TRUE;
                 break;
             default:
@@ -1660,14 +3533,39 @@ on_window_key_press(GtkWidget *widget, GdkEventKey *event, OsmGpsMapPrivate *pri
 static void
 on_gps_point_added (OsmGpsMapTrack *track, OsmGpsMapPoint *point, OsmGpsMap *map)
 {
-    osm_gps_map_map_redraw_idle (map);
-    maybe_autocenter_map (map);
+    if (!osm_gps_map_print_track_append (map, track))
+        osm_gps_map_overlay_redraw_idle (map);
+    if (maybe_autocenter_map (map))
+        osm_gps_map_map_update_idle (map);
 }
 
 static void
 on_track_changed (OsmGpsMapTrack *track, GParamSpec *pspec, OsmGpsMap *map)
 {
-    osm_gps_map_map_redraw_idle (map);
+    osm_gps_map_overlay_redraw_idle (map);
+}
+
+/* a point was inserted, removed or moved */
+static void
+on_track_point_changed (OsmGpsMapTrack *track, int pos, OsmGpsMap *map)
+{
+    osm_gps_map_overlay_redraw_idle (map);
+}
+
+/* Redraws the overlay whenever the track changes */
+static void
+osm_gps_map_connect_track (OsmGpsMap *map, OsmGpsMapTrack *track)
+{
+    g_signal_connect(track, "point-added",
+                    G_CALLBACK(on_gps_point_added), map);
+    g_signal_connect(track, "point-inserted",
+                    G_CALLBACK(on_track_point_changed), map);
+    g_signal_connect(track, "point-removed",
+                    G_CALLBACK(on_track_point_changed), map);
+    g_signal_connect(track, "point-changed",
+                    G_CALLBACK(on_track_point_changed), map);
+    g_signal_connect(track, "notify",
+                    G_CALLBACK(on_track_changed), map);
 }
 
 static void
@@ -1680,6 +3578,9 @@ osm_gps_map_init (OsmGpsMap *object)
     object->priv = priv;
 
     priv->pixmap = NULL;
+    priv->pixmap_spare = NULL;
+    priv->overlay = NULL;
+    priv->overlay_spare = NULL;
 
     priv->trip_history = NULL;
     priv->gps = osm_gps_map_point_new_radians(0.0, 0.0);
@@ -1687,18 +3588,17 @@ osm_gps_map_init (OsmGpsMap *object)
     priv->gps_heading = OSM_GPS_MAP_INVALID;
 
     priv->gps_track = osm_gps_map_track_new();
-    g_signal_connect(priv->gps_track, "point-added",
-                    G_CALLBACK(on_gps_point_added), object);
-    g_signal_connect(priv->gps_track, "notify",
-                    G_CALLBACK(on_track_changed), object);
+    osm_gps_map_connect_track(object, priv->gps_track);
 
     priv->tracks = NULL;
     priv->images = NULL;
+    priv->image_index = osm_image_index_new();
+    priv->dirty_tiles = g_array_new (FALSE, FALSE, sizeof (GdkRectangle));
+    priv->polygon_cache = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                 NULL, (GDestroyNotify) osm_polygon_cache_free);
     priv->layers = NULL;
 
     priv->drag_counter = 0;
-    priv->drag_mouse_dx = 0;
-    priv->drag_mouse_dy = 0;
     priv->drag_start_mouse_x = 0;
     priv->drag_start_mouse_y = 0;
 
@@ -1716,19 +3616,24 @@ osm_gps_map_init (OsmGpsMap *object)
     priv->soup_session = soup_session_new ();
     soup_session_set_user_agent (priv->soup_session, USER_AGENT);
 
-    /* Hash table which maps tile d/l URIs to SoupMessage requests, the hashtable
-       must free the key, the soup session unrefs the message */
-    priv->tile_queue = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, NULL);
+    /* maps tiles to the GCancellable of their queued or active download */
+    priv->tile_queue = osm_tile_index_new (g_object_unref);
 
     //Some mapping providers (Google) have varying degrees of tiles at multiple
     //zoom levels
-    priv->missing_tiles = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->missing_tiles = osm_tile_index_new (NULL);
+
+    /* downloads waiting for, or using, a connection to each server */
+    priv->download_hosts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  NULL, (GDestroyNotify)osm_download_host_free);
 
     /* memory cache for most recently used tiles */
-    priv->tile_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, (GDestroyNotify)cached_tile_free);
-    priv->max_tile_cache_size = 20;
+    priv->tile_cache = osm_tile_index_new ((GDestroyNotify)cached_tile_free);
+    g_queue_init (&priv->tile_cache_lru);
+
+    /* tiles being loaded from the tile store */
+    priv->decode_queue = osm_tile_index_new (NULL);
+    priv->decode_results = g_async_queue_new_full ((GDestroyNotify)osm_tile_decode_free);
 
     gtk_widget_add_events (GTK_WIDGET (object),
                            GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK |
@@ -1754,6 +3659,43 @@ osm_gps_map_get_cache_base_dir(OsmGpsMapPrivate *priv)
     return osm_gps_map_get_default_cache_directory();
 }
 
+static void
+osm_gps_map_setup_tile_store(OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    gboolean same_pack;
+
+    /* the pack is locked until the writes to it are done, otherwise they
+     * finish in the background, each holding its store */
+    same_pack = priv->tile_cache_packed && priv->tile_store && priv->cache_dir &&
+                g_strcmp0 (osm_tile_store_get_cache_dir (priv->tile_store), priv->cache_dir) == 0;
+    osm_gps_map_decode_cancel_all(map);
+    osm_gps_map_write_flush(map, same_pack);
+
+    osm_tile_store_unref(priv->tile_store);
+    priv->tile_store = NULL;
+
+    if (!priv->cache_dir)
+        return;
+
+    if (priv->tile_cache_packed) {
+        GError *error = NULL;
+        priv->tile_store = osm_tile_store_new_pack(priv->cache_dir, &error);
+        if (!priv->tile_store) {
+            g_warning("Falling back to one file per tile: %s", error->message);
+            g_error_free(error);
+            /* so that the application can tell */
+            priv->tile_cache_packed = FALSE;
+            g_object_notify(G_OBJECT(map), "tile-cache-packed");
+        }
+    }
+
+    if (!priv->tile_store)
+        priv->tile_store = osm_tile_store_new_files(priv->cache_dir, priv->image_format);
+
+    osm_tile_store_set_sync(priv->tile_store, priv->tile_cache_sync);
+}
+
 static void
 osm_gps_map_setup(OsmGpsMap *map)
 {
@@ -1766,8 +3708,14 @@ osm_gps_map_setup(OsmGpsMap *map)
         g_debug("Using null source");
         priv->map_source = OSM_GPS_MAP_SOURCE_NULL;
 
-        priv->null_tile = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, 256, 256);
-        gdk_pixbuf_fill(priv->null_tile, 0xcccccc00);
+        if (!priv->null_tile) {
+            cairo_t *cr;
+            priv->null_tile = cairo_image_surface_create(CAIRO_FORMAT_RGB24, TILESIZE, TILESIZE);
+            cr = cairo_create(priv->null_tile);
+            cairo_set_source_rgb(cr, 0.8, 0.8, 0.8);
+            cairo_paint(cr);
+            cairo_destroy(cr);
+        }
     }
     else if (priv->map_source >= 0) {
         /* check if the source given is valid */
@@ -1788,6 +3736,30 @@ osm_gps_map_setup(OsmGpsMap *map)
     /* parse the source uri */
     inspect_map_uri(priv);
 
+    /* the tiles being downloaded are for the source used until now. The
+     * decodes are discarded by osm_gps_map_setup_tile_store() */
+    if (priv->is_constructed) {
+        GHashTableIter iter;
+        OsmDownloadHost *host;
+        GList *l;
+
+        osm_gps_map_download_cancel_all(map);
+
+        /* let go of the old tile store now, it may have to be opened again
+         * below, and a pack can only be open once */
+        g_hash_table_iter_init (&iter, priv->download_hosts);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&host)) {
+            for (l = host->active.head; l != NULL; l = l->next) {
+                OsmTileDownload *dl = l->data;
+                g_clear_pointer (&dl->store, osm_tile_store_unref);
+            }
+        }
+    }
+
+    /* a new tag every time, so that it can't be the same as the one of the
+     * last source, as hashes of two uris could be */
+    priv->tile_source++;
+
     /* setup the tile cache */
     if ( g_strcmp0(priv->tile_dir, OSM_GPS_MAP_CACHE_DISABLED) == 0 ) {
         g_free(priv->cache_dir);
@@ -1809,13 +3781,15 @@ osm_gps_map_setup(OsmGpsMap *map)
         /* the simple case is handled in g_object_set(PROP_TILE_CACHE_DIR) */
     }
     g_debug("Cache dir: %s", priv->cache_dir);
+    osm_gps_map_setup_tile_store(map);
 
     /* check if we are being called for a second (or more) time in the lifetime
        of the object, and if so, do some extra cleanup */
     if ( priv->is_constructed ) {
         g_debug("Setup called again in map lifetime");
-        /* flush the ram cache */
-        g_hash_table_remove_all(priv->tile_cache);
+        /* flush the ram cache, and forget tiles missing from the old source */
+        osm_tile_index_remove_all(priv->tile_cache);
+        osm_tile_index_remove_all(priv->missing_tiles);
 
         /* adjust zoom if necessary */
         if(priv->map_zoom > priv->max_zoom)
@@ -1854,6 +3828,10 @@ osm_gps_map_dispose (GObject *object)
     if (priv->is_disposed)
         return;
 
+    /* jobs save their checkpoint, and need the download queues for that */
+    while (priv->download_jobs)
+        osm_gps_map_download_job_cancel (priv->download_jobs->data);
+
     priv->is_disposed = TRUE;
 
     soup_session_abort(priv->soup_session);
@@ -1861,26 +3839,57 @@ osm_gps_map_dispose (GObject *object)
 
     g_object_unref(priv->gps_track);
 
-    g_hash_table_destroy(priv->tile_queue);
-    g_hash_table_destroy(priv->missing_tiles);
-    g_hash_table_destroy(priv->tile_cache);
+    g_hash_table_destroy(priv->download_hosts);
+    osm_tile_index_free(priv->tile_queue);
+    osm_tile_index_free(priv->missing_tiles);
+    osm_tile_index_free(priv->tile_cache);
+
+    osm_gps_map_decode_cancel_all(map);
+    if (g_atomic_int_get (&priv->decode_idle_pending))
+        g_source_remove (priv->idle_decode_complete);
+    osm_tile_index_free(priv->decode_queue);
+    g_async_queue_unref(priv->decode_results);
+
+    /* don't lose tiles which were already downloaded */
+    osm_gps_map_write_flush(map, TRUE);
+
+    osm_tile_store_unref(priv->tile_store);
+    priv->tile_store = NULL;
 
     /* images and layers contain GObjects which need unreffing, so free here */
+    osm_image_index_free(priv->image_index);
+    priv->image_index = NULL;
+    g_clear_pointer (&priv->polygon_cache, g_hash_table_destroy);
+    g_clear_pointer (&priv->dirty_tiles, g_array_unref);
     gslist_of_gobjects_free(&priv->images);
     gslist_of_gobjects_free(&priv->layers);
     gslist_of_gobjects_free(&priv->tracks);
 
     if(priv->pixmap)
         cairo_surface_destroy (priv->pixmap);
+    if(priv->pixmap_spare)
+        cairo_surface_destroy (priv->pixmap_spare);
+    if(priv->overlay)
+        cairo_surface_destroy (priv->overlay);
+    if(priv->overlay_spare)
+        cairo_surface_destroy (priv->overlay_spare);
 
     if (priv->null_tile)
-        g_object_unref (priv->null_tile);
+        cairo_surface_destroy (priv->null_tile);
+
+    osm_gps_map_zoom_animation_stop (map);
+    if (priv->tick_kinetic != 0) {
+        gtk_widget_remove_tick_callback (GTK_WIDGET (object), priv->tick_kinetic);
+        priv->tick_kinetic = 0;
+    }
+    if (priv->tick_map_redraw != 0) {
+        gtk_widget_remove_tick_callback (GTK_WIDGET (object), priv->tick_map_redraw);
+        priv->tick_map_redraw = 0;
+    }
 
-    if (priv->idle_map_redraw != 0)
-        g_source_remove (priv->idle_map_redraw);
+    if (priv->idle_download_pump != 0)
+        g_source_remove (priv->idle_download_pump);
 
-    if (priv->drag_expose_source != 0)
-        g_source_remove (priv->drag_expose_source);
 
     g_free(priv->gps);
 
@@ -1983,6 +3992,8 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
                         g_free(priv->cache_dir);
                     priv->cache_dir = g_strdup(priv->tile_dir);
                     g_debug("Cache dir: %s", priv->cache_dir);
+                    if (priv->is_constructed)
+                        osm_gps_map_setup_tile_store(map);
                 }
             } else {
                 if (priv->tile_dir)
@@ -2050,6 +4061,43 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
         case PROP_SHOW_GPS_POINT:
             priv->gps_point_enabled = g_value_get_boolean (value);
             break;
+        case PROP_TILE_CACHE_PACKED:
+            priv->tile_cache_packed = g_value_get_boolean (value);
+            break;
+        case PROP_TILE_CACHE_BYTES:
+            priv->max_tile_cache_bytes = g_value_get_uint64 (value);
+            osm_gps_map_tile_cache_trim (map);
+            break;
+        case PROP_DRAG_MARGIN:
+            priv->drag_margin = g_value_get_uint (value);
+            priv->pixmap_border = priv->drag_margin * TILESIZE;
+            if (priv->pixmap) {
+                osm_gps_map_create_pixmap (map);
+                osm_gps_map_map_redraw_idle (map);
+            }
+            break;
+        case PROP_IMAGE_CLUSTERING:
+            priv->image_clustering = g_value_get_boolean (value);
+            osm_image_index_set_clustering (priv->image_index, priv->image_clustering);
+            osm_gps_map_overlay_redraw_idle (map);
+            break;
+        case PROP_ZOOM_ANIMATION_DURATION:
+            priv->zoom_animation_duration = g_value_get_uint (value);
+            if (priv->zoom_animation_duration == 0)
+                osm_gps_map_zoom_animation_stop (map);
+            break;
+        case PROP_KINETIC_SCROLLING:
+            priv->kinetic_scrolling = g_value_get_boolean (value);
+            if (!priv->kinetic_scrolling)
+                osm_gps_map_kinetic_stop (map);
+            break;
+        case PROP_TILE_CACHE_SYNC:
+            priv->tile_cache_sync = g_value_get_boolean (value);
+            if (priv->write_queue)
+                g_atomic_int_set (&priv->write_queue->sync, priv->tile_cache_sync);
+            if (priv->tile_store)
+                osm_tile_store_set_sync (priv->tile_store, priv->tile_cache_sync);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -2117,7 +4165,7 @@ osm_gps_map_get_property (GObject *object, guint prop_id, GValue *value, GParamS
             g_value_set_int(value, priv->map_y);
             break;
         case PROP_TILES_QUEUED:
-            g_value_set_int(value, g_hash_table_size(priv->tile_queue));
+            g_value_set_int(value, osm_tile_index_size(priv->tile_queue));
             break;
         case PROP_GPS_TRACK_WIDTH: {
             gfloat f;
@@ -2145,6 +4193,27 @@ osm_gps_map_get_property (GObject *object, guint prop_id, GValue *value, GParamS
         case PROP_SHOW_GPS_POINT:
             g_value_set_boolean(value, priv->gps_point_enabled);
             break;
+        case PROP_TILE_CACHE_PACKED:
+            g_value_set_boolean(value, priv->tile_cache_packed);
+            break;
+        case PROP_TILE_CACHE_BYTES:
+            g_value_set_uint64(value, priv->max_tile_cache_bytes);
+            break;
+        case PROP_TILE_CACHE_SYNC:
+            g_value_set_boolean(value, priv->tile_cache_sync);
+            break;
+        case PROP_DRAG_MARGIN:
+            g_value_set_uint(value, priv->drag_margin);
+            break;
+        case PROP_IMAGE_CLUSTERING:
+            g_value_set_boolean(value, priv->image_clustering);
+            break;
+        case PROP_ZOOM_ANIMATION_DURATION:
+            g_value_set_uint(value, priv->zoom_animation_duration);
+            break;
+        case PROP_KINETIC_SCROLLING:
+            g_value_set_boolean(value, priv->kinetic_scrolling);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -2154,33 +4223,32 @@ osm_gps_map_get_property (GObject *object, guint prop_id, GValue *value, GParamS
 static gboolean
 osm_gps_map_scroll_event (GtkWidget *widget, GdkEventScroll  *event)
 {
-    OsmGpsMap *map;
-    OsmGpsMapPoint *pt;
-    float lat, lon, c_lat, c_lon;
-
-    map = OSM_GPS_MAP(widget);
-    pt = osm_gps_map_point_new_degrees(0.0,0.0);
-    /* arguably we could use get_event_location here, but I'm not convinced it
-    is forward compatible to cast between GdkEventScroll and GtkEventButton */
-    osm_gps_map_convert_screen_to_geographic(map, event->x, event->y, pt);
-    osm_gps_map_point_get_degrees (pt, &lat, &lon);
-
-    c_lat = rad2deg(map->priv->center_rlat);
-    c_lon = rad2deg(map->priv->center_rlon);
+    OsmGpsMap *map = OSM_GPS_MAP(widget);
+    OsmGpsMapPrivate *priv = map->priv;
+    double view[3], x, y, scale;
+    int zoom;
 
+    if ((event->direction == GDK_SCROLL_UP) && (priv->map_zoom < priv->max_zoom))
+        zoom = priv->map_zoom + 1;
+    else if ((event->direction == GDK_SCROLL_DOWN) && (priv->map_zoom > priv->min_zoom))
+        zoom = priv->map_zoom - 1;
+    else
+        return FALSE;
 
+    /* keep the position under the pointer, as it is shown now, which while
+     * the zoom is animated is not yet at map_x,y */
+    osm_gps_map_get_view (map, view);
+    x = view[0] + (event->x - gtk_widget_get_allocated_width (widget) / 2) / view[2];
+    y = view[1] + (event->y - gtk_widget_get_allocated_height (widget) / 2) / view[2];
 
-    if ((event->direction == GDK_SCROLL_UP) && (map->priv->map_zoom < map->priv->max_zoom)) {
-        lat = c_lat + ((lat - c_lat)/2.0);
-        lon = c_lon + ((lon - c_lon)/2.0);
-        osm_gps_map_set_center_and_zoom(map, lat, lon, map->priv->map_zoom+1);
-    } else if ((event->direction == GDK_SCROLL_DOWN) && (map->priv->map_zoom > map->priv->min_zoom)) {
-        lat = c_lat + ((c_lat - lat)*1.0);
-        lon = c_lon + ((c_lon - lon)*1.0);
-        osm_gps_map_set_center_and_zoom(map, lat, lon, map->priv->map_zoom-1);
-    }
+    scale = (double)TILESIZE * (1 << zoom);
+    x -= (event->x - gtk_widget_get_allocated_width (widget) / 2) / scale;
+    y -= (event->y - gtk_widget_get_allocated_height (widget) / 2) / scale;
 
-    osm_gps_map_point_free (pt);
+    osm_gps_map_set_center_and_zoom (map,
+                                     rad2deg (pixel2lat (zoom, y * scale)),
+                                     rad2deg (pixel2lon (zoom, x * scale)),
+                                     zoom);
 
     return FALSE;
 }
@@ -2191,6 +4259,10 @@ osm_gps_map_button_press (GtkWidget *widget, GdkEventButton *event)
     OsmGpsMap *map = OSM_GPS_MAP(widget);
     OsmGpsMapPrivate *priv = map->priv;
 
+    /* whatever is pressed is where it will be once zoomed, or stopped */
+    osm_gps_map_zoom_animation_stop (map);
+    osm_gps_map_kinetic_stop (map);
+
     if (priv->layers)
     {
         GSList *list;
@@ -2204,134 +4276,35 @@ osm_gps_map_button_press (GtkWidget *widget, GdkEventButton *event)
 
     if(event->button == 1)
     {
-        GSList* tracks = priv->tracks;
-        while(tracks)
-        {
-            OsmGpsMapTrack* track = tracks->data;
-            gboolean path_editable = FALSE;
-            g_object_get(track, "editable", &path_editable, NULL);
-            if(path_editable)
-            {
-                GSList* points = osm_gps_map_track_get_points(track);
-                int ctr = 0;
-                int last_x = 0;
-                int last_y = 0;
-                while(points)
-                {
-                    //if the mouse has gone down on a point, start dragging it
-                    int cx, cy;
-                    OsmGpsMapPoint* point = (OsmGpsMapPoint*)points->data;
-                    osm_gps_map_convert_geographic_to_screen(map, point, &cx, &cy);
-
-                    float dist_sqrd = (event->x - cx) * (event->x-cx) + (event->y-cy) * (event->y-cy);
-                    if(dist_sqrd <= ((DOT_RADIUS + 1) * (DOT_RADIUS + 1)))
-                    {
-                        priv->is_button_down = TRUE;
-                        priv->drag_point = point;
-                        priv->drag_track = track;
-                        priv->is_dragging_point = TRUE;
-                        osm_gps_map_map_redraw(map);
-                        return FALSE;
-                    }
-
-                    //add a new point if a 'breaker' has been clicked
-                    if(ctr != 0)
-                    {
-                        int ptx = (last_x+cx)/2.0;
-                        int pty = (last_y+cy)/2.0;
-                        dist_sqrd = (event->x - ptx) * (event->x-ptx) + (event->y-pty) * (event->y-pty);
-                        if(dist_sqrd <= ((DOT_RADIUS + 1) * (DOT_RADIUS + 1)))
-                        {
-                            OsmGpsMapPoint newpoint;
-                            osm_gps_map_convert_screen_to_geographic(map, ptx, pty, &newpoint);
-                            osm_gps_map_track_insert_point(track, &newpoint, ctr);
-                            osm_gps_map_map_redraw(map);
-                            return FALSE;
-                        }
-                    }
-
-                    last_x = cx;
-                    last_y = cy;
-                    points = points->next;
-                    ctr++;
-                }
-            }
-            tracks = tracks->next;
-        }
+        OsmGpsMapTrack *track;
+        gint index;
 
-        GSList* polys = priv->polygons;
-        while(polys)
+        switch (osm_gps_map_hit_test(map, event->x, event->y, &track, &index))
         {
-            OsmGpsMapPolygon* poly = polys->data;
-            gboolean path_editable = FALSE;
-            gboolean breakable = TRUE;
-            OsmGpsMapTrack* track = osm_gps_map_polygon_get_track(poly);
-            g_object_get(poly, "editable", &path_editable, NULL);
-            g_object_get(poly, "breakable", &breakable, NULL);
-            if(path_editable)
-            {
-                GSList* points = osm_gps_map_track_get_points(track);
-                int ctr = 0;
-                int last_x = 0;
-                int last_y = 0;
-                int first_x = 0; int first_y = 0;
-                while(points)
-                {
-                    //if the mouse has gone down on a point, start dragging it
-                    int cx, cy;
-                    OsmGpsMapPoint* point = (OsmGpsMapPoint*)points->data;
-                    osm_gps_map_convert_geographic_to_screen(map, point, &cx, &cy);
-
-                    float dist_sqrd = (event->x - cx) * (event->x-cx) + (event->y-cy) * (event->y-cy);
-                    if(dist_sqrd <= ((DOT_RADIUS + 1) * (DOT_RADIUS + 1)))
-                    {
-                        priv->is_button_down = TRUE;
-                        priv->drag_point = point;
-                        priv->drag_track = track;
-                        priv->is_dragging_point = TRUE;
-                        osm_gps_map_map_redraw(map);
-                        return FALSE;
-                    }
-
-                    //add a new point if a 'breaker' has been clicked
-                    if((ctr != 0) && (breakable))
-                    {
-                        int ptx = (last_x+cx)/2.0;
-                        int pty = (last_y+cy)/2.0;
-                        dist_sqrd = (event->x - ptx) * (event->x-ptx) + (event->y-pty) * (event->y-pty);
-                        if(dist_sqrd <= ((DOT_RADIUS + 1) * (DOT_RADIUS + 1)))
-                        {
-                            OsmGpsMapPoint newpoint;
-                            osm_gps_map_convert_screen_to_geographic(map, ptx, pty, &newpoint);
-                            osm_gps_map_track_insert_point(track, &newpoint, ctr);
-                            osm_gps_map_map_redraw(map);
-                            return FALSE;
-                        }
-                    }
-                    else
-                    {
-                        first_x = cx; first_y = cy;
-                    }
-
-                    last_x = cx;
-                    last_y = cy;
-                    points = points->next;
-                    ctr++;
-                }
-
-                int ptx = (last_x+first_x)/2.0;
-                int pty = (last_y+first_y)/2.0;
-                float dist_sqrd = (event->x - ptx) * (event->x-ptx) + (event->y-pty) * (event->y-pty);
-                if(dist_sqrd <= ((DOT_RADIUS + 1) * (DOT_RADIUS + 1)))
-                {
-                    OsmGpsMapPoint newpoint;
-                    osm_gps_map_convert_screen_to_geographic(map, ptx, pty, &newpoint);
-                    osm_gps_map_track_insert_point(track, &newpoint, ctr);
-                    osm_gps_map_map_redraw(map);
-                    return FALSE;
-                }
+            case OSM_GPS_MAP_HIT_POINT:
+                //if the mouse has gone down on a point, start dragging it
+                priv->is_button_down = TRUE;
+                priv->drag_point = index;
+                priv->drag_track = track;
+                priv->is_dragging_point = TRUE;
+                osm_gps_map_map_redraw(map);
+                return FALSE;
+            case OSM_GPS_MAP_HIT_BREAKER: {
+                //add a new point if a 'breaker' has been clicked
+                int n = osm_gps_map_track_n_points(track);
+                int ax, ay, bx, by;
+                OsmGpsMapPoint newpoint;
+
+                /* index is n for the one closing a polygon */
+                osm_gps_map_convert_geographic_to_screen(map, osm_gps_map_track_get_point(track, index - 1), &ax, &ay);
+                osm_gps_map_convert_geographic_to_screen(map, osm_gps_map_track_get_point(track, index % n), &bx, &by);
+                osm_gps_map_convert_screen_to_geographic(map, (ax+bx)/2.0, (ay+by)/2.0, &newpoint);
+                osm_gps_map_track_insert_point(track, &newpoint, index);
+                osm_gps_map_map_redraw(map);
+                return FALSE;
             }
-            polys = polys->next;
+            default:
+                break;
         }
     }
 
@@ -2341,6 +4314,10 @@ osm_gps_map_button_press (GtkWidget *widget, GdkEventButton *event)
     priv->drag_start_mouse_y = (int) event->y;
     priv->drag_start_map_x = priv->map_x;
     priv->drag_start_map_y = priv->map_y;
+    priv->drag_last_mouse_x = priv->drag_start_mouse_x;
+    priv->drag_last_mouse_y = priv->drag_start_mouse_y;
+    priv->drag_last_time = g_get_monotonic_time ();
+    priv->drag_velocity[0] = priv->drag_velocity[1] = 0.0;
 
     return FALSE;
 }
@@ -2366,14 +4343,19 @@ osm_gps_map_button_release (GtkWidget *widget, GdkEventButton *event)
 
         center_coord_update(map);
 
-        osm_gps_map_map_redraw_idle(map);
+        osm_gps_map_map_update_idle(map);
+        osm_gps_map_kinetic_start(map);
     }
 
     if( priv->is_dragging_point)
     {
         priv->is_dragging_point = FALSE;
-        osm_gps_map_convert_screen_to_geographic(map, event->x, event->y, priv->drag_point);
-        g_signal_emit_by_name(priv->drag_track, "point-changed");
+        OsmGpsMapPoint *point = osm_gps_map_track_get_point(priv->drag_track, priv->drag_point);
+        if (point)
+        {
+            osm_gps_map_convert_screen_to_geographic(map, event->x, event->y, point);
+            g_signal_emit_by_name(priv->drag_track, "point-changed", priv->drag_point);
+        }
     }
 
     priv->drag_counter = -1;
@@ -2382,15 +4364,6 @@ osm_gps_map_button_release (GtkWidget *widget, GdkEventButton *event)
     return FALSE;
 }
 
-static gboolean
-osm_gps_map_idle_expose (GtkWidget *widget)
-{
-    OsmGpsMapPrivate *priv = OSM_GPS_MAP(widget)->priv;
-    priv->drag_expose_source = 0;
-    gtk_widget_queue_draw (widget);
-    return FALSE;
-}
-
 static gboolean
 osm_gps_map_motion_notify (GtkWidget *widget, GdkEventMotion  *event)
 {
@@ -2398,14 +4371,20 @@ osm_gps_map_motion_notify (GtkWidget *widget, GdkEventMotion  *event)
     OsmGpsMap *map = OSM_GPS_MAP(widget);
     OsmGpsMapPrivate *priv = map->priv;
     gint x, y;
+    gint64 now;
 
     if(!priv->is_button_down)
         return FALSE;
 
     if(priv->is_dragging_point)
     {
-        osm_gps_map_convert_screen_to_geographic(map, event->x, event->y, priv->drag_point);
-        osm_gps_map_map_redraw_idle(map);
+        OsmGpsMapPoint *point = osm_gps_map_track_get_point(priv->drag_track, priv->drag_point);
+        if (point)
+        {
+            osm_gps_map_convert_screen_to_geographic(map, event->x, event->y, point);
+            osm_gps_map_track_point_moved(priv->drag_track, priv->drag_point);
+        }
+        osm_gps_map_overlay_redraw_idle(map);
         return FALSE;
     }
 
@@ -2450,13 +4429,24 @@ osm_gps_map_motion_notify (GtkWidget *widget, GdkEventMotion  *event)
     if (priv->map_auto_center_enabled)
         g_object_set(G_OBJECT(widget), "auto-center", FALSE, NULL);
 
-    priv->drag_mouse_dx = x - priv->drag_start_mouse_x;
-    priv->drag_mouse_dy = y - priv->drag_start_mouse_y;
+    priv->map_x = priv->drag_start_map_x + (priv->drag_start_mouse_x - x);
+    priv->map_y = priv->drag_start_map_y + (priv->drag_start_mouse_y - y);
+
+    /* smoothed, the map moves the opposite way to the pointer */
+    now = g_get_monotonic_time ();
+    if (now > priv->drag_last_time) {
+        double dt = (now - priv->drag_last_time) / 1000000.0;
+        priv->drag_velocity[0] = 0.8 * (priv->drag_last_mouse_x - x) / dt + 0.2 * priv->drag_velocity[0];
+        priv->drag_velocity[1] = 0.8 * (priv->drag_last_mouse_y - y) / dt + 0.2 * priv->drag_velocity[1];
+    }
+    priv->drag_last_mouse_x = x;
+    priv->drag_last_mouse_y = y;
+    priv->drag_last_time = now;
 
-    /* instead of redrawing directly just add an idle function */
-    if (!priv->drag_expose_source)
-        priv->drag_expose_source =
-            g_idle_add ((GSourceFunc)osm_gps_map_idle_expose, widget);
+    /* show the pixmap moved right away, the newly exposed tiles are drawn
+     * in an idle, and shown at the next frame */
+    gtk_widget_queue_draw (widget);
+    osm_gps_map_map_update_idle (map);
 
     return FALSE;
 }
@@ -2465,22 +4455,15 @@ static gboolean
 osm_gps_map_configure (GtkWidget *widget, GdkEventConfigure *event)
 {
     int w,h;
-    GdkWindow *window;
     OsmGpsMap *map = OSM_GPS_MAP(widget);
     OsmGpsMapPrivate *priv = map->priv;
 
-    if (priv->pixmap)
-        cairo_surface_destroy (priv->pixmap);
+    osm_gps_map_zoom_animation_stop (map);
+    osm_gps_map_kinetic_stop (map);
+    osm_gps_map_create_pixmap (map);
 
     w = gtk_widget_get_allocated_width (widget);
     h = gtk_widget_get_allocated_height (widget);
-    window = gtk_widget_get_window(widget);
-
-    priv->pixmap = gdk_window_create_similar_surface (
-                        window,
-                        CAIRO_CONTENT_COLOR,
-                        w + EXTRA_BORDER * 2,
-                        h + EXTRA_BORDER * 2);
 
     // pixel_x,y, offsets
     gint pixel_x = lon2pixel(priv->map_zoom, priv->center_rlon);
@@ -2502,15 +4485,60 @@ osm_gps_map_draw (GtkWidget *widget, cairo_t *cr)
     OsmGpsMap *map = OSM_GPS_MAP(widget);
     OsmGpsMapPrivate *priv = map->priv;
 
-    if (!priv->drag_mouse_dx && !priv->drag_mouse_dy) {
-        cairo_set_source_surface (cr, priv->pixmap, 0, 0);
-    } else {
-        cairo_set_source_surface (cr, priv->pixmap,
-            priv->drag_mouse_dx - EXTRA_BORDER,
-            priv->drag_mouse_dy - EXTRA_BORDER);
+    int dx = 0, dy = 0;
+
+    if (priv->zoom_snapshot) {
+        osm_gps_map_draw_zoom_animation (map, cr);
+
+        /* the gps point where the view shown has it, at its usual size */
+        if (priv->gps_track_used && priv->gps_point_enabled) {
+            double *view = priv->zoom_view;
+            double scale = (double)TILESIZE * (1 << priv->map_zoom);
+            int x = lon2pixel(priv->map_zoom, priv->gps->rlon);
+            int y = lat2pixel(priv->map_zoom, priv->gps->rlat);
+
+            dx = (x / scale - view[0]) * view[2] + gtk_widget_get_allocated_width (widget) / 2 -
+                 (x - priv->map_x);
+            dy = (y / scale - view[1]) * view[2] + gtk_widget_get_allocated_height (widget) / 2 -
+                 (y - priv->map_y);
+        }
+        goto gps_point;
+    }
+
+    /* while dragging, the map may have moved since the pixmap was drawn */
+    if (priv->pixmap_zoom == priv->map_zoom) {
+        dx = priv->pixmap_map_x - priv->map_x;
+        dy = priv->pixmap_map_y - priv->map_y;
     }
 
+    /* dragged further than the margin */
+    if (ABS(dx) > priv->pixmap_border || ABS(dy) > priv->pixmap_border)
+        draw_white_rectangle (cr, 0, 0,
+                              gtk_widget_get_allocated_width (widget),
+                              gtk_widget_get_allocated_height (widget));
+
+    cairo_set_source_surface (cr, priv->pixmap,
+                              dx - priv->pixmap_border,
+                              dy - priv->pixmap_border);
     cairo_paint (cr);
+    cairo_set_source_surface (cr, priv->overlay,
+                              dx - priv->pixmap_border,
+                              dy - priv->pixmap_border);
+    cairo_paint (cr);
+    dx = dy = 0;
+
+gps_point:
+    /* draw the gps point using the appropriate virtual private method. It
+     * draws in pixmap coordinates for the current map_x,y */
+    if (priv->gps_track_used && priv->gps_point_enabled) {
+        OsmGpsMapClass *klass = OSM_GPS_MAP_GET_CLASS(map);
+        if (klass->draw_gps_point) {
+            cairo_save (cr);
+            cairo_translate (cr, dx - priv->pixmap_border, dy - priv->pixmap_border);
+            klass->draw_gps_point (map, cr);
+            cairo_restore (cr);
+        }
+    }
 
     if (priv->layers) {
         GSList *list;
@@ -2750,6 +4778,71 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
                                                           NULL,
                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 
+    /**
+     * OsmGpsMap:tile-cache-packed:
+     *
+     * Store the on disk tile cache in a few large pack files plus a memory
+     * mapped index, instead of one file per tile. This is much kinder to the
+     * filesystem when caching hundreds of thousands of tiles, and makes
+     * checking whether a tile is cached free of syscalls.
+     *
+     * The pack is created in the directory given by #OsmGpsMap:tile-cache.
+     * Existing one file per tile caches are not imported. On platforms
+     * without mmap support, or while another map or process is using the
+     * same pack, the map falls back to one file per tile, and the property
+     * reads back %FALSE.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_TILE_CACHE_PACKED,
+                                     g_param_spec_boolean ("tile-cache-packed",
+                                                           "tile cache packed",
+                                                           "Store cached tiles in pack files",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
+
+    /**
+     * OsmGpsMap:tile-cache-bytes:
+     *
+     * The amount of memory, in bytes, used to keep decoded tiles in memory.
+     * When it is exceeded the least recently drawn tiles are dropped. This
+     * should be large enough to hold all the tiles visible at once, plus
+     * some of the surrounding ones, a 256x256 tile uses 256KiB.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_TILE_CACHE_BYTES,
+                                     g_param_spec_uint64 ("tile-cache-bytes",
+                                                          "tile cache bytes",
+                                                          "Memory used for decoded tiles",
+                                                          0,           /* minimum property value */
+                                                          G_MAXUINT64, /* maximum property value */
+                                                          TILE_CACHE_BYTES,
+                                                          G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
+    /**
+     * OsmGpsMap:tile-cache-sync:
+     *
+     * Make sure downloaded tiles are on disk before they are counted as
+     * done by an #OsmGpsMapDownloadJob, so that none are lost on a power
+     * failure. Tiles are flushed in batches, which costs much less than
+     * flushing every tile, but still slows down large downloads.
+     *
+     * Tiles are always written in the background, to a temporary file
+     * which replaces the tile when complete.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_TILE_CACHE_SYNC,
+                                     g_param_spec_boolean ("tile-cache-sync",
+                                                           "tile cache sync",
+                                                           "Flush cached tiles to disk",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE));
+
     /**
      * OsmGpsMap:zoom:
      *
@@ -2923,6 +5016,82 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
                                                        10,
                                                        G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 
+    /**
+     * OsmGpsMap:drag-margin:
+     *
+     * The number of tiles drawn beyond each edge of the map. They are
+     * loaded before they are dragged into view, so that dragging shows
+     * them right away. Each tile of margin costs memory for a row and a
+     * column of tiles on every side.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_DRAG_MARGIN,
+                                     g_param_spec_uint ("drag-margin",
+                                                        "drag margin",
+                                                        "The number of tiles drawn beyond the visible map",
+                                                        0,
+                                                        8,
+                                                        1,
+                                                        G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
+    /**
+     * OsmGpsMap:image-clustering:
+     *
+     * When images are close enough to overlap, draw one numbered circle
+     * in their place. They are drawn separately again when zoomed in far
+     * enough to be apart. Drawing then costs the same however many images
+     * there are.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_IMAGE_CLUSTERING,
+                                     g_param_spec_boolean ("image-clustering",
+                                                           "image clustering",
+                                                           "Draw images close together as one numbered circle",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
+    /**
+     * OsmGpsMap:zoom-animation-duration:
+     *
+     * How long, in milliseconds, the map takes to scale smoothly from one
+     * zoom to the next. Meanwhile the map already drawn is shown scaled,
+     * and the tiles of the zoom it ends at are loaded. Downloads for a
+     * zoom scrolled past are dropped. 0, the default, changes the zoom
+     * at once.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_ZOOM_ANIMATION_DURATION,
+                                     g_param_spec_uint ("zoom-animation-duration",
+                                                        "zoom animation duration",
+                                                        "Milliseconds taken to change the zoom",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        0,
+                                                        G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
+    /**
+     * OsmGpsMap:kinetic-scrolling:
+     *
+     * Keep the map moving when it is released while being dragged, slowing
+     * down until it stops. The tiles where it will stop are loaded as soon
+     * as it is released. Off by default.
+     *
+     * Since: 1.3.0
+     **/
+    g_object_class_install_property (object_class,
+                                     PROP_KINETIC_SCROLLING,
+                                     g_param_spec_boolean ("kinetic-scrolling",
+                                                           "kinetic scrolling",
+                                                           "Keep the map moving after it is dragged",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
     /**
      * OsmGpsMap::changed:
      *
@@ -2939,6 +5108,23 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
     g_signal_new ("changed", OSM_TYPE_GPS_MAP,
                   G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
                   g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
+    /**
+     * OsmGpsMap::frame-rendered:
+     * @map: the map
+     * @milliseconds: the time spent drawing
+     *
+     * The #OsmGpsMap::frame-rendered signal is emitted after the map was
+     * drawn, because tiles arrived, or the map moved, or its tracks, images
+     * or layers changed. However often that happens, the map is drawn at
+     * most once per frame, and not at all if nothing changed or it can not
+     * be drawn yet, as while the zoom is animated.
+     *
+     * Since: 1.3.0
+     **/
+    g_signal_new ("frame-rendered", OSM_TYPE_GPS_MAP,
+                  G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
+                  g_cclosure_marshal_VOID__DOUBLE, G_TYPE_NONE, 1, G_TYPE_DOUBLE);
 }
 
 /**
@@ -2950,62 +5136,153 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
  * @zoom_end: (in): end of zoom range
  *
  * Downloads all tiles over the supplied zoom range in the rectangular
- * region specified by pt1 (north west corner) to pt2 (south east corner)
+ * region specified by pt1 (north west corner) to pt2 (south east corner).
+ * To follow the progress, or pause the download, use an
+ * #OsmGpsMapDownloadJob instead
  *
  **/
 void
 osm_gps_map_download_maps (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end)
 {
-    OsmGpsMapPrivate *priv = map->priv;
-
     if (pt1 && pt2) {
-        gchar *filename;
-        int i,j,zoom;
-        int num_tiles = 0;
-        zoom_end = CLAMP(zoom_end, priv->min_zoom, priv->max_zoom);
-        zoom_start = CLAMP(zoom_start, priv->min_zoom, priv->max_zoom);
+        OsmGpsMapDownloadJob *job = osm_gps_map_download_job_new(pt1, pt2, zoom_start, zoom_end);
+        osm_gps_map_download_job_add(map, job);
+        g_object_unref(job);
+    }
+}
+
+/**
+ * osm_gps_map_download_job_add:
+ * @map: a #OsmGpsMap widget
+ * @job: a #OsmGpsMapDownloadJob
+ *
+ * Start downloading the tiles of @job into the tile cache of @map. The map
+ * keeps a reference to the job until it is finished.
+ *
+ * Since: 1.3.0
+ **/
+void
+osm_gps_map_download_job_add (OsmGpsMap *map, OsmGpsMapDownloadJob *job)
+{
+    OsmGpsMapPrivate *priv;
 
-        for(zoom=zoom_start; zoom<=zoom_end; zoom++) {
-            int x1,y1,x2,y2;
+    g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
+    g_return_if_fail (OSM_GPS_MAP_IS_DOWNLOAD_JOB (job));
+    g_return_if_fail (!osm_gps_map_download_job_is_finished (job));
+    priv = map->priv;
 
-            x1 = (int)floorf((float)lon2pixel(zoom, pt1->rlon) / (float)TILESIZE);
-            y1 = (int)floorf((float)lat2pixel(zoom, pt1->rlat) / (float)TILESIZE);
+    if (g_slist_find (priv->download_jobs, job))
+        return;
 
-            x2 = (int)floorf((float)lon2pixel(zoom, pt2->rlon) / (float)TILESIZE);
-            y2 = (int)floorf((float)lat2pixel(zoom, pt2->rlat) / (float)TILESIZE);
+    priv->download_jobs = g_slist_prepend (priv->download_jobs, g_object_ref (job));
+    if (!osm_gps_map_download_job_start (job, map, priv->min_zoom, priv->max_zoom))
+        osm_gps_map_remove_job (map, job);
+}
 
-            /* check for insane ranges */
-            if ( (x2-x1) * (y2-y1) > MAX_DOWNLOAD_TILES ) {
-                g_warning("Aborting download of zoom level %d and up, because "
-                          "number of tiles would exceed %d", zoom, MAX_DOWNLOAD_TILES);
-                break;
+OsmTileStore *
+osm_gps_map_get_tile_store (OsmGpsMap *map)
+{
+    return map->priv->tile_store;
+}
+
+/* the queued or running download of the tile with key */
+static OsmTileDownload *
+osm_gps_map_find_download (OsmGpsMap *map, guint64 key)
+{
+    GHashTableIter iter;
+    OsmDownloadHost *host;
+    GList *l;
+
+    g_hash_table_iter_init (&iter, map->priv->download_hosts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&host)) {
+        for (l = host->pending.head; l != NULL; l = l->next)
+            if (((OsmTileDownload *)l->data)->key == key)
+                return l->data;
+        for (l = host->active.head; l != NULL; l = l->next)
+            if (((OsmTileDownload *)l->data)->key == key)
+                return l->data;
+    }
+    return NULL;
+}
+
+gboolean
+osm_gps_map_queue_job_tile (OsmGpsMap *map, OsmGpsMapDownloadJob *job,
+                            int zoom, int x, int y, gboolean *missing)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    guint64 key = OSM_TILE_KEY(priv->tile_source, zoom, x, y);
+
+    if (osm_tile_index_contains (priv->tile_queue, key)) {
+        OsmTileDownload *dl = osm_gps_map_find_download (map, key);
+
+        /* already being downloaded, for the screen or another job. The
+         * job waits for it too, rather than counting it before it is in */
+        *missing = FALSE;
+        if (!dl)
+            return FALSE;
+        if (!g_slist_find (dl->jobs, job))
+            dl->jobs = g_slist_prepend (dl->jobs, g_object_ref (job));
+        return TRUE;
+    }
+
+    /* if not queued, the tile is known to be missing or has no valid uri */
+    *missing = TRUE;
+    return osm_gps_map_download_tile_full (map, zoom, x, y, FALSE, job);
+}
+
+/* forget the job in the downloads it waits for. Those which are not for
+ * the screen or another job are dropped if not started, aborted if they are */
+void
+osm_gps_map_cancel_job_tiles (OsmGpsMap *map, OsmGpsMapDownloadJob *job)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GHashTableIter iter;
+    OsmDownloadHost *host;
+    GList *l, *next;
+
+    g_hash_table_iter_init (&iter, priv->download_hosts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&host)) {
+        for (l = host->pending.head; l != NULL; l = next) {
+            OsmTileDownload *dl = l->data;
+            next = l->next;
+            if (g_slist_find (dl->jobs, job)) {
+                dl->jobs = g_slist_remove (dl->jobs, job);
+                g_object_unref (job);
+                if (dl->jobs || dl->redraw)
+                    continue;
+                g_queue_delete_link (&host->pending, l);
+                osm_tile_index_remove (priv->tile_queue, dl->key);
+                osm_tile_download_free (dl);
             }
+        }
 
-            /* loop x1-x2 */
-            for(i=x1; i<=x2; i++) {
-                /* loop y1 - y2 */
-                for(j=y1; j<=y2; j++) {
-                    /* x = i, y = j */
-                    filename = g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                                    priv->cache_dir, G_DIR_SEPARATOR,
-                                    zoom, G_DIR_SEPARATOR,
-                                    i, G_DIR_SEPARATOR,
-                                    j,
-                                    priv->image_format);
-                    if (!g_file_test(filename, G_FILE_TEST_EXISTS)) {
-                        osm_gps_map_download_tile(map, zoom, i, j, FALSE);
-                        num_tiles++;
-                    }
-                    g_free(filename);
-                }
+        for (l = host->active.head; l != NULL; l = l->next) {
+            OsmTileDownload *dl = l->data;
+            if (g_slist_find (dl->jobs, job)) {
+                dl->jobs = g_slist_remove (dl->jobs, job);
+                g_object_unref (job);
+                if (!dl->jobs && !dl->redraw)
+                    g_cancellable_cancel (dl->cancellable);
             }
-            g_debug("DL @Z:%d = %d tiles", zoom, num_tiles);
         }
     }
+    g_object_notify (G_OBJECT (map), "tiles-queued");
+}
+
+void
+osm_gps_map_remove_job (OsmGpsMap *map, OsmGpsMapDownloadJob *job)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    GSList *link = g_slist_find (priv->download_jobs, job);
+
+    if (link) {
+        priv->download_jobs = g_slist_delete_link (priv->download_jobs, link);
+        g_object_unref (job);
+    }
 }
 
 static void
-cancel_message (char *key, GCancellable *cancellable, void *userdata)
+cancel_message (guint64 key, GCancellable *cancellable, void *userdata)
 {
     g_cancellable_cancel(cancellable);
 }
@@ -3023,7 +5300,26 @@ void
 osm_gps_map_download_cancel_all (OsmGpsMap *map)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    g_hash_table_foreach (priv->tile_queue, (GHFunc)cancel_message, NULL);
+    GHashTableIter iter;
+    OsmDownloadHost *host;
+
+    /* each job removes itself from the list */
+    while (priv->download_jobs)
+        osm_gps_map_download_job_cancel (priv->download_jobs->data);
+
+    /* forget the downloads which have not started yet */
+    g_hash_table_iter_init (&iter, priv->download_hosts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&host)) {
+        OsmTileDownload *dl;
+        while ((dl = g_queue_pop_head (&host->pending)) != NULL) {
+            osm_tile_index_remove (priv->tile_queue, dl->key);
+            osm_tile_download_free (dl);
+        }
+    }
+    g_object_notify (G_OBJECT (map), "tiles-queued");
+
+    /* and cancel the rest */
+    osm_tile_index_foreach (priv->tile_queue, (OsmTileIndexFunc)cancel_message, NULL);
 }
 
 /**
@@ -3108,6 +5404,7 @@ osm_gps_map_set_center (OsmGpsMap *map, float latitude, float longitude)
     g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
 
     priv = map->priv;
+    osm_gps_map_kinetic_stop(map);
     gtk_widget_get_allocation(GTK_WIDGET(map), &allocation);
     g_object_set(G_OBJECT(map), "auto-center", FALSE, NULL);
 
@@ -3120,7 +5417,7 @@ osm_gps_map_set_center (OsmGpsMap *map, float latitude, float longitude)
     priv->map_x = pixel_x - allocation.width/2;
     priv->map_y = pixel_y - allocation.height/2;
 
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_map_update_idle(map);
 
     g_signal_emit_by_name(map, "changed");
 }
@@ -3170,6 +5467,9 @@ osm_gps_map_set_zoom (OsmGpsMap *map, int zoom)
 
     if (zoom != priv->map_zoom)
     {
+        /* zoom about where the map is now */
+        osm_gps_map_kinetic_stop(map);
+
         gtk_widget_get_allocation(GTK_WIDGET(map), &allocation);
         width_center  = allocation.width / 2;
         height_center = allocation.height / 2;
@@ -3179,6 +5479,7 @@ osm_gps_map_set_zoom (OsmGpsMap *map, int zoom)
         priv->map_x = lon2pixel(priv->map_zoom, priv->center_rlon) - width_center;
         priv->map_y = lat2pixel(priv->map_zoom, priv->center_rlat) - height_center;
 
+        osm_gps_map_zoom_animation_start(map);
         osm_gps_map_map_redraw_idle(map);
 
         g_signal_emit_by_name(map, "changed");
@@ -3257,7 +5558,7 @@ osm_gps_map_scroll (OsmGpsMap *map, gint dx, gint dy)
     priv->map_y += dy;
     center_coord_update(map);
 
-    osm_gps_map_map_redraw_idle (map);
+    osm_gps_map_map_update_idle (map);
 }
 
 /**
@@ -3338,13 +5639,10 @@ osm_gps_map_track_add (OsmGpsMap *map, OsmGpsMapTrack *track)
     priv = map->priv;
 
     g_object_ref(track);
-    g_signal_connect(track, "point-added",
-                    G_CALLBACK(on_gps_point_added), map);
-    g_signal_connect(track, "notify",
-                    G_CALLBACK(on_track_changed), map);
+    osm_gps_map_connect_track(map, track);
 
     priv->tracks = g_slist_append(priv->tracks, track);
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
 }
 
 /**
@@ -3361,7 +5659,7 @@ osm_gps_map_track_remove_all (OsmGpsMap *map)
     g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
 
     gslist_of_gobjects_free(&map->priv->tracks);
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
 }
 
 /**
@@ -3382,7 +5680,7 @@ osm_gps_map_track_remove (OsmGpsMap *map, OsmGpsMapTrack *track)
     g_return_val_if_fail (track != NULL, FALSE);
 
     data = gslist_remove_one_gobject (&map->priv->tracks, G_OBJECT(track));
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
     return data != NULL;
 }
 
@@ -3397,13 +5695,10 @@ osm_gps_map_polygon_add (OsmGpsMap *map, OsmGpsMapPolygon *poly)
     g_object_ref(poly);
 
     OsmGpsMapTrack* track = osm_gps_map_polygon_get_track(poly);
-    g_signal_connect(track, "point-added",
-                    G_CALLBACK(on_gps_point_added), map);
-    g_signal_connect(track, "notify",
-                    G_CALLBACK(on_track_changed), map);
+    osm_gps_map_connect_track(map, track);
 
     priv->polygons = g_slist_append(priv->polygons, poly);
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
 }
 
 void
@@ -3411,8 +5706,9 @@ osm_gps_map_polygon_remove_all(OsmGpsMap *map)
 {
     g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
 
+    g_hash_table_remove_all (map->priv->polygon_cache);
     gslist_of_gobjects_free(&map->priv->polygons);
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
 }
 
 gboolean
@@ -3423,8 +5719,9 @@ osm_gps_map_polygon_remove(OsmGpsMap *map, OsmGpsMapPolygon *poly)
     g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), FALSE);
     g_return_val_if_fail (poly != NULL, FALSE);
 
+    g_hash_table_remove (map->priv->polygon_cache, poly);
     data = gslist_remove_one_gobject (&map->priv->polygons, G_OBJECT(poly));
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
     return data != NULL;
 }
 
@@ -3447,11 +5744,8 @@ osm_gps_map_gps_clear (OsmGpsMap *map)
 
     g_object_unref(priv->gps_track);
     priv->gps_track = osm_gps_map_track_new();
-    g_signal_connect(priv->gps_track, "point-added",
-                    G_CALLBACK(on_gps_point_added), map);
-    g_signal_connect(priv->gps_track, "notify",
-                    G_CALLBACK(on_track_changed), map);
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_connect_track(map, priv->gps_track);
+    osm_gps_map_overlay_redraw_idle(map);
 }
 
 /**
@@ -3492,11 +5786,13 @@ osm_gps_map_gps_add (OsmGpsMap *map, float latitude, float longitude, float head
     g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
     priv = map->priv;
 
-    /* update the current point */
+    /* update the current point, only the area under it is drawn again */
+    osm_gps_map_queue_gps_point (map);
     priv->gps->rlat = deg2rad(latitude);
     priv->gps->rlon = deg2rad(longitude);
     priv->gps_track_used = TRUE;
     priv->gps_heading = deg2rad(heading);
+    osm_gps_map_queue_gps_point (map);
 
     /* If trip marker add to list of gps points */
     if (priv->trip_history_record_enabled) {
@@ -3504,9 +5800,8 @@ osm_gps_map_gps_add (OsmGpsMap *map, float latitude, float longitude, float head
         osm_gps_map_point_set_degrees (&point, latitude, longitude);
         /* this will cause a redraw to be scheduled */
         osm_gps_map_track_add_point (priv->gps_track, &point);
-    } else {
-        osm_gps_map_map_redraw_idle (map);
-        maybe_autocenter_map (map);
+    } else if (maybe_autocenter_map (map)) {
+        osm_gps_map_map_update_idle (map);
     }
 }
 
@@ -3550,7 +5845,9 @@ osm_gps_map_image_add_z (OsmGpsMap *map, float latitude, float longitude, GdkPix
 static void
 on_image_changed (OsmGpsMapImage *image, GParamSpec *pspec, OsmGpsMap *map)
 {
-    osm_gps_map_map_redraw_idle (map);
+    if (map->priv->image_index)
+        osm_image_index_update (map->priv->image_index, image);
+    osm_gps_map_overlay_redraw_idle (map);
 }
 
 /**
@@ -3613,7 +5910,8 @@ osm_gps_map_image_add_with_alignment_z (OsmGpsMap *map, float latitude, float lo
 
     map->priv->images = g_slist_insert_sorted(map->priv->images, im,
                                               (GCompareFunc) osm_gps_map_image_z_compare);
-    osm_gps_map_map_redraw_idle(map);
+    osm_image_index_add(map->priv->image_index, im);
+    osm_gps_map_overlay_redraw_idle(map);
 
     g_object_ref(im);
     return im;
@@ -3638,8 +5936,9 @@ osm_gps_map_image_remove (OsmGpsMap *map, OsmGpsMapImage *image)
     g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), FALSE);
     g_return_val_if_fail (image != NULL, FALSE);
 
+    osm_image_index_remove (map->priv->image_index, image);
     data = gslist_remove_one_gobject (&map->priv->images, G_OBJECT(image));
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
     return data != NULL;
 }
 
@@ -3656,8 +5955,9 @@ osm_gps_map_image_remove_all (OsmGpsMap *map)
 {
     g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
 
+    osm_image_index_remove_all(map->priv->image_index);
     gslist_of_gobjects_free(&map->priv->images);
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_overlay_redraw_idle(map);
 }
 
 /**
@@ -3698,7 +5998,7 @@ osm_gps_map_layer_remove (OsmGpsMap *map, OsmGpsMapLayer *layer)
     g_return_val_if_fail (layer != NULL, FALSE);
 
     data = gslist_remove_one_gobject (&map->priv->layers, G_OBJECT(layer));
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_map_update_idle(map);
     return data != NULL;
 }
 
@@ -3716,7 +6016,7 @@ osm_gps_map_layer_remove_all (OsmGpsMap *map)
     g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
 
     gslist_of_gobjects_free(&map->priv->layers);
-    osm_gps_map_map_redraw_idle(map);
+    osm_gps_map_map_update_idle(map);
 }
 
 /**
@@ -3741,11 +6041,9 @@ osm_gps_map_convert_screen_to_geographic(OsmGpsMap *map, gint pixel_x, gint pixe
     g_return_if_fail (pt);
 
     priv = map->priv;
-    map_x0 = priv->map_x - EXTRA_BORDER;
-    map_y0 = priv->map_y - EXTRA_BORDER;
 
-    pt->rlat = pixel2lat(priv->map_zoom, map_y0 + pixel_y);
-    pt->rlon = pixel2lon(priv->map_zoom, map_x0 + pixel_x);
+    pt->rlat = pixel2lat(priv->map_zoom, priv->map_y + pixel_y);
+    pt->rlon = pixel2lon(priv->map_zoom, priv->map_x + pixel_x);
 }
 
 /**
@@ -3770,13 +6068,107 @@ osm_gps_map_convert_geographic_to_screen(OsmGpsMap *map, OsmGpsMapPoint *pt, gin
     g_return_if_fail (pt);
 
     priv = map->priv;
-    map_x0 = priv->map_x - EXTRA_BORDER;
-    map_y0 = priv->map_y - EXTRA_BORDER;
 
     if (pixel_x)
-        *pixel_x = lon2pixel(priv->map_zoom, pt->rlon) - map_x0 + priv->drag_mouse_dx;
+        *pixel_x = lon2pixel(priv->map_zoom, pt->rlon) - priv->map_x;
     if (pixel_y)
-        *pixel_y = lat2pixel(priv->map_zoom, pt->rlat) - map_y0 + priv->drag_mouse_dy;
+        *pixel_y = lat2pixel(priv->map_zoom, pt->rlat) - priv->map_y;
+}
+
+/**
+ * osm_gps_map_convert_geographic_to_screen_batch: (skip)
+ * @map: a #OsmGpsMap widget
+ * @points: (array length=n_points): locations
+ * @n_points: the number of locations
+ * @pixel_xy: room for 2 * @n_points doubles, the pixel location on the
+ * map of each point, x then y
+ *
+ * Like osm_gps_map_convert_geographic_to_screen(), for many points at
+ * once, and without rounding to whole pixels. Much faster when drawing
+ * many points, such as an overlay of your own.
+ *
+ * Since: 1.3.0
+ **/
+void
+osm_gps_map_convert_geographic_to_screen_batch(OsmGpsMap *map, const OsmGpsMapPoint *points, guint n_points, gdouble *pixel_xy)
+{
+    OsmGpsMapPrivate *priv;
+    guint i;
+
+    g_return_if_fail (OSM_GPS_MAP_IS_MAP (map));
+    g_return_if_fail (points != NULL || n_points == 0);
+    g_return_if_fail (pixel_xy != NULL || n_points == 0);
+
+    priv = map->priv;
+
+    for (i = 0; i < n_points; i++)
+        latlon2world (points[i].rlat, points[i].rlon, &pixel_xy[2*i], &pixel_xy[2*i+1]);
+    world2pixel (priv->map_zoom, pixel_xy, n_points, priv->map_x, priv->map_y, pixel_xy);
+}
+
+/**
+ * osm_gps_map_hit_test:
+ * @map: a #OsmGpsMap widget
+ * @pixel_x: pixel location on map, x axis
+ * @pixel_y: pixel location on map, y axis
+ * @track: (out) (transfer none) (optional): the track hit, for a polygon
+ * the track of its points
+ * @point_index: (out) (optional): the position in @track of the point
+ * hit, or that of a point inserted at the breaker hit
+ *
+ * Finds which of the handles drawn on editable tracks and polygons is at
+ * the given pixel, as when the user clicks on the map. Those are the
+ * points themselves, and the breakers between them where new points can
+ * be inserted. Points are preferred over breakers, and tracks over
+ * polygons.
+ *
+ * Returns: what was hit, or %OSM_GPS_MAP_HIT_NONE
+ * Since: 1.3.0
+ **/
+OsmGpsMapHit_t
+osm_gps_map_hit_test (OsmGpsMap *map, gint pixel_x, gint pixel_y, OsmGpsMapTrack **track, gint *point_index)
+{
+    OsmGpsMapPrivate *priv;
+    OsmGpsMapHit_t hit = OSM_GPS_MAP_HIT_NONE;
+    OsmGpsMapTrack *hit_track = NULL;
+    GSList *list;
+    double x, y;
+    int index = -1;
+
+    g_return_val_if_fail (OSM_GPS_MAP_IS_MAP (map), OSM_GPS_MAP_HIT_NONE);
+    priv = map->priv;
+
+    x = priv->map_x + pixel_x;
+    y = priv->map_y + pixel_y;
+
+    for (list = priv->tracks; list && !hit; list = list->next) {
+        gboolean editable = FALSE;
+
+        hit_track = list->data;
+        g_object_get (hit_track, "editable", &editable, NULL);
+        if (editable)
+            hit = osm_gps_map_track_hit_test (hit_track, priv->map_zoom, x, y,
+                                              DOT_RADIUS + 1, TRUE, FALSE, &index);
+    }
+
+    for (list = priv->polygons; list && !hit; list = list->next) {
+        gboolean editable = FALSE;
+        gboolean breakable = TRUE;
+
+        g_object_get (list->data, "editable", &editable, "breakable", &breakable, NULL);
+        hit_track = osm_gps_map_polygon_get_track (list->data);
+        if (editable && hit_track)
+            hit = osm_gps_map_track_hit_test (hit_track, priv->map_zoom, x, y,
+                                              DOT_RADIUS + 1, breakable, TRUE, &index);
+    }
+
+    if (!hit)
+        hit_track = NULL;
+    if (track)
+        *track = hit_track;
+    if (point_index)
+        *point_index = index;
+    return hit;
 }
 
 /**
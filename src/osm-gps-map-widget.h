@@ -46,6 +46,7 @@ typedef struct _OsmGpsMapPrivate OsmGpsMapPrivate;
 #include "osm-gps-map-track.h"
 #include "osm-gps-map-polygon.h"
 #include "osm-gps-map-image.h"
+#include "osm-gps-map-download-job.h"
 
 struct _OsmGpsMapClass
 {
@@ -71,6 +72,14 @@ typedef enum {
     OSM_GPS_MAP_KEY_MAX
 } OsmGpsMapKey_t;
 
+typedef enum {
+    OSM_GPS_MAP_HIT_NONE,
+    /* a point of the track */
+    OSM_GPS_MAP_HIT_POINT,
+    /* the handle between two points, where a point can be inserted */
+    OSM_GPS_MAP_HIT_BREAKER
+} OsmGpsMapHit_t;
+
 #define OSM_GPS_MAP_INVALID         (0.0/0.0)
 #define OSM_GPS_MAP_CACHE_DISABLED  "none://"
 #define OSM_GPS_MAP_CACHE_AUTO      "auto://"
@@ -84,6 +93,7 @@ gchar*          osm_gps_map_get_default_cache_directory (void);
 
 void            osm_gps_map_download_maps               (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2, int zoom_start, int zoom_end);
 void            osm_gps_map_download_cancel_all         (OsmGpsMap *map);
+void            osm_gps_map_download_job_add            (OsmGpsMap *map, OsmGpsMapDownloadJob *job);
 void            osm_gps_map_get_bbox                    (OsmGpsMap *map, OsmGpsMapPoint *pt1, OsmGpsMapPoint *pt2);
 void            osm_gps_map_zoom_fit_bbox               (OsmGpsMap *map, float latitude1, float latitude2, float longitude1, float longitude2);
 void            osm_gps_map_set_center_and_zoom         (OsmGpsMap *map, float latitude, float longitude, int zoom);
@@ -115,7 +125,9 @@ gboolean        osm_gps_map_layer_remove                (OsmGpsMap *map, OsmGpsM
 void            osm_gps_map_layer_remove_all            (OsmGpsMap *map);
 void            osm_gps_map_convert_screen_to_geographic(OsmGpsMap *map, gint pixel_x, gint pixel_y, OsmGpsMapPoint *pt);
 void            osm_gps_map_convert_geographic_to_screen(OsmGpsMap *map, OsmGpsMapPoint *pt, gint *pixel_x, gint *pixel_y);
+void            osm_gps_map_convert_geographic_to_screen_batch(OsmGpsMap *map, const OsmGpsMapPoint *points, guint n_points, gdouble *pixel_xy);
 OsmGpsMapPoint *osm_gps_map_get_event_location          (OsmGpsMap *map, GdkEventButton *event);
+OsmGpsMapHit_t  osm_gps_map_hit_test                    (OsmGpsMap *map, gint pixel_x, gint pixel_y, OsmGpsMapTrack **track, gint *point_index);
 gboolean        osm_gps_map_map_redraw                  (OsmGpsMap *map);
 void            osm_gps_map_map_redraw_idle             (OsmGpsMap *map);
 
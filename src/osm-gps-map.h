@@ -26,6 +26,7 @@
 #include <osm-gps-map-point.h>
 #include <osm-gps-map-image.h>
 #include <osm-gps-map-source.h>
+#include <osm-gps-map-download-job.h>
 #include <osm-gps-map-widget.h>
 #include <osm-gps-map-compat.h>
 
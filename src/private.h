@@ -26,6 +26,8 @@
 #include <gdk/gdk.h>
 #include <gtk/gtk.h>
 #include "osm-gps-map-widget.h"
+#include "osm-gps-map-download-job.h"
+#include "tile-store.h"
 
 #define TILESIZE 256
 #define MAX_ZOOM 20
@@ -62,4 +64,32 @@
 /* equatorial radius in meters */
 #define OSM_EQ_RADIUS   (6378137.0)
 
+/* between OsmGpsMap and a running OsmGpsMapDownloadJob */
+OsmTileStore *osm_gps_map_get_tile_store (OsmGpsMap *map);
+gboolean osm_gps_map_queue_job_tile (OsmGpsMap *map, OsmGpsMapDownloadJob *job, int zoom, int x, int y, gboolean *missing);
+void osm_gps_map_cancel_job_tiles (OsmGpsMap *map, OsmGpsMapDownloadJob *job);
+void osm_gps_map_remove_job (OsmGpsMap *map, OsmGpsMapDownloadJob *job);
+gboolean osm_gps_map_download_job_start (OsmGpsMapDownloadJob *job, OsmGpsMap *map, int min_zoom, int max_zoom);
+void osm_gps_map_download_job_tile_done (OsmGpsMapDownloadJob *job, int zoom, int x, int y, gboolean ok, gsize bytes);
+
+/* the positions of the points of a track to draw at a zoom level, transfer
+ * none */
+GArray *osm_gps_map_track_get_lod (OsmGpsMapTrack *track, int zoom);
+/* after the point at pos was moved without emitting point-changed */
+void osm_gps_map_track_point_moved (OsmGpsMapTrack *track, int pos);
+/* The handle nearest x,y, in pixels at zoom, and no further than radius.
+ * Points win over breakers. Closed tracks, polygons, also have a breaker
+ * between the last and first points. index is that of the point, or that
+ * a point inserted at the breaker would take */
+OsmGpsMapHit_t osm_gps_map_track_hit_test (OsmGpsMapTrack *track, int zoom, double x, double y,
+                                           double radius, gboolean breakers, gboolean closed, int *index);
+/* changes whenever points are added, removed or moved */
+guint osm_gps_map_track_get_stamp (OsmGpsMapTrack *track);
+/* the latlon2world() x and y of each point, one after the other */
+const double *osm_gps_map_track_get_world (OsmGpsMapTrack *track);
+/* the latlon2world() x and y of the image point */
+void osm_gps_map_image_get_world (OsmGpsMapImage *image, double *world);
+/* the size of the image pixbuf */
+void osm_gps_map_image_get_size (OsmGpsMapImage *image, int *w, int *h);
+
 #endif /* _PRIVATE_H_ */
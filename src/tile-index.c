@@ -0,0 +1,245 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "tile-index.h"
+
+#define MIN_BUCKETS 64
+
+/*
+ * Linear probing, with entries moved back on removal instead of leaving
+ * tombstones, so lookups never get slower as tiles come and go. Lookups,
+ * inserts of existing keys and removals never allocate.
+ */
+
+typedef struct {
+    guint64 key;            /* 0 == empty bucket */
+    gpointer value;
+} OsmTileIndexEntry;
+
+struct _OsmTileIndex
+{
+    OsmTileIndexEntry *entries;
+    guint n_buckets;        /* always a power of two */
+    guint n_used;
+    GDestroyNotify value_destroy_func;
+};
+
+static inline guint
+tile_index_bucket(OsmTileIndex *index, guint64 key)
+{
+    key ^= key >> 33;
+    key *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    return (guint)key & (index->n_buckets - 1);
+}
+
+static OsmTileIndexEntry *
+tile_index_find(OsmTileIndex *index, guint64 key)
+{
+    guint mask = index->n_buckets - 1;
+    guint i = tile_index_bucket(index, key);
+
+    while (index->entries[i].key != 0) {
+        if (index->entries[i].key == key)
+            return &index->entries[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void
+tile_index_resize(OsmTileIndex *index, guint n_buckets)
+{
+    OsmTileIndexEntry *old = index->entries;
+    guint i, old_n = index->n_buckets;
+
+    index->entries = g_new0(OsmTileIndexEntry, n_buckets);
+    index->n_buckets = n_buckets;
+
+    for (i = 0; i < old_n; i++) {
+        if (old[i].key != 0) {
+            guint j = tile_index_bucket(index, old[i].key);
+            while (index->entries[j].key != 0)
+                j = (j + 1) & (n_buckets - 1);
+            index->entries[j] = old[i];
+        }
+    }
+    g_free(old);
+}
+
+OsmTileIndex *
+osm_tile_index_new(GDestroyNotify value_destroy_func)
+{
+    OsmTileIndex *index = g_new0(OsmTileIndex, 1);
+
+    index->n_buckets = MIN_BUCKETS;
+    index->entries = g_new0(OsmTileIndexEntry, MIN_BUCKETS);
+    index->value_destroy_func = value_destroy_func;
+
+    return index;
+}
+
+void
+osm_tile_index_free(OsmTileIndex *index)
+{
+    if (index) {
+        osm_tile_index_remove_all(index);
+        g_free(index->entries);
+        g_free(index);
+    }
+}
+
+gboolean
+osm_tile_index_lookup_extended(OsmTileIndex *index, guint64 key, gpointer *value)
+{
+    OsmTileIndexEntry *e = tile_index_find(index, key);
+
+    if (value)
+        *value = e ? e->value : NULL;
+    return e != NULL;
+}
+
+gpointer
+osm_tile_index_lookup(OsmTileIndex *index, guint64 key)
+{
+    OsmTileIndexEntry *e = tile_index_find(index, key);
+    return e ? e->value : NULL;
+}
+
+gboolean
+osm_tile_index_contains(OsmTileIndex *index, guint64 key)
+{
+    return tile_index_find(index, key) != NULL;
+}
+
+/* replaces (and destroys) the value if the key is already present */
+void
+osm_tile_index_insert(OsmTileIndex *index, guint64 key, gpointer value)
+{
+    OsmTileIndexEntry *e;
+    guint i;
+
+    g_return_if_fail(key != 0);
+
+    e = tile_index_find(index, key);
+    if (e) {
+        gpointer old = e->value;
+        e->value = value;
+        if (index->value_destroy_func && old)
+            index->value_destroy_func(old);
+        return;
+    }
+
+    if ((index->n_used + 1) * 2 > index->n_buckets)
+        tile_index_resize(index, index->n_buckets * 2);
+
+    i = tile_index_bucket(index, key);
+    while (index->entries[i].key != 0)
+        i = (i + 1) & (index->n_buckets - 1);
+
+    index->entries[i].key = key;
+    index->entries[i].value = value;
+    index->n_used++;
+}
+
+gboolean
+osm_tile_index_remove(OsmTileIndex *index, guint64 key)
+{
+    OsmTileIndexEntry *e = tile_index_find(index, key);
+    guint mask = index->n_buckets - 1;
+    guint i, j;
+    gpointer value;
+
+    if (!e)
+        return FALSE;
+
+    value = e->value;
+
+    /* shift back the following entries of the probe sequence which would
+     * no longer be reachable across the hole */
+    i = e - index->entries;
+    j = i;
+    for (;;) {
+        guint home;
+
+        j = (j + 1) & mask;
+        if (index->entries[j].key == 0)
+            break;
+
+        home = tile_index_bucket(index, index->entries[j].key);
+        /* can entry j move to i, i.e. is its home outside (i, j] */
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            index->entries[i] = index->entries[j];
+            i = j;
+        }
+    }
+    index->entries[i].key = 0;
+    index->entries[i].value = NULL;
+    index->n_used--;
+
+    /* destroy last, the callback may well look at the index */
+    if (index->value_destroy_func && value)
+        index->value_destroy_func(value);
+
+    return TRUE;
+}
+
+void
+osm_tile_index_remove_all(OsmTileIndex *index)
+{
+    OsmTileIndexEntry *old = index->entries;
+    guint i, old_n = index->n_buckets;
+
+    /* detach the entries first, so the destroy function sees an empty
+     * index */
+    index->entries = g_new0(OsmTileIndexEntry, MIN_BUCKETS);
+    index->n_buckets = MIN_BUCKETS;
+    index->n_used = 0;
+
+    if (index->value_destroy_func) {
+        for (i = 0; i < old_n; i++) {
+            if (old[i].key != 0 && old[i].value)
+                index->value_destroy_func(old[i].value);
+        }
+    }
+    g_free(old);
+}
+
+guint
+osm_tile_index_size(OsmTileIndex *index)
+{
+    return index->n_used;
+}
+
+/* the index must not be modified by func */
+void
+osm_tile_index_foreach(OsmTileIndex *index, OsmTileIndexFunc func, gpointer user_data)
+{
+    guint i;
+
+    for (i = 0; i < index->n_buckets; i++) {
+        if (index->entries[i].key != 0)
+            func(index->entries[i].key, index->entries[i].value, user_data);
+    }
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TILE_INDEX_H__
+#define __TILE_INDEX_H__
+
+#include <glib.h>
+
+/* A tile packed into 64 bits, so it can be looked up without building a
+ * string. Bits 56-63 identify the tile source, 50-55 hold zoom + 1 (so no
+ * tile has the key 0), then 25 bits each of x and y, enough for zoom 25 */
+#define OSM_TILE_KEY(source, zoom, x, y) \
+    (((guint64)((source) & 0xff) << 56) | \
+     ((guint64)(((zoom) + 1) & 0x3f) << 50) | \
+     ((guint64)((x) & 0x1ffffff) << 25) | \
+     ((guint64)((y) & 0x1ffffff)))
+
+/* Open addressing hash table from tile keys to pointers */
+typedef struct _OsmTileIndex OsmTileIndex;
+
+typedef void (*OsmTileIndexFunc) (guint64 key, gpointer value, gpointer user_data);
+
+OsmTileIndex *osm_tile_index_new(GDestroyNotify value_destroy_func);
+void osm_tile_index_free(OsmTileIndex *index);
+
+gboolean osm_tile_index_lookup_extended(OsmTileIndex *index, guint64 key, gpointer *value);
+gpointer osm_tile_index_lookup(OsmTileIndex *index, guint64 key);
+gboolean osm_tile_index_contains(OsmTileIndex *index, guint64 key);
+void osm_tile_index_insert(OsmTileIndex *index, guint64 key, gpointer value);
+gboolean osm_tile_index_remove(OsmTileIndex *index, guint64 key);
+void osm_tile_index_remove_all(OsmTileIndex *index);
+guint osm_tile_index_size(OsmTileIndex *index);
+void osm_tile_index_foreach(OsmTileIndex *index, OsmTileIndexFunc func, gpointer user_data);
+
+#endif /* __TILE_INDEX_H__ */
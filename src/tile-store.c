@@ -0,0 +1,991 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifndef G_OS_WIN32
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+
+#include "tile-index.h"
+#include "tile-store.h"
+
+typedef struct {
+    GBytes *    (*read)     (OsmTileStore *store, int zoom, int x, int y);
+    gboolean    (*write)    (OsmTileStore *store, int zoom, int x, int y, GBytes *bytes);
+    gboolean    (*contains) (OsmTileStore *store, int zoom, int x, int y);
+    OsmTileStoreState (*probe) (OsmTileStore *store, int zoom, int x, int y);
+    void        (*sync)     (OsmTileStore *store);
+    void        (*free)     (OsmTileStore *store);
+} OsmTileStoreOps;
+
+struct _OsmTileStore
+{
+    const OsmTileStoreOps *ops;
+    gchar *cache_dir;
+    gint ref_count;
+    /* remember writes for osm_tile_store_sync */
+    gint sync;
+};
+
+/*
+ * One file per tile, the traditional layout. Which tiles exist is read once
+ * by a background scan of the cache directory and then kept up to date in
+ * memory, so that missing tiles can be told apart without failing open()s
+ */
+
+typedef struct {
+    OsmTileStore parent;
+    gchar *image_format;
+
+    /* protects present */
+    GMutex lock;
+    /* keyed by OSM_TILE_KEY with source 0, complete once scan_done is set */
+    OsmTileIndex *present;
+    GThread *scan_thread;
+    gint scan_done;
+    gint scan_cancel;
+
+    /* protected by lock, files written since the last sync */
+    GPtrArray *unsynced;
+} OsmTileStoreFiles;
+
+static gchar *
+files_tile_path(OsmTileStoreFiles *store, int zoom, int x, int y)
+{
+    return g_strdup_printf("%s%c%d%c%d%c%d.%s",
+                store->parent.cache_dir, G_DIR_SEPARATOR,
+                zoom, G_DIR_SEPARATOR,
+                x, G_DIR_SEPARATOR,
+                y,
+                store->image_format);
+}
+
+static gboolean
+files_is_present(OsmTileStoreFiles *store, int zoom, int x, int y)
+{
+    gboolean present;
+
+    g_mutex_lock(&store->lock);
+    present = osm_tile_index_contains(store->present, OSM_TILE_KEY(0, zoom, x, y));
+    g_mutex_unlock(&store->lock);
+
+    return present;
+}
+
+/* parse a non negative decimal number, followed by suffix */
+static gboolean
+files_parse_name(const gchar *name, const gchar *suffix, int *value)
+{
+    gchar *end;
+    gint64 v;
+
+    if (!g_ascii_isdigit(name[0]))
+        return FALSE;
+
+    v = g_ascii_strtoll(name, &end, 10);
+    if (v > G_MAXINT || strcmp(end, suffix) != 0)
+        return FALSE;
+
+    *value = v;
+    return TRUE;
+}
+
+static gpointer
+files_scan_thread(gpointer data)
+{
+    OsmTileStoreFiles *store = data;
+    gchar *suffix = g_strdup_printf(".%s", store->image_format);
+    GArray *found = g_array_new(FALSE, FALSE, sizeof(guint64));
+    const gchar *zname, *xname, *yname;
+    GDir *zdir, *xdir, *ydir;
+    guint n_found = 0;
+
+    zdir = g_dir_open(store->parent.cache_dir, 0, NULL);
+    while (zdir && (zname = g_dir_read_name(zdir)) != NULL) {
+        gchar *zpath;
+        int zoom;
+
+        if (!files_parse_name(zname, "", &zoom))
+            continue;
+
+        zpath = g_build_filename(store->parent.cache_dir, zname, NULL);
+        xdir = g_dir_open(zpath, 0, NULL);
+        while (xdir && (xname = g_dir_read_name(xdir)) != NULL) {
+            gchar *xpath;
+            guint i;
+            int x, y;
+
+            if (g_atomic_int_get(&store->scan_cancel))
+                break;
+            if (!files_parse_name(xname, "", &x))
+                continue;
+
+            xpath = g_build_filename(zpath, xname, NULL);
+            ydir = g_dir_open(xpath, 0, NULL);
+            while (ydir && (yname = g_dir_read_name(ydir)) != NULL) {
+                if (files_parse_name(yname, suffix, &y)) {
+                    guint64 key = OSM_TILE_KEY(0, zoom, x, y);
+                    g_array_append_val(found, key);
+                }
+            }
+            if (ydir)
+                g_dir_close(ydir);
+            g_free(xpath);
+
+            /* publish one column at a time */
+            g_mutex_lock(&store->lock);
+            for (i = 0; i < found->len; i++)
+                osm_tile_index_insert(store->present, g_array_index(found, guint64, i), GINT_TO_POINTER(TRUE));
+            g_mutex_unlock(&store->lock);
+            n_found += found->len;
+            g_array_set_size(found, 0);
+        }
+        if (xdir)
+            g_dir_close(xdir);
+        g_free(zpath);
+
+        if (g_atomic_int_get(&store->scan_cancel))
+            break;
+    }
+    if (zdir)
+        g_dir_close(zdir);
+
+    if (!g_atomic_int_get(&store->scan_cancel)) {
+        g_debug("Found %u tiles in %s", n_found, store->parent.cache_dir);
+        g_atomic_int_set(&store->scan_done, 1);
+    }
+
+    g_array_free(found, TRUE);
+    g_free(suffix);
+    return NULL;
+}
+
+static GBytes *
+files_read(OsmTileStore *base, int zoom, int x, int y)
+{
+    OsmTileStoreFiles *store = (OsmTileStoreFiles *)base;
+    gchar *filename, *contents;
+    gsize length;
+    GBytes *bytes = NULL;
+
+    if (g_atomic_int_get(&store->scan_done) && !files_is_present(store, zoom, x, y))
+        return NULL;
+
+    filename = files_tile_path(store, zoom, x, y);
+    if (g_file_get_contents(filename, &contents, &length, NULL))
+        bytes = g_bytes_new_take(contents, length);
+
+    g_free(filename);
+    return bytes;
+}
+
+static gboolean
+files_write(OsmTileStore *base, int zoom, int x, int y, GBytes *bytes)
+{
+    OsmTileStoreFiles *store = (OsmTileStoreFiles *)base;
+    gchar *folder, *filename = NULL;
+    gboolean saved = FALSE;
+    GError *error = NULL;
+
+    folder = g_strdup_printf("%s%c%d%c%d",
+                base->cache_dir, G_DIR_SEPARATOR,
+                zoom, G_DIR_SEPARATOR,
+                x);
+
+    if (g_mkdir_with_parents(folder,0700) == 0) {
+        gsize size = g_bytes_get_size(bytes);
+
+        /* written to a temporary file and renamed, so that readers and a
+         * crash never leave a half written tile behind */
+        filename = files_tile_path(store, zoom, x, y);
+        saved = g_file_set_contents_full(filename, g_bytes_get_data(bytes, NULL), size,
+                                         G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error);
+        if (saved) {
+            g_debug("Wrote %"G_GSIZE_FORMAT" bytes to %s", size, filename);
+        } else {
+            g_warning("Error writing tile: %s", error->message);
+            g_error_free(error);
+        }
+    } else {
+        g_warning("Error creating tile download directory: %s", folder);
+    }
+
+    if (saved) {
+        g_mutex_lock(&store->lock);
+        osm_tile_index_insert(store->present, OSM_TILE_KEY(0, zoom, x, y), GINT_TO_POINTER(TRUE));
+        if (g_atomic_int_get(&base->sync)) {
+            g_ptr_array_add(store->unsynced, filename);
+            filename = NULL;
+        }
+        g_mutex_unlock(&store->lock);
+    }
+
+    g_free(filename);
+    g_free(folder);
+    return saved;
+}
+
+static gboolean
+files_contains(OsmTileStore *base, int zoom, int x, int y)
+{
+    OsmTileStoreFiles *store = (OsmTileStoreFiles *)base;
+    gchar *filename;
+    gboolean exists;
+
+    if (files_is_present(store, zoom, x, y))
+        return TRUE;
+    if (g_atomic_int_get(&store->scan_done))
+        return FALSE;
+
+    filename = files_tile_path(store, zoom, x, y);
+    exists = g_file_test(filename, G_FILE_TEST_EXISTS);
+    g_free(filename);
+    return exists;
+}
+
+static OsmTileStoreState
+files_probe(OsmTileStore *base, int zoom, int x, int y)
+{
+    OsmTileStoreFiles *store = (OsmTileStoreFiles *)base;
+
+    if (files_is_present(store, zoom, x, y))
+        return OSM_TILE_STORE_PRESENT;
+    if (g_atomic_int_get(&store->scan_done))
+        return OSM_TILE_STORE_MISSING;
+    return OSM_TILE_STORE_UNKNOWN;
+}
+
+#ifndef G_OS_WIN32
+static void
+fsync_path(const gchar *path)
+{
+    int fd = g_open(path, O_RDONLY, 0);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+#endif
+
+/* flush the files written since the last sync, and the directory entries
+ * pointing at them */
+static void
+files_sync(OsmTileStore *base)
+{
+    OsmTileStoreFiles *store = (OsmTileStoreFiles *)base;
+    GPtrArray *paths;
+
+    g_mutex_lock(&store->lock);
+    paths = store->unsynced;
+    store->unsynced = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_unlock(&store->lock);
+
+#ifndef G_OS_WIN32
+    if (paths->len > 0) {
+        GHashTable *folders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        GHashTableIter iter;
+        gchar *folder;
+        guint i;
+
+        for (i = 0; i < paths->len; i++) {
+            const gchar *path = g_ptr_array_index(paths, i);
+            fsync_path(path);
+            g_hash_table_add(folders, g_path_get_dirname(path));
+        }
+
+        g_hash_table_iter_init(&iter, folders);
+        while (g_hash_table_iter_next(&iter, (gpointer *)&folder, NULL))
+            fsync_path(folder);
+
+        g_debug("Synced %u tiles in %u folders", paths->len, g_hash_table_size(folders));
+        g_hash_table_destroy(folders);
+    }
+#endif
+
+    g_ptr_array_unref(paths);
+}
+
+static void
+files_free(OsmTileStore *base)
+{
+    OsmTileStoreFiles *store = (OsmTileStoreFiles *)base;
+
+    if (store->scan_thread) {
+        g_atomic_int_set(&store->scan_cancel, 1);
+        g_thread_join(store->scan_thread);
+    }
+    osm_tile_index_free(store->present);
+    g_ptr_array_unref(store->unsynced);
+    g_mutex_clear(&store->lock);
+    g_free(store->image_format);
+}
+
+static const OsmTileStoreOps files_ops = {
+    files_read,
+    files_write,
+    files_contains,
+    files_probe,
+    files_sync,
+    files_free
+};
+
+OsmTileStore *
+osm_tile_store_new_files(const gchar *cache_dir, const gchar *image_format)
+{
+    OsmTileStoreFiles *store = g_new0(OsmTileStoreFiles, 1);
+
+    store->parent.ops = &files_ops;
+    store->parent.ref_count = 1;
+    store->parent.cache_dir = g_strdup(cache_dir);
+    store->image_format = g_strdup(image_format);
+    store->present = osm_tile_index_new(NULL);
+    store->unsynced = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_init(&store->lock);
+    store->scan_thread = g_thread_new("osm-tile-scan", files_scan_thread, store);
+
+    return (OsmTileStore *)store;
+}
+
+/*
+ * Pack files. All tiles live in a handful of append-only segment files, each
+ * record is a PackRecordHeader followed by the encoded tile. The index is an
+ * open addressing (linear probing) hash table of PackIndexEntry, mmap'd
+ * directly from tiles.idx, so a lookup costs no syscalls at all.
+ *
+ * The index remembers how far into the segments it is up to date (tail).
+ * Records appended after that point, for example because we crashed before
+ * the index page was written back, are recovered by scanning the segments from
+ * the tail when the store is opened. If the index is missing or damaged it is
+ * rebuilt the same way from the beginning of the first segment.
+ *
+ * Both files are stored in native byte order, they are a cache and are not
+ * meant to be shared between machines.
+ */
+
+#define PACK_INDEX_NAME         "tiles.idx"
+#define PACK_SEGMENT_FORMAT     "tiles-%04u.pack"
+#define PACK_INDEX_MAGIC        "OGMPIDX1"
+#define PACK_RECORD_MAGIC       (0x544d474f) /* OGMT */
+#define PACK_SEGMENT_MAX        (256 * 1024 * 1024)
+#define PACK_MIN_BUCKETS        (1 << 14)
+#define PACK_MAX_TILE_SIZE      (16 * 1024 * 1024)
+
+typedef struct {
+    gchar   magic[8];
+    guint32 n_buckets;
+    guint32 n_used;
+    guint32 tail_segment;
+    guint32 reserved;
+    guint64 tail_offset;
+} PackIndexHeader;
+
+typedef struct {
+    guint64 key;            /* 0 == empty bucket */
+    guint64 offset;         /* of the tile data within the segment */
+    guint32 segment;
+    guint32 length;
+} PackIndexEntry;
+
+typedef struct {
+    guint32 magic;
+    guint32 length;
+    guint64 key;
+} PackRecordHeader;
+
+typedef struct {
+    OsmTileStore parent;
+
+    /* protects everything below, readers only hold it for the index lookup */
+    GMutex lock;
+
+    int index_fd;
+    gsize map_size;
+    PackIndexHeader *header;
+    PackIndexEntry *entries;
+
+    /* one fd per segment, opened on demand, -1 if not yet opened */
+    GArray *segment_fds;
+    /* the first segment written since the last sync, G_MAXUINT32 if none */
+    guint32 unsynced_segment;
+} OsmTileStorePack;
+
+static inline guint64
+pack_key(int zoom, int x, int y)
+{
+    /* zoom + 1 so that no valid tile has a key of 0 */
+    return ((guint64)(zoom + 1) << 58) |
+           ((guint64)(x & 0x1fffffff) << 29) |
+           ((guint64)(y & 0x1fffffff));
+}
+
+static inline guint64
+pack_hash(guint64 k)
+{
+    k ^= k >> 33;
+    k *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+#ifndef G_OS_WIN32
+
+static gboolean
+pack_pread_all(int fd, void *buf, gsize count, guint64 offset)
+{
+    guint8 *p = buf;
+    while (count > 0) {
+        ssize_t n = pread(fd, p, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        count -= n;
+        offset += n;
+    }
+    return TRUE;
+}
+
+static gboolean
+pack_pwrite_all(int fd, const void *buf, gsize count, guint64 offset)
+{
+    const guint8 *p = buf;
+    while (count > 0) {
+        ssize_t n = pwrite(fd, p, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        count -= n;
+        offset += n;
+    }
+    return TRUE;
+}
+
+static PackIndexEntry *
+pack_lookup(OsmTileStorePack *store, guint64 key, gboolean for_insert)
+{
+    guint32 mask = store->header->n_buckets - 1;
+    guint32 i = pack_hash(key) & mask;
+
+    while (store->entries[i].key != 0) {
+        if (store->entries[i].key == key)
+            return &store->entries[i];
+        i = (i + 1) & mask;
+    }
+    return for_insert ? &store->entries[i] : NULL;
+}
+
+static void
+pack_unmap_index(OsmTileStorePack *store)
+{
+    if (store->header) {
+        munmap(store->header, store->map_size);
+        store->header = NULL;
+        store->entries = NULL;
+        store->map_size = 0;
+    }
+}
+
+static gboolean
+pack_map_index(OsmTileStorePack *store, guint32 n_buckets)
+{
+    gsize size = sizeof(PackIndexHeader) + (gsize)n_buckets * sizeof(PackIndexEntry);
+    void *map;
+
+    if (ftruncate(store->index_fd, size) != 0)
+        return FALSE;
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, store->index_fd, 0);
+    if (map == MAP_FAILED)
+        return FALSE;
+
+    store->header = map;
+    store->entries = (PackIndexEntry *)(store->header + 1);
+    store->map_size = size;
+    return TRUE;
+}
+
+static gboolean
+pack_reset_index(OsmTileStorePack *store)
+{
+    pack_unmap_index(store);
+
+    /* truncating to 0 first guarantees a zero filled (empty) table */
+    if (ftruncate(store->index_fd, 0) != 0)
+        return FALSE;
+    if (!pack_map_index(store, PACK_MIN_BUCKETS))
+        return FALSE;
+
+    store->header->n_buckets = PACK_MIN_BUCKETS;
+    memcpy(store->header->magic, PACK_INDEX_MAGIC, sizeof(store->header->magic));
+    return TRUE;
+}
+
+/* double the size of the table, called with the lock held */
+static gboolean
+pack_grow_index(OsmTileStorePack *store)
+{
+    guint32 i, old_n = store->header->n_buckets;
+    PackIndexEntry *old;
+    PackIndexHeader hdr = *store->header;
+
+    old = g_new(PackIndexEntry, old_n);
+    memcpy(old, store->entries, (gsize)old_n * sizeof(PackIndexEntry));
+
+    /* invalidate the on disk copy while it is being rewritten, a crash in
+     * here is then detected and repaired by a rebuild at the next start */
+    memset(store->header->magic, 0, sizeof(store->header->magic));
+
+    pack_unmap_index(store);
+    if (!pack_map_index(store, old_n * 2)) {
+        g_free(old);
+        return FALSE;
+    }
+
+    memset(store->entries, 0, (gsize)old_n * 2 * sizeof(PackIndexEntry));
+    *store->header = hdr;
+    store->header->n_buckets = old_n * 2;
+    memset(store->header->magic, 0, sizeof(store->header->magic));
+
+    for (i = 0; i < old_n; i++) {
+        if (old[i].key != 0)
+            *pack_lookup(store, old[i].key, TRUE) = old[i];
+    }
+    g_free(old);
+
+    memcpy(store->header->magic, PACK_INDEX_MAGIC, sizeof(store->header->magic));
+    return TRUE;
+}
+
+static gboolean
+pack_index_insert(OsmTileStorePack *store, guint64 key, guint32 segment, guint64 offset, guint32 length)
+{
+    PackIndexEntry *e;
+
+    if ((store->header->n_used + 1) * 2 > store->header->n_buckets) {
+        if (!pack_grow_index(store))
+            return FALSE;
+    }
+
+    e = pack_lookup(store, key, TRUE);
+    if (e->key == 0)
+        store->header->n_used++;
+
+    /* re-downloaded tiles simply point at the newer copy, the old blob
+     * stays in its segment as garbage */
+    e->key = key;
+    e->segment = segment;
+    e->offset = offset;
+    e->length = length;
+    return TRUE;
+}
+
+static int
+pack_segment_fd(OsmTileStorePack *store, guint32 segment, gboolean create)
+{
+    int fd;
+
+    if (segment < store->segment_fds->len) {
+        fd = g_array_index(store->segment_fds, int, segment);
+        if (fd >= 0)
+            return fd;
+    }
+
+    {
+        gchar *name = g_strdup_printf(PACK_SEGMENT_FORMAT, segment);
+        gchar *path = g_build_filename(store->parent.cache_dir, name, NULL);
+        fd = g_open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+        g_free(name);
+        g_free(path);
+    }
+
+    if (fd >= 0) {
+        if (segment >= store->segment_fds->len) {
+            guint i, old_len = store->segment_fds->len;
+            g_array_set_size(store->segment_fds, segment + 1);
+            for (i = old_len; i <= segment; i++)
+                g_array_index(store->segment_fds, int, i) = -1;
+        }
+        g_array_index(store->segment_fds, int, segment) = fd;
+    }
+    return fd;
+}
+
+/* index every complete record found after the tail of the index */
+static void
+pack_recover(OsmTileStorePack *store)
+{
+    guint32 segment = store->header->tail_segment;
+    guint64 offset = store->header->tail_offset;
+    guint n_recovered = 0;
+
+    for (;;) {
+        PackRecordHeader rec;
+        struct stat st;
+        int fd = pack_segment_fd(store, segment, FALSE);
+
+        if (fd < 0 || fstat(fd, &st) != 0)
+            break;
+
+        if (offset + sizeof(rec) > (guint64)st.st_size ||
+            !pack_pread_all(fd, &rec, sizeof(rec), offset) ||
+            rec.magic != PACK_RECORD_MAGIC ||
+            rec.length > PACK_MAX_TILE_SIZE ||
+            offset + sizeof(rec) + rec.length > (guint64)st.st_size) {
+            /* end of this segment, or a torn write which will be overwritten
+             * by the next append. Move on if a later segment exists. */
+            if (pack_segment_fd(store, segment + 1, FALSE) < 0)
+                break;
+            segment++;
+            offset = 0;
+            store->header->tail_segment = segment;
+            store->header->tail_offset = 0;
+            continue;
+        }
+
+        if (!pack_index_insert(store, rec.key, segment, offset + sizeof(rec), rec.length))
+            break;
+
+        offset += sizeof(rec) + rec.length;
+        store->header->tail_segment = segment;
+        store->header->tail_offset = offset;
+        n_recovered++;
+    }
+
+    if (n_recovered)
+        g_debug("Recovered %u tiles into pack index", n_recovered);
+}
+
+static GBytes *
+pack_read(OsmTileStore *base, int zoom, int x, int y)
+{
+    OsmTileStorePack *store = (OsmTileStorePack *)base;
+    PackIndexEntry *e;
+    PackIndexEntry entry;
+    int fd = -1;
+    guint8 *data;
+
+    g_mutex_lock(&store->lock);
+    e = pack_lookup(store, pack_key(zoom, x, y), FALSE);
+    if (e) {
+        entry = *e;
+        fd = pack_segment_fd(store, entry.segment, FALSE);
+    }
+    g_mutex_unlock(&store->lock);
+
+    if (fd < 0)
+        return NULL;
+
+    /* segments are append-only, so the record cannot change under us */
+    data = g_malloc(entry.length);
+    if (!pack_pread_all(fd, data, entry.length, entry.offset)) {
+        g_free(data);
+        return NULL;
+    }
+    return g_bytes_new_take(data, entry.length);
+}
+
+static gboolean
+pack_write(OsmTileStore *base, int zoom, int x, int y, GBytes *bytes)
+{
+    OsmTileStorePack *store = (OsmTileStorePack *)base;
+    PackRecordHeader rec;
+    gsize size = g_bytes_get_size(bytes);
+    guint32 segment;
+    guint64 offset;
+    gboolean saved = FALSE;
+    int fd;
+
+    if (size == 0 || size > PACK_MAX_TILE_SIZE)
+        return FALSE;
+
+    rec.magic = PACK_RECORD_MAGIC;
+    rec.length = size;
+    rec.key = pack_key(zoom, x, y);
+
+    g_mutex_lock(&store->lock);
+
+    segment = store->header->tail_segment;
+    offset = store->header->tail_offset;
+    if (offset > 0 && offset + sizeof(rec) + size > PACK_SEGMENT_MAX) {
+        segment++;
+        offset = 0;
+    }
+
+    fd = pack_segment_fd(store, segment, TRUE);
+    if (fd >= 0 &&
+        pack_pwrite_all(fd, &rec, sizeof(rec), offset) &&
+        pack_pwrite_all(fd, g_bytes_get_data(bytes, NULL), size, offset + sizeof(rec))) {
+        saved = pack_index_insert(store, rec.key, segment, offset + sizeof(rec), size);
+        store->unsynced_segment = MIN(store->unsynced_segment, segment);
+        store->header->tail_segment = segment;
+        store->header->tail_offset = offset + sizeof(rec) + size;
+        g_debug("Packed %"G_GSIZE_FORMAT" bytes into segment %u", size, segment);
+    } else {
+        g_warning("Error writing tile to pack segment %u: %s", segment, g_strerror(errno));
+    }
+
+    g_mutex_unlock(&store->lock);
+    return saved;
+}
+
+static gboolean
+pack_contains(OsmTileStore *base, int zoom, int x, int y)
+{
+    OsmTileStorePack *store = (OsmTileStorePack *)base;
+    gboolean found;
+
+    g_mutex_lock(&store->lock);
+    found = pack_lookup(store, pack_key(zoom, x, y), FALSE) != NULL;
+    g_mutex_unlock(&store->lock);
+
+    return found;
+}
+
+static OsmTileStoreState
+pack_probe(OsmTileStore *base, int zoom, int x, int y)
+{
+    /* the index is always complete */
+    return pack_contains(base, zoom, x, y) ? OSM_TILE_STORE_PRESENT : OSM_TILE_STORE_MISSING;
+}
+
+/* flush the segments written since the last sync, then the index
+ * pointing into them */
+static void
+pack_sync(OsmTileStore *base)
+{
+    OsmTileStorePack *store = (OsmTileStorePack *)base;
+    guint32 first, last, segment;
+
+    g_mutex_lock(&store->lock);
+    first = store->unsynced_segment;
+    last = store->header->tail_segment;
+    store->unsynced_segment = G_MAXUINT32;
+    g_mutex_unlock(&store->lock);
+
+    if (first == G_MAXUINT32)
+        return;
+
+    /* the fds stay open as long as the store, and fsync can be slow,
+     * so don't hold up readers meanwhile */
+    for (segment = first; segment <= last; segment++) {
+        int fd;
+
+        g_mutex_lock(&store->lock);
+        fd = pack_segment_fd(store, segment, FALSE);
+        g_mutex_unlock(&store->lock);
+        if (fd >= 0)
+            fsync(fd);
+    }
+
+    g_mutex_lock(&store->lock);
+    msync(store->header, store->map_size, MS_SYNC);
+    g_mutex_unlock(&store->lock);
+
+    g_debug("Synced pack segments %u to %u", first, last);
+}
+
+static void
+pack_free(OsmTileStore *base)
+{
+    OsmTileStorePack *store = (OsmTileStorePack *)base;
+    guint i;
+
+    pack_unmap_index(store);
+    if (store->index_fd >= 0)
+        close(store->index_fd);
+
+    for (i = 0; i < store->segment_fds->len; i++) {
+        int fd = g_array_index(store->segment_fds, int, i);
+        if (fd >= 0)
+            close(fd);
+    }
+    g_array_free(store->segment_fds, TRUE);
+    g_mutex_clear(&store->lock);
+}
+
+static const OsmTileStoreOps pack_ops = {
+    pack_read,
+    pack_write,
+    pack_contains,
+    pack_probe,
+    pack_sync,
+    pack_free
+};
+
+OsmTileStore *
+osm_tile_store_new_pack(const gchar *cache_dir, GError **error)
+{
+    OsmTileStorePack *store;
+    struct stat st;
+    gchar *path;
+    gboolean valid = FALSE;
+
+    if (g_mkdir_with_parents(cache_dir, 0700) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Error creating tile cache directory %s", cache_dir);
+        return NULL;
+    }
+
+    store = g_new0(OsmTileStorePack, 1);
+    store->parent.ops = &pack_ops;
+    store->parent.ref_count = 1;
+    store->parent.cache_dir = g_strdup(cache_dir);
+    store->segment_fds = g_array_new(FALSE, FALSE, sizeof(int));
+    store->unsynced_segment = G_MAXUINT32;
+    g_mutex_init(&store->lock);
+
+    path = g_build_filename(cache_dir, PACK_INDEX_NAME, NULL);
+    store->index_fd = g_open(path, O_RDWR | O_CREAT, 0600);
+    g_free(path);
+    if (store->index_fd < 0)
+        goto fail;
+
+    /* only one store may append to, and recover, the pack at a time, be it
+     * another map or another process. The lock goes with the fd */
+    if (flock(store->index_fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_AGAIN,
+                        "Tile pack in %s is already in use", cache_dir);
+            osm_tile_store_unref((OsmTileStore *)store);
+            return NULL;
+        }
+        goto fail;
+    }
+
+    /* map an existing index if it looks sane */
+    if (fstat(store->index_fd, &st) == 0 && st.st_size >= (off_t)sizeof(PackIndexHeader)) {
+        PackIndexHeader hdr;
+        if (pack_pread_all(store->index_fd, &hdr, sizeof(hdr), 0) &&
+            memcmp(hdr.magic, PACK_INDEX_MAGIC, sizeof(hdr.magic)) == 0 &&
+            hdr.n_buckets >= PACK_MIN_BUCKETS &&
+            (hdr.n_buckets & (hdr.n_buckets - 1)) == 0 &&
+            (gsize)st.st_size == sizeof(PackIndexHeader) + (gsize)hdr.n_buckets * sizeof(PackIndexEntry)) {
+            valid = pack_map_index(store, hdr.n_buckets);
+        }
+    }
+
+    if (!valid) {
+        g_debug("Rebuilding pack index in %s", cache_dir);
+        if (!pack_reset_index(store))
+            goto fail;
+    }
+
+    pack_recover(store);
+    return (OsmTileStore *)store;
+
+fail:
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Error opening tile pack index in %s: %s", cache_dir, g_strerror(errno));
+    osm_tile_store_unref((OsmTileStore *)store);
+    return NULL;
+}
+
+#else /* G_OS_WIN32 */
+
+OsmTileStore *
+osm_tile_store_new_pack(const gchar *cache_dir, GError **error)
+{
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOSYS,
+                "Tile pack files are not supported on this platform");
+    return NULL;
+}
+
+#endif /* G_OS_WIN32 */
+
+/*
+ * Public (to the library) interface
+ */
+
+GBytes *
+osm_tile_store_read(OsmTileStore *store, int zoom, int x, int y)
+{
+    return store->ops->read(store, zoom, x, y);
+}
+
+gboolean
+osm_tile_store_write(OsmTileStore *store, int zoom, int x, int y, GBytes *bytes)
+{
+    return store->ops->write(store, zoom, x, y, bytes);
+}
+
+gboolean
+osm_tile_store_contains(OsmTileStore *store, int zoom, int x, int y)
+{
+    return store->ops->contains(store, zoom, x, y);
+}
+
+OsmTileStoreState
+osm_tile_store_probe(OsmTileStore *store, int zoom, int x, int y)
+{
+    return store->ops->probe(store, zoom, x, y);
+}
+
+void
+osm_tile_store_set_sync(OsmTileStore *store, gboolean sync)
+{
+    g_atomic_int_set(&store->sync, sync);
+}
+
+void
+osm_tile_store_sync(OsmTileStore *store)
+{
+    store->ops->sync(store);
+}
+
+const gchar *
+osm_tile_store_get_cache_dir(OsmTileStore *store)
+{
+    return store->cache_dir;
+}
+
+OsmTileStore *
+osm_tile_store_ref(OsmTileStore *store)
+{
+    g_atomic_int_inc(&store->ref_count);
+    return store;
+}
+
+void
+osm_tile_store_unref(OsmTileStore *store)
+{
+    if (store && g_atomic_int_dec_and_test(&store->ref_count)) {
+        store->ops->free(store);
+        g_free(store->cache_dir);
+        g_free(store);
+    }
+}
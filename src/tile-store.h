@@ -0,0 +1,57 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/* vim:set et sw=4 ts=4 */
+/*
+ * Copyright (C) 2013 John Stowers <john.stowers@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TILE_STORE_H__
+#define __TILE_STORE_H__
+
+#include <glib.h>
+
+/* On disk tile cache. All backends store the encoded (png, jpg) tile data
+ * exactly as it was downloaded, keyed by zoom, x, y. */
+typedef struct _OsmTileStore OsmTileStore;
+
+typedef enum {
+    OSM_TILE_STORE_MISSING,
+    OSM_TILE_STORE_PRESENT,
+    /* the store has not finished indexing yet */
+    OSM_TILE_STORE_UNKNOWN
+} OsmTileStoreState;
+
+/* one file per tile, cache_dir/zoom/x/y.image_format */
+OsmTileStore *osm_tile_store_new_files(const gchar *cache_dir, const gchar *image_format);
+/* mmap'd index cache_dir/tiles.idx plus append-only segments
+ * cache_dir/tiles-NNNN.pack. Fails if another store, in this process or
+ * another, has the pack open */
+OsmTileStore *osm_tile_store_new_pack(const gchar *cache_dir, GError **error);
+
+GBytes *osm_tile_store_read(OsmTileStore *store, int zoom, int x, int y);
+gboolean osm_tile_store_write(OsmTileStore *store, int zoom, int x, int y, GBytes *bytes);
+gboolean osm_tile_store_contains(OsmTileStore *store, int zoom, int x, int y);
+/* like contains, but answered from memory, never touching the disk */
+OsmTileStoreState osm_tile_store_probe(OsmTileStore *store, int zoom, int x, int y);
+/* when set, tiles written are remembered until osm_tile_store_sync()
+ * flushes them to disk, all at once */
+void osm_tile_store_set_sync(OsmTileStore *store, gboolean sync);
+void osm_tile_store_sync(OsmTileStore *store);
+const gchar *osm_tile_store_get_cache_dir(OsmTileStore *store);
+/* a store can be used from several threads, each holding a reference */
+OsmTileStore *osm_tile_store_ref(OsmTileStore *store);
+void osm_tile_store_unref(OsmTileStore *store);
+
+#endif /* __TILE_STORE_H__ */
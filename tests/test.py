@@ -2,6 +2,9 @@
 import unittest
 import cairo
 import io
+import os
+import tempfile
+import time
 
 import gi
 gi.require_version('OsmGpsMap', '1.0')
@@ -16,6 +19,58 @@ class TestOsmGpsMap(unittest.TestCase):
 		self.zoom = 15
 		self.osm = OsmGpsMap.Map(user_agent="test/0.1")
 		
+	def show(self, size=256):
+		# drawn offscreen, without tiles
+		self.osm.set_property('map-source', OsmGpsMap.MapSource_t.NULL)
+		window = Gtk.OffscreenWindow()
+		window.set_size_request(size, size)
+		window.add(self.osm)
+		window.show_all()
+		self.spin_main_loop(0)
+		self.osm.set_center_and_zoom(self.lat, self.lon, self.zoom)
+		self.osm.map_redraw()
+		return window
+
+	def spin_main_loop(self, seconds):
+		end = time.monotonic() + seconds
+		while True:
+			while Gtk.events_pending():
+				Gtk.main_iteration()
+			if time.monotonic() >= end:
+				break
+			time.sleep(0.01)
+
+	def pointer(self, event_type, x, y):
+		event = Gdk.Event.new(event_type)
+		event.x = x
+		event.y = y
+		if event_type == Gdk.EventType.MOTION_NOTIFY:
+			event.state = Gdk.ModifierType.BUTTON1_MASK
+			self.osm.emit('motion-notify-event', event)
+		elif event_type == Gdk.EventType.BUTTON_PRESS:
+			event.button = 1
+			self.osm.emit('button-press-event', event)
+		else:
+			event.button = 1
+			self.osm.emit('button-release-event', event)
+
+	def pixel(self, x, y):
+		# red, green, blue of what the map shows at x, y
+		surface = cairo.ImageSurface(cairo.FORMAT_ARGB32, x + 1, y + 1)
+		self.osm.draw(cairo.Context(surface))
+		data = surface.get_data()
+		i = y * surface.get_stride() + x * 4
+		return data[i+2], data[i+1], data[i]
+
+	def red_image(self, x, y):
+		# a red square centered on the screen position x, y
+		pixbuf = GdkPixbuf.Pixbuf.new(GdkPixbuf.Colorspace.RGB, True, 8, 16, 16)
+		pixbuf.fill(0xff0000ff)
+		pt = OsmGpsMap.MapPoint()
+		self.osm.convert_screen_to_geographic(x, y, pt)
+		lat, lon = pt.get_degrees()
+		return self.osm.image_add(lat, lon, pixbuf)
+
 	def test_map(self):
 		test_window = Gtk.Window()
 		test_window.set_title("OsmGpsMap")
@@ -94,6 +149,42 @@ class TestOsmGpsMap(unittest.TestCase):
 		self.osm.image_remove(pointer)
 		self.osm.image_remove_all()
 		
+	def test_image_point(self):
+		window = self.show()
+		image = self.red_image(64, 128)
+		self.osm.map_redraw()
+		self.assertEqual(self.pixel(64, 128), (255, 0, 0))
+
+		# moved by setting its point, not by changing the one it has
+		pt = OsmGpsMap.MapPoint()
+		self.osm.convert_screen_to_geographic(192, 128, pt)
+		image.set_property('point', pt)
+		self.osm.map_redraw()
+		self.assertNotEqual(self.pixel(64, 128), (255, 0, 0))
+		self.assertEqual(self.pixel(192, 128), (255, 0, 0))
+		window.destroy()
+
+	def test_image_clustering(self):
+		self.assertFalse(self.osm.get_property('image-clustering'))
+		window = self.show()
+		for x in range(0, 100):
+			self.red_image(128, 128)
+
+		# the images, then a circle counting them instead
+		self.osm.map_redraw()
+		self.assertEqual(self.pixel(128, 121), (255, 0, 0))
+		self.osm.set_property('image-clustering', True)
+		self.osm.map_redraw()
+		r, g, b = self.pixel(128, 121)
+		self.assertTrue(b > r)
+
+		# a lone image is shown as it is
+		self.osm.image_remove_all()
+		self.red_image(128, 128)
+		self.osm.map_redraw()
+		self.assertEqual(self.pixel(128, 121), (255, 0, 0))
+		window.destroy()
+		
 	def test_track(self):
 		track = OsmGpsMap.MapTrack()
 		self.osm.track_add(track)
@@ -129,11 +220,151 @@ class TestOsmGpsMap(unittest.TestCase):
 		track.insert_point(point, 0)
 		self.assertEqual(track.n_points(), 1)
 
+	def test_add_points(self):
+		track = OsmGpsMap.MapTrack()
+		points = [OsmGpsMap.MapPoint.new_degrees(self.lat+x, self.lon)
+			  for x in range(0, 10)]
+		track.add_points(points)
+		self.assertEqual(track.n_points(), 10)
+		self.assertEqual(len(track.get_point_array()), 10)
+		
+		track.set_point(0, OsmGpsMap.MapPoint.new_degrees(0, 0))
+		self.assertEqual(track.get_point(0).get_degrees(), (0, 0))
+		
+		# the moved point is drawn, and found, where it is now
+		track.set_property('editable', True)
+		self.osm.track_add(track)
+		self.osm.set_center_and_zoom(self.lat, self.lon, self.zoom)
+		old = OsmGpsMap.MapPoint.new_degrees(self.lat+1, self.lon)
+		x, y = self.osm.convert_geographic_to_screen(old)
+		self.assertEqual(self.osm.hit_test(x, y)[0], OsmGpsMap.MapHit_t.POINT)
+		track.set_point(1, OsmGpsMap.MapPoint.new_degrees(self.lat, self.lon))
+		self.assertEqual(self.osm.hit_test(x, y)[0], OsmGpsMap.MapHit_t.NONE)
+		x, y = self.osm.convert_geographic_to_screen(track.get_point(1))
+		hit, hit_track, index = self.osm.hit_test(x, y)
+		self.assertEqual(hit, OsmGpsMap.MapHit_t.POINT)
+		self.assertEqual(index, 1)
+
+	def test_hit_test(self):
+		track = OsmGpsMap.MapTrack(editable=True)
+		for x in range(0, 3):
+			track.add_point(OsmGpsMap.MapPoint.new_degrees(self.lat, self.lon+x*0.01))
+		self.osm.track_add(track)
+		self.osm.set_center_and_zoom(self.lat, self.lon, self.zoom)
+		
+		x, y = self.osm.convert_geographic_to_screen(track.get_point(1))
+		hit, hit_track, index = self.osm.hit_test(x, y)
+		self.assertEqual(hit, OsmGpsMap.MapHit_t.POINT)
+		self.assertEqual(index, 1)
+		
+		hit, hit_track, index = self.osm.hit_test(x + 1000, y)
+		self.assertEqual(hit, OsmGpsMap.MapHit_t.NONE)
+
 	def test_zoom_fit_bbox_point(self):
 		# Degenerate bbox (one geotag). Must not crash; zoom clamps to max.
 		self.osm.zoom_fit_bbox(self.lat, self.lat, self.lon, self.lon)
 		self.assertEqual(self.osm.get_property('zoom'),
 				 self.osm.get_property('max-zoom'))
 
+	def test_tile_cache_packed(self):
+		with tempfile.TemporaryDirectory() as cache:
+			osm = OsmGpsMap.Map(tile_cache=cache, tile_cache_packed=True)
+			self.assertTrue(osm.get_property('tile-cache-packed'))
+			self.assertTrue(os.path.exists(os.path.join(cache, 'tiles.idx')))
+			# the pack is in use, so the second map has one file per tile
+			other = OsmGpsMap.Map(tile_cache=cache, tile_cache_packed=True)
+			self.assertFalse(other.get_property('tile-cache-packed'))
+			other.destroy()
+			osm.destroy()
+
+	def test_tile_cache_bytes(self):
+		self.assertEqual(self.osm.get_property('tile-cache-bytes'), 64*1024*1024)
+		self.osm.set_property('tile-cache-bytes', 1024*1024)
+		self.assertEqual(self.osm.get_property('tile-cache-bytes'), 1024*1024)
+
+	def test_tile_cache_sync(self):
+		self.assertFalse(self.osm.get_property('tile-cache-sync'))
+		self.osm.set_property('tile-cache-sync', True)
+		self.assertTrue(self.osm.get_property('tile-cache-sync'))
+
+	def test_drag_margin(self):
+		self.assertEqual(self.osm.get_property('drag-margin'), 1)
+		for margin in (0, 1):
+			self.osm = OsmGpsMap.Map(drag_margin=margin, kinetic_scrolling=False)
+			window = self.show()
+			# just beyond the right edge, then dragged into view
+			self.red_image(328, 128)
+			self.osm.map_redraw()
+			self.pointer(Gdk.EventType.BUTTON_PRESS, 200, 128)
+			self.pointer(Gdk.EventType.MOTION_NOTIFY, 0, 128)
+			# shown before anything more is drawn if within the margin
+			self.assertEqual(self.pixel(128, 128) == (255, 0, 0), margin > 0)
+			self.pointer(Gdk.EventType.BUTTON_RELEASE, 0, 128)
+			window.destroy()
+
+	def test_zoom_animation_duration(self):
+		test_window = Gtk.Window()
+		test_window.set_size_request(640, 480)
+		test_window.add(self.osm)
+		test_window.show_all()
+		while Gtk.events_pending():
+			Gtk.main_iteration()
+
+		pt = OsmGpsMap.MapPoint.new_degrees(self.lat+0.01, self.lon+0.01)
+		self.assertEqual(self.osm.get_property('zoom-animation-duration'), 0)
+		self.osm.set_center_and_zoom(self.lat, self.lon, self.zoom+1)
+		expected = self.osm.convert_geographic_to_screen(pt)
+
+		# while the zoom is animated the map already is at the new zoom
+		self.osm.set_zoom(self.zoom)
+		self.osm.set_property('zoom-animation-duration', 10000)
+		self.osm.set_zoom(self.zoom+1)
+		self.assertEqual(self.osm.get_property('zoom'), self.zoom+1)
+		self.assertEqual(self.osm.convert_geographic_to_screen(pt), expected)
+		test_window.destroy()
+
+	def test_kinetic_scrolling(self):
+		self.assertFalse(self.osm.get_property('kinetic-scrolling'))
+		center = OsmGpsMap.MapPoint.new_degrees(self.lat, self.lon)
+		for kinetic in (False, True):
+			self.osm = OsmGpsMap.Map(kinetic_scrolling=kinetic)
+			window = self.show()
+			# flicked to the left and let go
+			self.pointer(Gdk.EventType.BUTTON_PRESS, 200, 128)
+			self.pointer(Gdk.EventType.MOTION_NOTIFY, 100, 128)
+			self.pointer(Gdk.EventType.BUTTON_RELEASE, 100, 128)
+			self.assertEqual(self.osm.convert_geographic_to_screen(center), (28, 128))
+			# only keeps moving if kinetic
+			self.spin_main_loop(0.5)
+			x, y = self.osm.convert_geographic_to_screen(center)
+			self.assertEqual(x < 28, kinetic)
+			self.assertEqual(y, 128)
+			window.destroy()
+
+	def test_download_job(self):
+		pt1 = OsmGpsMap.MapPoint.new_degrees(self.lat+0.1, self.lon)
+		pt2 = OsmGpsMap.MapPoint.new_degrees(self.lat, self.lon+0.1)
+		job = OsmGpsMap.MapDownloadJob.new(pt1, pt2, 10, 12)
+		self.assertEqual(job.get_property('zoom-start'), 10)
+		self.assertEqual(job.get_property('zoom-end'), 12)
+		self.assertTrue(job.get_property('tiles-total') > 0)
+		self.assertFalse(job.is_finished())
+
+		job.pause()
+		self.assertTrue(job.get_property('paused'))
+		job.resume()
+		self.assertFalse(job.get_property('paused'))
+
+		with tempfile.TemporaryDirectory() as tmp:
+			checkpoint = os.path.join(tmp, 'job.ini')
+			self.assertTrue(job.save_checkpoint(checkpoint))
+			job2 = OsmGpsMap.MapDownloadJob.new_from_checkpoint(checkpoint)
+			for prop in ('zoom-start', 'zoom-end', 'tiles-total', 'tiles-done'):
+				self.assertEqual(job2.get_property(prop), job.get_property(prop))
+			self.assertEqual(job2.get_property('checkpoint-file'), checkpoint)
+
+		job.cancel()
+		self.assertTrue(job.is_finished())
+
 if __name__ == "__main__":
 	unittest.main()